@@ -1,7 +1,18 @@
 #pragma once
 
+#include <concepts>
 #include <cstdint>
 
+#include "modm/platform.hpp"
+#include "SampleRing.hpp"
+
+/** An ADC which can take a series of back-to-back conversions of the selected
+ * channel, e.g. StmAdcBurst or SamAdcBurst */
+template<class T>
+concept IBurstAdc = requires(uint16_t *samples) {
+    {T::readBurst(samples, (uint32_t)0)} -> std::convertible_to<void>;
+};
+
 template<
     typename AdcDev,
     typename INT_VOUT,
@@ -27,14 +38,56 @@ struct Analog {
         return AdcDev::getValue();
     }
 
+    /** Take `n` readings of INT_VOUT as quickly as possible
+    setIntVout must be called first
+    */
+    static void readIntVoutBurst(uint16_t *samples, uint32_t n) {
+        if constexpr(IBurstAdc<AdcDev>) {
+            AdcDev::readBurst(samples, n);
+        } else {
+            for(uint32_t i=0; i<n; i++) {
+                samples[i] = readIntVout();
+            }
+        }
+    }
+
     /** Return VHV_FB_P - VHV_FB_N */
     static inline int16_t readVhvDiff() {
-        int16_t p_read, n_read;
         // Disable interrupts because readIntVout may be called in IRQ
         modm::atomic::Lock lck;
+        return readVhvDiffUnlocked();
+    }
+
+    /** Read VHV_FB_P - VHV_FB_N into the background ring
+     *
+     * Called from the drive interrupt, which owns the ADC between its
+     * integrator measurements.
+     */
+    static void sampleVhvDiff() {
+        sVhvDiffRing.push(readVhvDiffUnlocked());
+    }
 
+    /** Mean of the sampleVhvDiff readings since the last call
+     *
+     * Returns false, leaving mean unchanged, if there have been none.
+     */
+    static bool takeVhvDiffMean(float &mean) {
+        int32_t sum;
+        uint32_t n = sVhvDiffRing.takeSum(sum);
+        if(n == 0) {
+            return false;
+        }
+        mean = (float)sum / n;
+        return true;
+    }
+
+private:
+    static inline int16_t readVhvDiffUnlocked() {
+        int16_t p_read, n_read;
         p_read = AdcDev::readChannel(AdcDev::template getPinChannel<VHV_FB_P>());
         n_read = AdcDev::readChannel(AdcDev::template getPinChannel<VHV_FB_N>());
         return p_read - n_read;
     }
+
+    inline static SampleRing<int16_t, 64> sVhvDiffRing;
 };
@@ -27,10 +27,22 @@ ConfigOptionDescriptor AppConfig::optionDescriptors[] = {
     INTOPT(AutoSampleTimeoutId, 35, "Auto Sample Timeout", "Number of sample cycles to wait for current threshold"),
     INTOPT(AutoSampleThresholdId, 50, "Auto sample threshold", "ADC counts; threshold for sample cutoff"),
     INTOPT(AutoSampleHoldoffId, 1000, "Auto sample holdoff", "ns; delay after threshold is reached before ending sampling"),
+    INTOPT(ScanSliceSizeId, 0, "Scan Slice Size", "Number of electrodes to scan per drive cycle; 0 scans all electrodes at once, every Scan Period cycles"),
+    INTOPT(DrivePeriodId, 1000, "Drive Period", "us; duration of each drive pulse, between 200 and 10000; a drive cycle is one negative and one positive pulse"),
+    INTOPT(ScanPeriodId, 500, "Scan Period", "Drive cycles between the starts of full capacitance scans; 0 disables full scans. A sliced scan which takes longer starts again as soon as it completes."),
+    INTOPT(GroupScanPeriodId, 1, "Group Scan Period", "Drive cycles between scan group measurements; 0 disables them"),
+    INTOPT(CapSampleCountId, 1, "Cap Sample Count", "ADC readings of the integrator at the start and end of each capacitance measurement, 1 to 16"),
+    INTOPT(CapSampleReductionId, 0, "Cap Sample Reduction", "How Cap Sample Count readings are combined; 0: mean, 1: mean of medians of 3, 2: mean without min and max"),
+    INTOPT(CapGroupsFilterId, 0, "Cap Groups Filter", "Filter on scan group capacitance sent to the host; 0: none, 1: exponential moving average, 2: moving average, 3: median"),
+    INTOPT(CapGroupsFilterLengthId, 4, "Cap Groups Filter Length", "Number of group scans spanned by the Cap Groups Filter, 1 to 8"),
+    BOOLOPT(PacedScanTxId, 0, "Paced Scan Transmit", "Send full scans as BulkCapacitanceMsg chunks spread over 100ms, instead of a single CapScanMsg when each scan completes"),
     BOOLOPT(InvertedOptoId, 0, "Inverting Optoisolators", "Invert all opto-isolator IOs to support alternative parts; Enable only if you know for sure what you're doing!"),
     FLTOPT(FeedbackGainPId, 0.0, "Feedback KP", "Proportional gain for feedback drop control"),
     FLTOPT(FeedbackGainIId, 0.0, "Feedback KI", "Integral gain for feedback drop control"),
-    FLTOPT(FeedbackGainDId, 0.0, "Feedback KD", "Differential gain for feedback drop control")
+    FLTOPT(FeedbackGainDId, 0.0, "Feedback KD", "Differential gain for feedback drop control"),
+    BOOLOPT(FeedbackInIrqId, 0, "Feedback In IRQ", "Run the feedback controller in the drive interrupt right after each group scan, so that new duty cycles apply from the next pulse"),
+    INTOPT(FeedbackFilterId, 0, "Feedback Filter", "Filter on scan group capacitance input to the feedback controller; 0: none, 1: exponential moving average, 2: moving average, 3: median"),
+    INTOPT(FeedbackFilterLengthId, 4, "Feedback Filter Length", "Number of group scans spanned by the Feedback Filter, 1 to 8")
 };
 
 const uint32_t AppConfig::N_OPT_DESCRIPTOR = sizeof(AppConfig::optionDescriptors) / sizeof(AppConfig::optionDescriptors[0]);
@@ -3,6 +3,19 @@
 
 #include "EventEx.hpp"
 
+// Number of daisy-chained HV507s on the board, each driving 64 electrodes;
+// set by the board build
+#ifndef PURPLEDROP_N_HV507
+#define PURPLEDROP_N_HV507 2
+#endif
+
+// Opto-isolator polarity on the HV507 control lines. -1 selects it at runtime
+// with the Inverting Optoisolators parameter; a board with a fixed part can
+// set 0 (non-inverting) or 1 (inverting) to remove the runtime checks.
+#ifndef PURPLEDROP_INVERTED_OPTO
+#define PURPLEDROP_INVERTED_OPTO -1
+#endif
+
 // Enum for option IDs, to ensure uniqueness
 enum ConfigOptionIds : uint8_t {
     TargetVoltageId = 0,
@@ -26,10 +39,22 @@ enum ConfigOptionIds : uint8_t {
     AutoSampleTimeoutId = 34,
     AutoSampleThresholdId = 35,
     AutoSampleHoldoffId = 36,
+    ScanSliceSizeId = 37,
+    PacedScanTxId = 38,
+    DrivePeriodId = 39,
+    ScanPeriodId = 40,
+    GroupScanPeriodId = 41,
+    CapSampleCountId = 42,
+    CapSampleReductionId = 43,
+    CapGroupsFilterId = 44,
+    CapGroupsFilterLengthId = 45,
     InvertedOptoId = 75,
     FeedbackGainPId = 100,
     FeedbackGainIId = 101,
-    FeedbackGainDId = 102
+    FeedbackGainDId = 102,
+    FeedbackInIrqId = 103,
+    FeedbackFilterId = 104,
+    FeedbackFilterLengthId = 105
 };
 
 union ConfigOptionValue {
@@ -79,10 +104,43 @@ struct AppConfig {
     static inline int32_t AutoSampleTimeout() { return optionValues[AutoSampleTimeoutId].i32; }
     static inline float AutoSampleThreshold() { return optionValues[AutoSampleThresholdId].f32; }
 
-    static inline bool InvertedOpto() { return optionValues[InvertedOptoId].i32 != 0; }
+    // Number of electrodes measured per drive cycle for a sliced scan; 0 means
+    // the whole array is scanned in one cycle, every ScanPeriod cycles
+    static inline uint32_t ScanSliceSize() { return optionValues[ScanSliceSizeId].i32; }
+    // Send full scans in small chunks spread over time, rather than in one
+    // message as soon as they complete
+    static inline bool PacedScanTx() { return (bool)optionValues[PacedScanTxId].i32; }
+    // Duration of each drive pulse in us; a drive cycle is a negative and a
+    // positive pulse
+    static inline uint32_t DrivePeriod() { return optionValues[DrivePeriodId].i32; }
+    // Drive cycles between the starts of full capacitance scans, sliced or
+    // not; 0 disables full scans
+    static inline uint32_t ScanPeriod() { return optionValues[ScanPeriodId].i32; }
+    // Drive cycles between scan group measurements; 0 disables them
+    static inline uint32_t GroupScanPeriod() { return optionValues[GroupScanPeriodId].i32; }
+    // ADC readings taken of the integrator at the start and end of each
+    // capacitance measurement
+    static inline uint32_t CapSampleCount() { return optionValues[CapSampleCountId].i32; }
+    // How those readings are combined; a SampleReduction value
+    static inline uint32_t CapSampleReduction() { return optionValues[CapSampleReductionId].i32; }
+    static inline uint32_t CapGroupsFilter() { return optionValues[CapGroupsFilterId].i32; }
+    static inline uint32_t CapGroupsFilterLength() { return optionValues[CapGroupsFilterLengthId].i32; }
+
+    // True when the opto-isolator polarity is fixed by the build, in which
+    // case the parameter is ignored
+    static constexpr bool INVERTED_OPTO_FIXED = PURPLEDROP_INVERTED_OPTO >= 0;
+    static inline bool InvertedOpto() {
+        if constexpr(INVERTED_OPTO_FIXED) {
+            return PURPLEDROP_INVERTED_OPTO > 0;
+        }
+        return optionValues[InvertedOptoId].i32 != 0;
+    }
     static inline float FeedbackKp() { return optionValues[FeedbackGainPId].f32; }
     static inline float FeedbackKi() { return optionValues[FeedbackGainIId].f32; }
     static inline float FeedbackKd() { return optionValues[FeedbackGainDId].f32; }
+    static inline bool FeedbackInIrq() { return (bool)optionValues[FeedbackInIrqId].i32; }
+    static inline uint32_t FeedbackFilter() { return optionValues[FeedbackFilterId].i32; }
+    static inline uint32_t FeedbackFilterLength() { return optionValues[FeedbackFilterLengthId].i32; }
 
     // Number of options defined in options
     static const uint32_t N_OPT_DESCRIPTOR;
@@ -92,13 +150,29 @@ struct AppConfig {
     // Trade some memory for access speed
     static ConfigOptionValue optionValues[MAX_OPT_ID];
 
-    static const uint32_t N_HV507 = 2;
+    static const uint32_t N_HV507 = PURPLEDROP_N_HV507;
     static const uint32_t N_PINS = N_HV507 * 64;
     static const uint32_t N_BYTES = N_HV507 * 8;
+    // Limited by the size of message frames, e.g. a CapScanMsg must fit in
+    // the USB transmit buffer
+    static_assert(N_HV507 >= 1 && N_HV507 <= 8, "PURPLEDROP_N_HV507 must be between 1 and 8");
+    static_assert(PURPLEDROP_INVERTED_OPTO >= -1 && PURPLEDROP_INVERTED_OPTO <= 1, "PURPLEDROP_INVERTED_OPTO must be -1, 0 or 1");
 
     static const uint32_t N_TEMP_SENSOR = 4;
     static const uint32_t TEMP_READ_PERIOD = 250000; // us
 
-    static const uint32_t N_CAP_GROUPS = 5;
+    // Number of capacitance scan groups; only active groups are measured
+    static const uint32_t N_CAP_GROUPS = 32;
+
+    // Number of electrode groups which can be driven at once, each with its
+    // own duty cycle
+    static const uint32_t N_DRIVE_GROUPS = 8;
+
+    // Number of capacitance feedback loops which can run at once, each
+    // driving its own pair of drive groups
+    static const uint32_t N_FEEDBACK_LOOPS = 4;
+
+    // Maximum number of steps in an on-device electrode sequence
+    static const uint32_t N_SEQUENCE_STEPS = 64;
 };
 
@@ -18,7 +18,7 @@ struct AppConfigController {
         load();
 
         // Register for relevant system events
-        mSetParameterHandler.setFunction([this](auto e) { HandleSetParameter(e); } );
+        mSetParameterHandler.setFunction([this](auto &e) { HandleSetParameter(e); } );
         mBroker->registerHandler(&mSetParameterHandler);
     }
 
@@ -1,11 +1,130 @@
 #include "version.hpp"
 
+#include <algorithm>
+#include <tusb.h>
+
 #include "Comms.hpp"
 #include "MessageFramer.hpp"
 #include "Messages.hpp"
 
 using namespace events;
 
+static_assert(TusbTx::REPLY_RESERVE <= TusbTx::REPLY_BACKLOG_SIZE);
+// A telemetry frame too large for its slot would be dropped every time
+static_assert(maxFrameSize(ActiveCapacitanceMsg::MAX_PAYLOAD_SIZE) <= TusbTx::TELEMETRY_FRAME_SIZE);
+static_assert(maxFrameSize(HvRegulatorMsg::MAX_PAYLOAD_SIZE) <= TusbTx::TELEMETRY_FRAME_SIZE);
+static_assert(maxFrameSize(TemperatureMsg::MAX_PAYLOAD_SIZE) <= TusbTx::TELEMETRY_FRAME_SIZE);
+static_assert(maxFrameSize(DutyCycleUpdatedMsg::MAX_PAYLOAD_SIZE) <= TusbTx::TELEMETRY_FRAME_SIZE);
+static_assert(maxFrameSize(SequenceStatusMsg::MAX_PAYLOAD_SIZE) <= TusbTx::TELEMETRY_FRAME_SIZE);
+static_assert(maxFrameSize(TxDropCountMsg::MAX_PAYLOAD_SIZE) <= TusbTx::TELEMETRY_FRAME_SIZE);
+
+// Write a frame to the USB FIFO if all of it fits
+static bool writeUsb(const uint8_t *frame, uint32_t length) {
+    if(tud_cdc_write_available() < length) {
+        return false;
+    }
+    tud_cdc_write(frame, length);
+    tud_cdc_write_flush();
+    return true;
+}
+
+TusbTx::TusbTx() : mBacklogHead(0), mBacklogCount(0) {
+    for(auto &t : mTelemetry) {
+        t.length = 0;
+        t.pending = false;
+    }
+    for(auto &count : mDropCount) {
+        count = 0;
+    }
+}
+
+bool TusbTx::write(TxClass txClass, uint8_t slot, const uint8_t *frame, uint32_t length) {
+    flush();
+    bool accepted = false;
+    switch(txClass) {
+        case TxClass::Reply:
+            if(!replyPending() && writeUsb(frame, length)) {
+                accepted = true;
+            } else {
+                accepted = appendBacklog(frame, length);
+            }
+            break;
+        case TxClass::Telemetry:
+            if(slot < N_TELEMETRY_SLOTS && length <= TELEMETRY_FRAME_SIZE) {
+                TelemetryFrame &t = mTelemetry[slot];
+                if(t.pending) {
+                    // Superseded before it could be sent
+                    mDropCount[(uint8_t)txClass]++;
+                }
+                memcpy(t.data, frame, length);
+                t.length = length;
+                t.pending = true;
+                flush();
+                return true;
+            }
+            break;
+        case TxClass::Bulk:
+            accepted = !replyPending();
+            for(auto &t : mTelemetry) {
+                if(t.pending) {
+                    accepted = false;
+                }
+            }
+            accepted = accepted && writeUsb(frame, length);
+            break;
+    }
+    if(!accepted) {
+        mDropCount[(uint8_t)txClass]++;
+    }
+    return accepted;
+}
+
+void TusbTx::flush() {
+    drainBacklog();
+    if(replyPending()) {
+        return;
+    }
+    for(auto &t : mTelemetry) {
+        if(t.pending && writeUsb(t.data, t.length)) {
+            t.pending = false;
+        }
+    }
+}
+
+bool TusbTx::appendBacklog(const uint8_t *frame, uint32_t length) {
+    if(mBacklogCount + length > REPLY_BACKLOG_SIZE) {
+        return false;
+    }
+    uint32_t tail = (mBacklogHead + mBacklogCount) % REPLY_BACKLOG_SIZE;
+    for(uint32_t i=0; i<length; i++) {
+        mBacklog[tail] = frame[i];
+        tail = (tail + 1) % REPLY_BACKLOG_SIZE;
+    }
+    mBacklogCount += length;
+    return true;
+}
+
+void TusbTx::drainBacklog() {
+    if(mBacklogCount == 0) {
+        return;
+    }
+    // Frames in the backlog are contiguous and nothing else is sent until
+    // it is empty, so it can be written out in any size pieces
+    while(mBacklogCount > 0) {
+        uint32_t n = mBacklogCount;
+        if(mBacklogHead + n > REPLY_BACKLOG_SIZE) {
+            n = REPLY_BACKLOG_SIZE - mBacklogHead;
+        }
+        n = tud_cdc_write(&mBacklog[mBacklogHead], n);
+        if(n == 0) {
+            break;
+        }
+        mBacklogHead = (mBacklogHead + n) % REPLY_BACKLOG_SIZE;
+        mBacklogCount -= n;
+    }
+    tud_cdc_write_flush();
+}
+
 void Comms::init(
         EventBroker *broker
 ) {
@@ -27,17 +146,25 @@ void Comms::init(
     mBroker->registerHandler(&mHvRegulatorUpdateHandler);
     mDutyCycleUpdatedHandler.setFunction([this](auto &e){ HandleDutyCycleUdpated(e); });
     mBroker->registerHandler(&mDutyCycleUpdatedHandler);
+    mSequenceProgressHandler.setFunction([this](auto &e){ HandleSequenceProgress(e); });
+    mBroker->registerHandler(&mSequenceProgressHandler);
+    mHandoffCompleteHandler.setFunction([this](auto &e){ HandleHandoffComplete(e); });
+    mBroker->registerHandler(&mHandoffCompleteHandler);
 }
 
 void Comms::poll() {
     uint8_t *msgBuf;
     uint16_t msgLen;
     uint8_t readByte;
-    while(modm::platform::UsbUart0::read(readByte)) {
+    mTx.flush();
+    // Leave commands in the USB receive FIFO, holding off the host, while
+    // their replies might not fit in the backlog
+    while(mTx.replyRoom() && modm::platform::UsbUart0::read(readByte)) {
         if(mFramer.push(readByte, msgBuf, msgLen)) {
             ProcessMessage(msgBuf, msgLen);
         }
     }
+    mTx.flush();
     PeriodicSend();
 }
 
@@ -50,7 +177,6 @@ void Comms::ProcessMessage(uint8_t *buf, uint16_t len) {
         case CalibrateCommandMsg::ID:
             {
                 CalibrateCommandMsg msg(buf, len);
-                Serializer ser(&mTxQueue);
                 if(msg.command == CalibrateCommandMsg::CommandType::CapacitanceOffset) {
                     events::CapOffsetCalibrationRequest event;
                     mBroker->publish(event);
@@ -71,6 +197,13 @@ void Comms::ProcessMessage(uint8_t *buf, uint16_t len) {
                     event.data = msg.data;
                     mBroker->publish(event);
                     SendAck(DataBlobMsg::ID);
+                } else if(msg.blob_id == DataBlobId::ElectrodeSequence) {
+                    events::UpdateElectrodeSequence event;
+                    event.offset = msg.chunk_index;
+                    event.length = msg.payload_size;
+                    event.data = msg.data;
+                    mBroker->publish(event);
+                    SendAck(DataBlobMsg::ID);
                 }
             }
             break;
@@ -98,6 +231,26 @@ void Comms::ProcessMessage(uint8_t *buf, uint16_t len) {
                 mBroker->publish(event);
             }
             break;
+        case FeedbackLoopMsg::ID:
+            {
+                FeedbackLoopMsg msg(buf, len);
+                events::FeedbackCommand event;
+                event.loop = msg.loop;
+                event.target = msg.target;
+                event.mode = msg.mode;
+                event.measureGroupsPMask = msg.measureGroupsPMask;
+                event.measureGroupsNMask = msg.measureGroupsNMask;
+                event.baseline = msg.baseline;
+                event.driveGroupA = msg.driveGroupA;
+                event.driveGroupB = msg.driveGroupB;
+                event.parameterGains = (bool)(msg.flags & FeedbackLoopMsg::ParameterGainsFlag);
+                event.kp = msg.kp;
+                event.ki = msg.ki;
+                event.kd = msg.kd;
+                mBroker->publish(event);
+                SendAck(FeedbackLoopMsg::ID);
+            }
+            break;
         case GpioControlMsg::ID:
             {
                 GpioControlMsg msg(buf, len);
@@ -108,7 +261,7 @@ void Comms::ProcessMessage(uint8_t *buf, uint16_t len) {
                 event.write = !(bool)(msg.flags & GpioControlMsg::ReadFlag);
                 event.callback = [this](uint8_t pin, bool value) {
                     GpioControlMsg resp;
-                    Serializer ser(&mTxQueue);
+                    Serializer ser(&mReplySink);
                     resp.pin = pin;
                     resp.flags = 0;
                     if(value) {
@@ -120,6 +273,21 @@ void Comms::ProcessMessage(uint8_t *buf, uint16_t len) {
                 mBroker->publish(event);
             }
             break;
+        case HandoffMsg::ID:
+            {
+                HandoffMsg msg(buf, len);
+                events::QueueHandoff event;
+                event.groupID = msg.groupID;
+                event.setting = msg.setting;
+                memcpy(event.values, msg.values, AppConfig::N_BYTES);
+                event.scanGroup = msg.scanGroup;
+                event.below = (bool)(msg.flags & HandoffMsg::BelowFlag);
+                event.threshold = msg.threshold;
+                event.timeoutCycles = msg.timeoutCycles;
+                mBroker->publish(event);
+                SendAck(HandoffMsg::ID);
+            }
+            break;
         case ParameterDescriptorMsg::ID:
             // Kick off transmission of all parameter descriptors
             mParamaterDescriptorTxPos = 0;
@@ -134,7 +302,7 @@ void Comms::ProcessMessage(uint8_t *buf, uint16_t len) {
                 event.writeFlag = msg.writeFlag;
                 event.callback = [this](const uint32_t &idx, const ConfigOptionValue &value) {
                     ParameterMsg msg;
-                    Serializer ser(&mTxQueue);
+                    Serializer ser(&mReplySink);
                     msg.paramIdx = idx;
                     msg.paramValue.i32 = value.i32;
                     msg.writeFlag = 0;
@@ -144,11 +312,31 @@ void Comms::ProcessMessage(uint8_t *buf, uint16_t len) {
                 mBroker->publish(event);
             }
             break;
+        case ScanMaskMsg::ID:
+            {
+                ScanMaskMsg msg(buf, len);
+                events::SetScanMask event;
+                for(uint32_t i=0; i<AppConfig::N_BYTES; i++) {
+                    event.values[i] = msg.values[i];
+                }
+                mBroker->publish(event);
+                SendAck(ScanMaskMsg::ID);
+            }
+            break;
+        case SequenceControlMsg::ID:
+            {
+                SequenceControlMsg msg(buf, len);
+                events::SequenceControl event;
+                event.start = msg.command == SequenceControlMsg::Start;
+                event.stepCount = msg.stepCount;
+                mBroker->publish(event);
+                SendAck(SequenceControlMsg::ID);
+            }
+            break;
         case SetGainMsg::ID:
             {
                 SetGainMsg msg;
                 events::SetGain event;
-                Serializer ser(&mTxQueue);
                 msg.fill(buf, len);
                 for(uint32_t i=0; i<msg.count; i++) {
                     event.set_channel(i, msg.get_channel(i));
@@ -161,7 +349,6 @@ void Comms::ProcessMessage(uint8_t *buf, uint16_t len) {
             {
                 SetPwmMsg msg;
                 events::SetPwm event;
-                Serializer ser(&mTxQueue);
                 msg.fill(buf, len);
                 event.channel = msg.channel;
                 event.duty_cycle = msg.duty_cycle;
@@ -174,7 +361,7 @@ void Comms::ProcessMessage(uint8_t *buf, uint16_t len) {
 
 void Comms::HandleCapActive(CapActive &e) {
     ActiveCapacitanceMsg msg;
-    Serializer ser(&mTxQueue);
+    Serializer ser(&mActiveCapacitanceSink);
     msg.baseline = e.baseline;
     msg.measurement = e.measurement;
     msg.settings = e.settings;
@@ -183,34 +370,53 @@ void Comms::HandleCapActive(CapActive &e) {
 }
 
 void Comms::HandleCapScan(CapScan &e) {
-    // Capacitance scan data is large, and is sent out in chunks to prevent
-    // blocking the communications channel for too long
-    // This is a hold-over from when this was done on a slower serial port,
-    // and is probably less of an issue with USB but it's more flexible this
-    // way.
-    for(uint32_t i=0; i<AppConfig::N_PINS; i++) {
-        mCapScanData[i] = e.measurements[i];
+    mCapScanBuffer = e.buffer;
+    if(AppConfig::PacedScanTx()) {
+        // Send the scan out in chunks to prevent blocking the communications
+        // channel for too long. This is a hold-over from when this was done
+        // on a slower serial port.
+        // The latest scan is acquired from the buffer when the next
+        // transmission starts, and stays unchanged until it is finished.
+        mCapScanDataDirty = true;
+    } else {
+        // Abandon any paced transmission, as acquiring a new frame releases
+        // the one it was sending from
+        mCapScanTxPos = AppConfig::N_PINS;
+        mCapScanDataDirty = false;
+
+        // Values go straight from the frame into the USB frame buffer
+        auto &frame = mCapScanBuffer->acquire();
+        Serializer ser(&mBulkSink);
+        CapScanMsg::serialize(ser, frame.sequence, frame.timestamp, 0, AppConfig::N_PINS, frame.values);
     }
-    mCapScanDataDirty = true;
 }
 
 void Comms::HandleCapGroups(CapGroups &e) {
-    BulkCapacitanceMsg msg;
-    Serializer ser(&mTxQueue);
-    msg.groupScan = 1;
-    msg.count = e.measurements.size();
-    msg.startIndex = 0;
-    for(uint32_t i=0; i<e.measurements.size() && i<msg.MAX_VALUES; i++) {
-        msg.values[i] = e.measurements[i];
+    mGroupFilter.configure((InputFilterType)AppConfig::CapGroupsFilter(), AppConfig::CapGroupsFilterLength());
+    std::array<uint16_t, AppConfig::N_CAP_GROUPS> values;
+    for(uint32_t i=0; i<e.count; i++) {
+        values[i] = mGroupFilter.push(i, e.measurements[i], e.settings[i]);
+    }
+
+    // Groups past the last active one are left out, and the rest are sent in
+    // as many messages as needed
+    for(uint32_t start=0; start<e.count; start+=BulkCapacitanceMsg::MAX_VALUES) {
+        BulkCapacitanceMsg msg;
+        Serializer ser(&mBulkSink);
+        msg.groupScan = 1;
+        msg.startIndex = start;
+        msg.count = std::min<uint32_t>(e.count - start, BulkCapacitanceMsg::MAX_VALUES);
+        for(uint32_t i=0; i<msg.count; i++) {
+            msg.values[i] = values[start + i];
+        }
+        msg.serialize(ser);
     }
-    msg.serialize(ser);
-    //mFlush();
 }
 
 void Comms::HandleElectrodesUpdated(ElectrodesUpdated &e) {
     (void)e;
     CommandAckMsg msg;
-    Serializer ser(&mTxQueue);
+    Serializer ser(&mReplySink);
     msg.acked_id = ElectrodeEnableMsg::ID;
     msg.serialize(ser);
     //mFlush();
@@ -221,7 +427,7 @@ void Comms::HandleHvRegulatorUpdate(HvRegulatorUpdate &e) {
     if(mHvUpdateCounter >= HvMessageDivider) {
         mHvUpdateCounter = 0;
         HvRegulatorMsg msg;
-        Serializer ser(&mTxQueue);
+        Serializer ser(&mHvRegulatorSink);
         msg.voltage = e.voltage;
         msg.vTargetOut = e.vTargetOut;
         msg.serialize(ser);
@@ -231,7 +437,7 @@ void Comms::HandleHvRegulatorUpdate(HvRegulatorUpdate &e) {
 
 void Comms::HandleTemperatureMeasurement(TemperatureMeasurement &e) {
     TemperatureMsg msg;
-    Serializer ser(&mTxQueue);
+    Serializer ser(&mTemperatureSink);
     msg.count = AppConfig::N_TEMP_SENSOR;
     for(uint32_t i=0; i<AppConfig::N_TEMP_SENSOR; i++) {
         msg.temps[i] = e.measurements[i];
@@ -242,30 +448,52 @@ void Comms::HandleTemperatureMeasurement(TemperatureMeasurement &e) {
 
 void Comms::HandleDutyCycleUdpated(DutyCycleUpdated &e) {
     DutyCycleUpdatedMsg msg;
-    Serializer ser(&mTxQueue);
+    Serializer ser(&mDutyCycleSink);
     msg.dutyCycleA = e.dutyCycleA;
     msg.dutyCycleB = e.dutyCycleB;
     msg.serialize(ser);
     //mFlush();
 }
 
+void Comms::HandleSequenceProgress(SequenceProgress &e) {
+    SequenceStatusMsg msg;
+    Serializer ser(&mSequenceStatusSink);
+    msg.running = e.running;
+    msg.step = e.step;
+    msg.stepCount = e.stepCount;
+    msg.timestamp = e.timestamp;
+    msg.serialize(ser);
+}
+
+void Comms::HandleHandoffComplete(HandoffComplete &e) {
+    HandoffStatusMsg msg;
+    Serializer ser(&mReplySink);
+    msg.arrived = e.arrived;
+    msg.groupValue = e.groupValue;
+    msg.cycles = e.cycles;
+    msg.timestamp = e.timestamp;
+    msg.serialize(ser);
+}
+
 void Comms::PeriodicSend() {
     if(mCapScanTimer.poll()) {
         if((mCapScanTxPos >= AppConfig::N_PINS) && mCapScanDataDirty) {
             mCapScanDataDirty = false;
+            mCapScanFrame = &mCapScanBuffer->acquire();
             mCapScanTxPos = 0;
         }
         if(mCapScanTxPos < AppConfig::N_PINS) {
             BulkCapacitanceMsg msg;
-            Serializer ser(&mTxQueue);
+            Serializer ser(&mBulkSink);
             msg.groupScan = 0;
             msg.startIndex = mCapScanTxPos;
+            msg.sequence = mCapScanFrame->sequence;
             msg.count = AppConfig::N_PINS - mCapScanTxPos;
             if(msg.count > CapScanMsgSize) {
                 msg.count = CapScanMsgSize;
             }
             for(uint32_t i=0; i<msg.count; i++) {
-                msg.values[i] = mCapScanData[i + msg.startIndex];
+                msg.values[i] = mCapScanFrame->values[i + msg.startIndex];
             }
             mCapScanTxPos += msg.count;
             msg.serialize(ser);
@@ -273,10 +501,12 @@ void Comms::PeriodicSend() {
         }
     }
 
-    if(mParameterTxTimer.poll() && mParamaterDescriptorTxPos < AppConfig::N_OPT_DESCRIPTOR) {
+    // Descriptors are replies, but are sent only once earlier replies are
+    // out so that they cannot fill the backlog
+    if(mParameterTxTimer.poll() && mParamaterDescriptorTxPos < AppConfig::N_OPT_DESCRIPTOR && !mTx.replyPending()) {
         ParameterDescriptorMsg msg;
         ConfigOptionDescriptor *desc = &AppConfig::optionDescriptors[mParamaterDescriptorTxPos];
-        Serializer ser(&mTxQueue);
+        Serializer ser(&mReplySink);
         msg.param_id = desc->id;
         memcpy(msg.defaultValue, &desc->defaultValue, sizeof(msg.defaultValue));
         msg.sequence_number = mParamaterDescriptorTxPos;
@@ -288,6 +518,14 @@ void Comms::PeriodicSend() {
         //mFlush();
         mParamaterDescriptorTxPos++;
     }
+
+    if(mTxDropCountTimer.poll()) {
+        uint32_t counts[TxDropCountMsg::N_COUNTS];
+        readDropCounts(counts);
+        if(memcmp(counts, mReportedDropCount, sizeof(counts)) != 0) {
+            SendTxDropCount();
+        }
+    }
 }
 
 void Comms::SendBlob(uint8_t blob_id, const uint8_t *buf, uint32_t size) {
@@ -296,7 +534,7 @@ void Comms::SendBlob(uint8_t blob_id, const uint8_t *buf, uint32_t size) {
     // needs to chunk them up, and queue for transmission over time.
 
     DataBlobMsg msg;
-    Serializer ser(&mTxQueue);
+    Serializer ser(&mReplySink);
     msg.blob_id = blob_id;
     msg.chunk_index = 0;
     msg.payload_size = size;
@@ -307,8 +545,25 @@ void Comms::SendBlob(uint8_t blob_id, const uint8_t *buf, uint32_t size) {
 
 void Comms::SendAck(uint8_t acked_id) {
     CommandAckMsg ack;
-    Serializer ser(&mTxQueue);
+    Serializer ser(&mReplySink);
     ack.acked_id = acked_id;
     ack.serialize(ser);
     //mFlush();
-}
\ No newline at end of file
+}
+
+void Comms::readDropCounts(uint32_t *counts) {
+    // One count for each transmit class, then the deferred event queue
+    static_assert(TxDropCountMsg::N_COUNTS == N_TX_CLASSES + 1);
+    for(uint32_t i=0; i<N_TX_CLASSES; i++) {
+        counts[i] = mTx.dropCount((TxClass)i);
+    }
+    counts[N_TX_CLASSES] = mBroker->deferredOverflowCount();
+}
+
+void Comms::SendTxDropCount() {
+    TxDropCountMsg msg;
+    Serializer ser(&mTxDropCountSink);
+    readDropCounts(msg.counts);
+    memcpy(mReportedDropCount, msg.counts, sizeof(mReportedDropCount));
+    msg.serialize(ser);
+}
@@ -3,6 +3,7 @@
 #include "CircularBuffer.hpp"
 #include "EventEx.hpp"
 #include "Events.hpp"
+#include "InputFilter.hpp"
 #include "Messages.hpp"
 #include "PeriodicPollingTimer.hpp"
 
@@ -10,10 +11,115 @@
 
 using namespace EventEx;
 
-struct TusbTxSink : IProducer<uint8_t> {
-    bool push(uint8_t b) {
-        return modm::platform::UsbUart0::write(b);
-    }
+/** Priority classes for messages sent to the host */
+enum class TxClass : uint8_t {
+    // Acks and replies to host requests; never dropped, as commands are not
+    // read while there may not be room for their replies
+    Reply = 0,
+    // Periodic measurements; only the latest of each kind is kept
+    Telemetry = 1,
+    // Capacitance scans; dropped if there is no room for them
+    Bulk = 2,
+};
+
+static const uint32_t N_TX_CLASSES = 3;
+
+/** Kinds of telemetry, each of which has a slot for its latest frame */
+enum TelemetrySlot : uint8_t {
+    ActiveCapacitanceSlot = 0,
+    HvRegulatorSlot,
+    TemperatureSlot,
+    DutyCycleSlot,
+    SequenceStatusSlot,
+    TxDropCountSlot,
+    N_TELEMETRY_SLOTS
+};
+
+/** Largest frame for a payload: the start byte, with every payload and
+ * checksum byte escaped */
+constexpr uint32_t maxFrameSize(uint32_t payloadSize) {
+    return 1 + 2 * (payloadSize + 2);
+}
+
+/** Prioritized transmission of complete frames to the USB CDC interface
+ *
+ * Frames are built in a buffer large enough for the biggest message, and are
+ * written to the USB transmit FIFO whole, or not at all.
+ *
+ * Replies which do not fit are held in a backlog, and are sent ahead of
+ * anything else as room becomes available. Comms reads no more commands
+ * while the backlog has less than REPLY_RESERVE free, so the host is held
+ * off rather than a reply dropped. Telemetry is held in one slot per
+ * kind of message; a new frame replaces one which has not been sent yet,
+ * and the replaced frame counts as dropped. Bulk frames are sent only if
+ * nothing else is waiting and they fit; otherwise they are dropped.
+ */
+struct TusbTx {
+    static const uint32_t FRAME_BUFFER_SIZE = maxFrameSize(CapScanMsg::HEADER_SIZE + 2 * CapScanMsg::MAX_VALUES);
+    static const uint32_t REPLY_BACKLOG_SIZE = 1024;
+    // Room for the largest reply to a command, a data blob, and for the acks
+    // which follow it from the drive interrupt. Each of those is sent at most
+    // once per electrode update or hand-off.
+    static const uint32_t REPLY_RESERVE =
+        maxFrameSize(DataBlobMsg::MAX_PAYLOAD_SIZE) +
+        maxFrameSize(CommandAckMsg::MAX_PAYLOAD_SIZE) +
+        maxFrameSize(HandoffStatusMsg::MAX_PAYLOAD_SIZE);
+    static const uint32_t TELEMETRY_FRAME_SIZE = 40;
+
+    /** Sink for one priority class, or for one telemetry slot */
+    struct Sink : FrameSink {
+        Sink(TusbTx *tx, TxClass txClass, uint8_t slot = 0) :
+            FrameSink(tx->mFrameBuffer, FRAME_BUFFER_SIZE),
+            mTx(tx),
+            mClass(txClass),
+            mSlot(slot)
+        {}
+
+        bool writeFrame(const uint8_t *frame, uint32_t length) override {
+            return mTx->write(mClass, mSlot, frame, length);
+        }
+
+    private:
+        TusbTx *mTx;
+        TxClass mClass;
+        uint8_t mSlot;
+    };
+
+    TusbTx();
+
+    /** Send a frame, or hold it according to its class
+     *
+     * Returns false if the frame was dropped.
+     */
+    bool write(TxClass txClass, uint8_t slot, const uint8_t *frame, uint32_t length);
+
+    /** Send held replies and telemetry as room becomes available */
+    void flush();
+
+    /** True if there are replies waiting to be sent */
+    bool replyPending() { return mBacklogCount > 0; }
+
+    /** True if the backlog can take the replies to another command */
+    bool replyRoom() { return REPLY_BACKLOG_SIZE - mBacklogCount >= REPLY_RESERVE; }
+
+    uint32_t dropCount(TxClass txClass) { return mDropCount[(uint8_t)txClass]; }
+
+private:
+    struct TelemetryFrame {
+        uint8_t data[TELEMETRY_FRAME_SIZE];
+        uint8_t length;
+        bool pending;
+    };
+
+    bool appendBacklog(const uint8_t *frame, uint32_t length);
+    void drainBacklog();
+
+    uint8_t mFrameBuffer[FRAME_BUFFER_SIZE];
+    uint8_t mBacklog[REPLY_BACKLOG_SIZE];
+    uint32_t mBacklogHead;
+    uint32_t mBacklogCount;
+    TelemetryFrame mTelemetry[N_TELEMETRY_SLOTS];
+    uint32_t mDropCount[N_TX_CLASSES];
 };
 
 /* Application messaging interface
@@ -24,9 +130,26 @@ struct Comms {
 
     Comms() :
         mCapScanTimer(CapScanTxPeriod * CapScanMsgSize / AppConfig::N_PINS),
-        mParameterTxTimer(ParameterTxPeriod)
-
-    {}
+        mParameterTxTimer(ParameterTxPeriod),
+        mCapScanBuffer(nullptr),
+        mCapScanFrame(nullptr),
+        mCapScanTxPos(AppConfig::N_PINS),
+        mCapScanDataDirty(false),
+        mHvUpdateCounter(0),
+        mTxDropCountTimer(TxDropCountPeriod),
+        mReplySink(&mTx, TxClass::Reply),
+        mBulkSink(&mTx, TxClass::Bulk),
+        mActiveCapacitanceSink(&mTx, TxClass::Telemetry, ActiveCapacitanceSlot),
+        mHvRegulatorSink(&mTx, TxClass::Telemetry, HvRegulatorSlot),
+        mTemperatureSink(&mTx, TxClass::Telemetry, TemperatureSlot),
+        mDutyCycleSink(&mTx, TxClass::Telemetry, DutyCycleSlot),
+        mSequenceStatusSink(&mTx, TxClass::Telemetry, SequenceStatusSlot),
+        mTxDropCountSink(&mTx, TxClass::Telemetry, TxDropCountSlot)
+    {
+        for(auto &count : mReportedDropCount) {
+            count = 0;
+        }
+    }
 
     void init(
         EventBroker *broker
@@ -37,14 +160,16 @@ struct Comms {
 
 private:
     EventBroker *mBroker;
-    TusbTxSink mTxQueue;
+    TusbTx mTx;
 
 
     MessageFramer<Messages> mFramer;
 
     PeriodicPollingTimer mCapScanTimer;
     PeriodicPollingTimer mParameterTxTimer;
-    uint16_t mCapScanData[AppConfig::N_PINS];
+    ScanBuffer<AppConfig::N_PINS> *mCapScanBuffer;
+    // Scan being transmitted; held until the next one is acquired
+    const ScanFrame<AppConfig::N_PINS> *mCapScanFrame;
     uint32_t mCapScanTxPos;
     bool mCapScanDataDirty;
     static const uint32_t CapScanMsgSize = 8;
@@ -56,6 +181,20 @@ private:
     uint16_t mHvUpdateCounter;
     static const uint16_t HvMessageDivider = 10;
 
+    // Drop counts are sent when they change, at most once per period
+    PeriodicPollingTimer mTxDropCountTimer;
+    uint32_t mReportedDropCount[TxDropCountMsg::N_COUNTS];
+    static const uint32_t TxDropCountPeriod = 1000000; // us
+
+    TusbTx::Sink mReplySink;
+    TusbTx::Sink mBulkSink;
+    TusbTx::Sink mActiveCapacitanceSink;
+    TusbTx::Sink mHvRegulatorSink;
+    TusbTx::Sink mTemperatureSink;
+    TusbTx::Sink mDutyCycleSink;
+    TusbTx::Sink mSequenceStatusSink;
+    TusbTx::Sink mTxDropCountSink;
+
     // Allocate storage for event handlers
     EventHandlerFunction<events::CapScan> mCapScanHandler;
     EventHandlerFunction<events::CapActive> mCapActiveHandler;
@@ -64,6 +203,11 @@ private:
     EventHandlerFunction<events::TemperatureMeasurement> mTemperatureMeasurementHandler;
     EventHandlerFunction<events::HvRegulatorUpdate> mHvRegulatorUpdateHandler;
     EventHandlerFunction<events::DutyCycleUpdated> mDutyCycleUpdatedHandler;
+    EventHandlerFunction<events::SequenceProgress> mSequenceProgressHandler;
+    EventHandlerFunction<events::HandoffComplete> mHandoffCompleteHandler;
+
+    // Smooths group scan results sent to the host, per the Cap Groups Filter
+    InputFilter<AppConfig::N_CAP_GROUPS> mGroupFilter;
 
     void ProcessMessage(uint8_t *buf, uint16_t len);
     void HandleCapActive(events::CapActive &e);
@@ -73,8 +217,12 @@ private:
     void HandleTemperatureMeasurement(events::TemperatureMeasurement &e);
     void HandleHvRegulatorUpdate(events::HvRegulatorUpdate &e);
     void HandleDutyCycleUdpated(events::DutyCycleUpdated &e);
+    void HandleSequenceProgress(events::SequenceProgress &e);
+    void HandleHandoffComplete(events::HandoffComplete &e);
 
     void PeriodicSend();
     void SendBlob(uint8_t blob_id, const uint8_t *buf, uint32_t size);
     void SendAck(uint8_t acked_id);
+    void readDropCounts(uint32_t *counts);
+    void SendTxDropCount();
 };
\ No newline at end of file
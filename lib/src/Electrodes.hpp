@@ -1,23 +1,33 @@
+#pragma once
+#include <atomic>
 #include <cstdint>
 #include <chrono>
+#include <cstring>
 #include <functional>
 
 #include "modm/platform.hpp"
 #include "modm/math/utils/bit_operation.hpp"
 #include "AppConfig.hpp"
-#include "CircularBuffer.hpp"
 #include "EventEx.hpp"
 #include "Events.hpp"
+#include "InplaceFunction.hpp"
+#include "SampleReduction.hpp"
+#include "ScanBuffer.hpp"
 #include "ScanGroups.hpp"
 
 using namespace modm::platform;
 using namespace modm::literals;
 using namespace std::chrono_literals;
 
-// Cycles between capacitance scans
-static const uint32_t SCAN_PERIOD = 500;
-// Duration of each voltage pulse
-static const uint32_t DRIVE_PERIOD_US = 1000;
+// Limits of the configurable duration of each voltage pulse
+static const uint32_t MIN_DRIVE_PERIOD_US = 200;
+static const uint32_t MAX_DRIVE_PERIOD_US = 10000;
+// Limit of the CapSampleCount parameter
+static const uint32_t MAX_CAP_SAMPLES = 16;
+// HV rail feedback readings taken for HvRegulator in each pulse
+static const uint32_t HV_SAMPLES_PER_PULSE = 2;
+// Idle time which must be left before the next step to start a reading
+static const int32_t HV_SAMPLE_SLACK_US = 50;
 
 enum CalibrateStep : uint8_t {
     CALSTEP_NONE = 0,
@@ -77,6 +87,28 @@ public:
         uint16_t sample1; // final value
     };
 
+    /** One step of an electrode sequence, as uploaded by the host
+     *
+     * Masks have the same bit order as SetElectrodes values.
+     */
+    struct SequenceStep {
+        uint16_t dwellCycles; // Number of drive cycles to hold this step
+        uint8_t dutyCycleA;
+        uint8_t dutyCycleB;
+        uint8_t maskA[HV507::N_BYTES];
+        uint8_t maskB[HV507::N_BYTES];
+    };
+    static_assert(sizeof(SequenceStep) == 4 + 2 * HV507::N_BYTES, "SequenceStep must match its wire format");
+
+    /** Controller run in the drive interrupt after each group scan
+     *
+     * Returns a mask of the drive groups given new duty cycles, which take
+     * effect from the next drive pulse.
+     */
+    typedef InplaceFunction<uint8_t(
+        const events::CapGroups &, std::array<uint8_t, AppConfig::N_DRIVE_GROUPS> &
+    )> GroupScanController;
+
     Electrodes() {
         // Save singleton reference
         mSingleton = this;
@@ -86,17 +118,44 @@ public:
     void init(EventEx::EventBroker *broker) {
         mBroker = broker;
         mCyclesSinceScan = 0;
+        mCyclesSinceGroupScan = 0;
+        mDrivePeriodUs = 0;
+        latchTiming();
+        // Applied to the pins by HV507::init
+        mOptoInverted = AppConfig::InvertedOpto();
+        mScanSequence = 0;
+        mScanPos = HV507::N_PINS - 1;
+        mScanMask.fill(0xff);
+        mSweepMask.fill(0);
+        mSweepSliceSize = 0;
         mCalibrateStep = CALSTEP_NONE;
-        mDutyCycleA = 255;
-        mDutyCycleB = 255;
+        mDutyCycles.fill(255);
+        mScheduleDirty = true;
+        mHvSamplesDue = 0;
+        mPolaritySwitchUs = 0;
+        mActiveElectrodeOffset = 0;
+        mGroupElectrodeOffsets.fill(0);
+        mGroupScanData.fill(0);
+        memset(&mElectrodeCalibration, 0, sizeof(mElectrodeCalibration));
+        memset(mSequence, 0, sizeof(mSequence));
+        mSequenceRunning = false;
+        mSequenceLength = 0;
+        mSequenceStep = 0;
+        mSequenceDwell = 0;
+        mHandoffPending = false;
+        mHandoffReady = false;
         for(uint32_t i=0; i<HV507::N_BYTES; i++) {
-            mShiftRegA[i] = 0;
-            mShiftRegB[i] = 0;
             mLowGainFlags[i] = 0;
         }
+        for(auto &group : mDriveGroups) {
+            group.fill(0);
+        }
+        buildOffsetTable();
 
         HV507::template init<SystemClock>();
 
+        mCalSampleCount = AppConfig::CapSampleCount();
+        mCalSampleReduction = AppConfig::CapSampleReduction();
         calibrateOffset();
 
         mSetElectrodesHandler.setFunction([this](auto &e) { handleSetElectrodes(e); });
@@ -109,23 +168,42 @@ public:
         mBroker->registerHandler(&mSetDutyCycleHandler);
         mUpdateElectrodeCalibrationHandler.setFunction([this](auto &e){ handleUpdateElectrodeCalibration(e); });
         mBroker->registerHandler(&mUpdateElectrodeCalibrationHandler);
+        mSetScanMaskHandler.setFunction([this](auto &e){ handleSetScanMask(e); });
+        mBroker->registerHandler(&mSetScanMaskHandler);
+        mUpdateElectrodeSequenceHandler.setFunction([this](auto &e){ handleUpdateElectrodeSequence(e); });
+        mBroker->registerHandler(&mUpdateElectrodeSequenceHandler);
+        mSequenceControlHandler.setFunction([this](auto &e){ handleSequenceControl(e); });
+        mBroker->registerHandler(&mSequenceControlHandler);
+        mQueueHandoffHandler.setFunction([this](auto &e){ handleQueueHandoff(e); });
+        mBroker->registerHandler(&mQueueHandoffHandler);
 
         TimingTimer::init();
         // Kick off asynchronous drive
         SchedulingTimer::init();
         SchedulingTimer::reset();
-        SchedulingTimer::schedule(DRIVE_PERIOD_US);
+        SchedulingTimer::schedule(mDrivePeriodUs);
 
     }
 
+    /** Measure the charge transferred to the active electrodes
+     *
+     * The integrator output is read CapSampleCount times, back-to-back, before
+     * unblanking and again at the end of the sample delay. The readings are
+     * combined once the timed section is over.
+     */
     inline static SampleData
     sampleCapacitance(bool low_gain, bool fire_sync_pulse) {
-        static const uint32_t N_SAMPLE = 1;
         static const uint32_t DIFF_DELAY = 3;
         SampleData ret;
 
-        uint32_t accum0 = 0;
-        uint32_t accum1 = 0;
+        uint32_t n_sample = AppConfig::CapSampleCount();
+        if(n_sample < 1) {
+            n_sample = 1;
+        } else if(n_sample > MAX_CAP_SAMPLES) {
+            n_sample = MAX_CAP_SAMPLES;
+        }
+        uint16_t samples0[MAX_CAP_SAMPLES];
+        uint16_t samples1[MAX_CAP_SAMPLES];
         Differencer<DIFF_DELAY, uint16_t, typename SchedulingTimer::CountType> diff;
         uint32_t sample_count = 0;
         HV507::setupAnalog();
@@ -148,9 +226,7 @@ public:
             }
             // Take an initial reading of integrator output -- the integrator does not
             // reset fully to 0V
-            for(uint32_t i=0; i<N_SAMPLE; i++) {
-                accum0 += HV507::readIntVout();
-            }
+            HV507::readIntVoutBurst(samples0, n_sample);
             // Release the blanking signal, charging active electrodes
             HV507::unblank();
 
@@ -179,48 +255,46 @@ public:
             }
 
             // Read final value from integrator
-            for(uint32_t i=0; i<N_SAMPLE; i++) {
-                accum1 += HV507::readIntVout();
-            }
+            HV507::readIntVoutBurst(samples1, n_sample);
 
             HV507::clearScanSync();
             HV507::resetIntegrator();
         }
 
-        ret.sample0 = accum0/N_SAMPLE;
-        ret.sample1 = accum1/N_SAMPLE;
+        auto reduction = (SampleReduction)AppConfig::CapSampleReduction();
+        ret.sample0 = reduceSamples(samples0, n_sample, reduction);
+        ret.sample1 = reduceSamples(samples1, n_sample, reduction);
         return ret;
     }
 
-    // To be called frequently on main task
+    /** Update calibration tables after a change of parameters
+     *
+     * Called from the main loop. The electrode offset table is rebuilt when
+     * the HV target or the sense resistors have changed. Offset calibration
+     * is repeated when the ADC sampling changes, as the time between the
+     * start and end readings, and so the integrator drift, depends on it.
+     */
     void poll() {
-        while(mAsyncEventQ.count() > 0) {
-            AsyncEvent_e e = mAsyncEventQ.pop();
-            if(e == AsyncEvent_e::SendActiveCap) {
-                // Send active capacitance message
-                auto &sample = mLastActiveSample;
-                events::CapActive event(
-                    sample.sample0 + mOffsetCalibration + mActiveElectrodeOffset,
-                    sample.sample1,
-                    AppConfig::ActiveCapLowGain() ? 1 : 0
-                );
-                mBroker->publish(event);
-            } else if(e == AsyncEvent_e::SendGroupCap) {
-                events::CapGroups event;
-                event.measurements = mGroupScanData;
-                event.scanGroups = mScanGroups;
-                mBroker->publish(event);
-            } else if(e == AsyncEvent_e::SendScanCap) {
-                events::CapScan event;
-                event.measurements = mScanData;
-                mBroker->publish(event);
-            } else if(e == AsyncEvent_e::SendElectrodeAck) {
-                events::ElectrodesUpdated event;
-                mBroker->publish(event);
-            }
+        if(AppConfig::HvControlTarget() != mOffsetTableTarget ||
+            AppConfig::LowGainR() != mOffsetTableLowGainR ||
+            AppConfig::HighGainR() != mOffsetTableHighGainR)
+        {
+            buildOffsetTable();
+        }
+        if(AppConfig::CapSampleCount() != mCalSampleCount ||
+            AppConfig::CapSampleReduction() != mCalSampleReduction)
+        {
+            mCalSampleCount = AppConfig::CapSampleCount();
+            mCalSampleReduction = AppConfig::CapSampleReduction();
+            mCalibrateStep = CALSTEP_REQUEST;
         }
     }
 
+    /** Set the controller run after each group scan; must be set before init */
+    void setGroupScanController(GroupScanController controller) {
+        mGroupScanController = controller;
+    }
+
     static void timerIrqHandler() {
         if(mSingleton) {
             mSingleton->callback();
@@ -238,7 +312,7 @@ private:
 
     enum DriveState_e {
         Start,
-        WaitIntermediate,
+        LatchNext,
         EndPulse,
         EndCycle
     };
@@ -254,63 +328,174 @@ private:
         DriveState_e drive = DriveState_e::Start;
     };
 
-    enum AsyncEvent_e : uint8_t {
-        SendActiveCap,
-        SendScanCap,
-        SendGroupCap,
-        SendElectrodeAck
-    };
-
-    // Store signals to send event in the main task
-    // We can't send messages from the IRQs because message serialization is not
-    // thread safe. Queue ensures events are transmitted in the correct order.
-    static const uint32_t EVENT_Q_SIZE = 16;
-    StaticCircularBuffer<AsyncEvent_e, EVENT_Q_SIZE> mAsyncEventQ;
-
     FSM mFsm;
 
-    HV507::PinMask mShiftRegA;
-    HV507::PinMask mShiftRegB;
-    uint8_t mDutyCycleA;
-    uint8_t mDutyCycleB;
+    /** Order in which electrodes are switched off during a drive pulse
+     *
+     * All driven electrodes are latched at the start of the pulse. At the end
+     * time of each step but the last, the electrodes of the groups which are
+     * still being driven are latched; the last step ends the pulse. Masks are
+     * stored as loaded to the shift register, i.e. inverted for an inverted
+     * opto isolator.
+     */
+    struct DriveSchedule {
+        struct Step {
+            // Time from the start latch
+            uint32_t endUs;
+            typename HV507::PinMask next;
+        };
+        typename HV507::PinMask start;
+        std::array<Step, AppConfig::N_DRIVE_GROUPS> steps;
+        uint32_t count;
+    };
+
+    // Electrodes and duty cycle of each drive group
+    std::array<typename HV507::PinMask, AppConfig::N_DRIVE_GROUPS> mDriveGroups;
+    std::array<uint8_t, AppConfig::N_DRIVE_GROUPS> mDutyCycles;
+    // Rebuilt from the drive groups at the start of a pulse, when marked dirty
+    DriveSchedule mSchedule;
+    uint32_t mScheduleStep;
+    // Time of the start latch in the current pulse
+    uint32_t mPulseStartUs;
+    // When the positive polarity was selected, ahead of the sliced scan
+    uint32_t mPolaritySwitchUs;
+    volatile bool mScheduleDirty;
+    // HV readings still due for the pulse just ended
+    uint8_t mHvSamplesDue;
 
     ScanGroups<HV507::N_PINS, AppConfig::N_CAP_GROUPS> mScanGroups;
 
     /* These must be cached to ensure changes are made only when starting a new
     cycle */
-    HV507::PinMask mShadowShiftReg;
-    HV507::PinMask mIntermediateShiftReg;
-    bool mWriteIntermediate = false;
     bool mShiftRegDirty = false;
     uint32_t mCyclesSinceScan;
-    uint16_t mScanData[HV507::N_PINS];
+    uint32_t mCyclesSinceGroupScan;
+    // Timing parameters, taken from AppConfig at the start of each cycle
+    uint32_t mDrivePeriodUs;
+    uint32_t mScanPeriod;
+    uint32_t mGroupScanPeriod;
+    // Opto-isolator polarity applied to the control pins
+    bool mOptoInverted;
+    // Next pin to be measured by a sliced scan
+    int32_t mScanPos;
+    // Electrodes included in the full scan; bit N of byte M is pin M*8+N
+    std::array<uint8_t, HV507::N_BYTES> mScanMask;
+    // The scan mask, less the top plate, and the slice size, taken when the
+    // scan in progress started
+    std::array<uint8_t, HV507::N_BYTES> mSweepMask;
+    uint32_t mSweepSliceSize;
+    // Full scan results; the IRQ fills the back frame
+    ScanBuffer<HV507::N_PINS> mScanBuffer;
+    uint32_t mScanSequence;
     uint16_t mOffsetCalibration;
     uint16_t mOffsetCalibrationLowGain;
+    // ADC sampling parameters in use at the last offset calibration
+    uint32_t mCalSampleCount;
+    uint32_t mCalSampleReduction;
     uint8_t mLowGainFlags[HV507::N_BYTES];
     uint8_t mCalibrateStep;
     std::array<uint16_t, AppConfig::N_CAP_GROUPS> mGroupScanData;
-    SampleData mLastActiveSample;
     ElectrodeCalibrationData mElectrodeCalibration;
+    // Offset of each electrode in ADC counts at the present HV target, for
+    // high and low gain, and the parameters it was computed with
+    std::array<uint16_t, HV507::N_PINS> mOffsetTable[2];
+    float mOffsetTableTarget;
+    float mOffsetTableLowGainR;
+    float mOffsetTableHighGainR;
     uint16_t mActiveElectrodeOffset;
     std::array<uint16_t, AppConfig::N_CAP_GROUPS> mGroupElectrodeOffsets;
+    // Electrode sequence table, and the player state. The IRQ owns the state
+    // while the sequence is running.
+    SequenceStep mSequence[AppConfig::N_SEQUENCE_STEPS];
+    // Active electrode offset for each step, computed when the sequence starts
+    uint16_t mSequenceOffsets[AppConfig::N_SEQUENCE_STEPS];
+    std::atomic<bool> mSequenceRunning;
+    uint16_t mSequenceLength;
+    uint16_t mSequenceStep;
+    uint16_t mSequenceDwell;
+    // Pending hand-off. The IRQ owns it while mHandoffPending is set, and
+    // checks the condition after each group scan.
+    events::QueueHandoff mHandoff;
+    uint16_t mHandoffOffset;
+    std::atomic<bool> mHandoffPending;
+    bool mHandoffReady;
+    bool mHandoffArrived;
+    uint16_t mHandoffCycles;
+    uint16_t mHandoffValue;
     // Allocate storage for event handler callbacks
     EventEx::EventHandlerFunction<events::SetElectrodes> mSetElectrodesHandler;
     EventEx::EventHandlerFunction<events::SetGain> mSetGainHandler;
     EventEx::EventHandlerFunction<events::CapOffsetCalibrationRequest> mCapOffsetCalibrationRequestHandler;
     EventEx::EventHandlerFunction<events::SetDutyCycle> mSetDutyCycleHandler;
     EventEx::EventHandlerFunction<events::UpdateElectrodeCalibration> mUpdateElectrodeCalibrationHandler;
+    EventEx::EventHandlerFunction<events::SetScanMask> mSetScanMaskHandler;
+    EventEx::EventHandlerFunction<events::UpdateElectrodeSequence> mUpdateElectrodeSequenceHandler;
+    EventEx::EventHandlerFunction<events::SequenceControl> mSequenceControlHandler;
+    EventEx::EventHandlerFunction<events::QueueHandoff> mQueueHandoffHandler;
 
     EventEx::EventBroker *mBroker;
+    GroupScanController mGroupScanController;
 
     // Pointer to the singleton class instance for static methods
     static Electrodes<HV507, SchedulingTimer, TimingTimer> *mSingleton;
 
-    inline uint16_t electrodeOffset(uint8_t pin, bool low_gain=false) {
-        float x = mElectrodeCalibration.offsets[pin] * AppConfig::HvControlTarget() / mElectrodeCalibration.voltage;
-        if(low_gain) {
-            x *= AppConfig::LowGainR() / AppConfig::HighGainR();
+    inline uint16_t electrodeOffset(uint16_t pin, bool low_gain=false) {
+        return mOffsetTable[low_gain][pin];
+    }
+
+    /** Scale the calibrated offsets to the present HV target and gain
+     *
+     * Scale factors are computed once, in 16.16 fixed point, so that each
+     * entry is an integer multiply. Offsets derived from the table (scan
+     * groups, the active electrodes) are recomputed.
+     */
+    void buildOffsetTable() {
+        mOffsetTableTarget = AppConfig::HvControlTarget();
+        mOffsetTableLowGainR = AppConfig::LowGainR();
+        mOffsetTableHighGainR = AppConfig::HighGainR();
+
+        uint32_t scale[2] = {0, 0};
+        if(mElectrodeCalibration.voltage > 0 && mOffsetTableHighGainR > 0) {
+            float high = mOffsetTableTarget / mElectrodeCalibration.voltage;
+            float low = high * mOffsetTableLowGainR / mOffsetTableHighGainR;
+            scale[0] = toScale(high);
+            scale[1] = toScale(low);
+        }
+        for(uint32_t gain=0; gain<2; gain++) {
+            for(uint32_t pin=0; pin<HV507::N_PINS; pin++) {
+                uint64_t x = ((uint64_t)mElectrodeCalibration.offsets[pin] * scale[gain]) >> 16;
+                mOffsetTable[gain][pin] = x > 0xffff ? 0xffff : x;
+            }
+        }
+
+        for(uint8_t group=0; group<AppConfig::N_CAP_GROUPS; group++) {
+            if(mScanGroups.isGroupActive(group)) {
+                updateGroupElectrodeOffset(group);
+            }
         }
-        return x;
+        mActiveElectrodeOffset = maskOffset(mDriveGroups[0], AppConfig::ActiveCapLowGain());
+    }
+
+    static uint32_t toScale(float x) {
+        if(!(x > 0)) {
+            return 0;
+        }
+        if(x >= 65535.0f) {
+            return 0xffffffff;
+        }
+        return x * 65536.0f;
+    }
+
+    /** Total offset of the electrodes in a mask, as loaded to the shift
+     * register */
+    uint16_t maskOffset(const typename HV507::PinMask &mask, bool low_gain) {
+        uint16_t offset = 0;
+        for(uint32_t i=0; i<HV507::N_PINS; i++) {
+            if(mask[i / 8] & (0x80 >> (i % 8))) {
+                offset += electrodeOffset(i, low_gain);
+            }
+        }
+        return offset;
     }
 
     void callback() {
@@ -319,7 +504,7 @@ private:
             HV507::blank();
             HV507::setPolarity(true);
             mCalibrateStep = CALSTEP_SETTLE;
-            SchedulingTimer::schedule(DRIVE_PERIOD_US);
+            SchedulingTimer::schedule(mDrivePeriodUs);
         } else if(mCalibrateStep == CALSTEP_SETTLE) {
             // Previouse cycle we did setup, now measure the offset
             calibrateOffset();
@@ -334,18 +519,44 @@ private:
                 mFsm.top = TopState_e::MeasureGroups;
                 HV507::blank();
                 HV507::setPolarity(true);
+                mPolaritySwitchUs = TimingTimer::time_us();
                 SchedulingTimer::schedule(1);
                 mCyclesSinceScan++;
             }
         } else if(mFsm.top == TopState_e::MeasureGroups) {
-            groupScan();
+            bool scanned = false;
+            if(mGroupScanPeriod > 0 && ++mCyclesSinceGroupScan >= mGroupScanPeriod) {
+                mCyclesSinceGroupScan = 0;
+                groupScan();
+                scanned = true;
+            }
+            if(mHandoffPending && !mHandoffReady) {
+                checkHandoff(scanned);
+            }
+            if(sliceDue()) {
+                // Let the polarity switch settle before scanning, without
+                // holding up the CPU. Any group scan has already used up part
+                // of the delay.
+                int32_t delay = AppConfig::ScanStartDelay() / 1000 - (int32_t)(TimingTimer::time_us() - mPolaritySwitchUs);
+                mFsm.top = TopState_e::Scan;
+                SchedulingTimer::schedule(delay > 1 ? delay : 1);
+            } else {
+                mFsm.top = TopState_e::DriveP;
+                SchedulingTimer::schedule(1);
+            }
+        } else if(mFsm.top == TopState_e::Scan) {
+            if(scanSlice()) {
+                publishScan();
+            }
             mFsm.top = TopState_e::DriveP;
             SchedulingTimer::schedule(1);
         } else if(mFsm.top == TopState_e::DriveP) {
-            if(mCyclesSinceScan >= SCAN_PERIOD) {
+            if(AppConfig::ScanSliceSize() == 0 && mScanPos == HV507::N_PINS - 1 &&
+               mScanPeriod > 0 && mCyclesSinceScan >= mScanPeriod) {
                 mCyclesSinceScan = 0;
-                scan();
-                mAsyncEventQ.push(AsyncEvent_e::SendScanCap);
+                if(scan()) {
+                    publishScan();
+                }
             }
 
             if(driveFsm()) {
@@ -353,50 +564,42 @@ private:
                 SchedulingTimer::schedule(1);
             }
         }
-
-        // Update settings for inverted opto isolator
-        if(AppConfig::InvertedOpto()) {
-            HV507::Spi::setDataMode(HV507::Spi::DataMode::Mode2); // Set CPOL = 1, inverted clock
-            HV507::Pins::POL::setInvert(true);
-            HV507::Pins::BL::setInvert(true);
-            HV507::Pins::LE::setInvert(true);
-            HV507::Pins::SCK::setInvert(true);
-            HV507::Pins::MOSI::setInvert(true);
-            HV507::Pins::AUGMENT_ENABLE::setInvert(true);
-        } else {
-            HV507::Spi::setDataMode(HV507::Spi::DataMode::Mode0); // Set CPOL = 0, non-inverted clock
-            HV507::Pins::POL::setInvert(false);
-            HV507::Pins::BL::setInvert(false);
-            HV507::Pins::LE::setInvert(false);
-            HV507::Pins::SCK::setInvert(false);
-            HV507::Pins::MOSI::setInvert(false);
-            HV507::Pins::AUGMENT_ENABLE::setInvert(false);
-        }
     }
 
     bool driveFsm() {
         if(mFsm.drive == DriveState_e::Start) {
             TimingTimer::reset();
             HV507::blank();
+            // A drive cycle begins with the negative pulse
+            if(mFsm.top == TopState_e::DriveN) {
+                latchTiming();
+                latchOptoPolarity();
+                if(mHandoffPending && mHandoffReady) {
+                    completeHandoff();
+                }
+                if(mSequenceRunning) {
+                    stepSequence();
+                }
+            }
+            if(mScheduleDirty) {
+                mScheduleDirty = false;
+                buildSchedule();
+            }
+
+            // Write all drive groups, shifting them in while the polarity
+            // switches
+            HV507::startLoadShiftRegister(mSchedule.start);
             if(mFsm.top == TopState_e::DriveN) {
                 HV507::setPolarity(false);
             } else {
                 HV507::setPolarity(true);
             }
-            // Write both enable groups
-            for(uint32_t b=0; b<HV507::N_BYTES; b++) {
-                if(AppConfig::InvertedOpto()) {
-                    mShadowShiftReg[b] = ~mShiftRegA[b] & ~mShiftRegB[b];
-                } else {
-                    mShadowShiftReg[b] = mShiftRegA[b] | mShiftRegB[b];
-                }
-            }
-
-            HV507::loadShiftRegister(mShadowShiftReg);
             HV507::latchShiftRegister();
+            mPulseStartUs = TimingTimer::time_us();
             if(mShiftRegDirty) {
                 mShiftRegDirty = false;
-                mAsyncEventQ.push(AsyncEvent_e::SendElectrodeAck);
+                events::ElectrodesUpdated event;
+                mBroker->publishFromIsr(event);
             }
 
             if(mFsm.top == TopState_e::DriveN) {
@@ -410,61 +613,56 @@ private:
                 }
                 // Scan sync pin -1 causes sync pulse on active capacitance measurement
                 bool fire_sync_pulse = AppConfig::ScanSyncPin() == -1;
-                mLastActiveSample = sampleCapacitance(low_gain, fire_sync_pulse);
-                mAsyncEventQ.push(AsyncEvent_e::SendActiveCap);
-            }
-
-            // Determine what intermediate steps are needed
-            if(mDutyCycleA == mDutyCycleB) {
-                mWriteIntermediate = false;
-            } else {
-                mWriteIntermediate = true;
-                if(mDutyCycleA < mDutyCycleB) {
-                    for(uint32_t i=0; i<HV507::N_BYTES; i++) {
-                        mIntermediateShiftReg[i] = mShiftRegB[i];
-                    }
-                } else {
-                    for(uint32_t i=0; i<HV507::N_BYTES; i++) {
-                        mIntermediateShiftReg[i] = mShiftRegA[i];
-                    }
-                }
-                if(AppConfig::InvertedOpto()) {
-                    for(size_t i=0; i<mIntermediateShiftReg.size(); i++) {
-                        mIntermediateShiftReg[i] = ~mIntermediateShiftReg[i];
-                    }
-                }
+                auto sample = sampleCapacitance(low_gain, fire_sync_pulse);
+                events::CapActive event(
+                    sample.sample0 + mOffsetCalibration + mActiveElectrodeOffset,
+                    sample.sample1,
+                    low_gain ? 1 : 0
+                );
+                mBroker->publishFromIsr(event);
             }
 
-            // Next step, we will either latch the new partial shift register value,
-            // or we will go straight to blanking
-            if(mWriteIntermediate) {
-                HV507::loadShiftRegister(mIntermediateShiftReg);
-                mFsm.drive = DriveState_e::WaitIntermediate;
+            // Next step, we will either latch the electrodes which remain on
+            // after the shortest group ends, or we will go straight to blanking
+            mScheduleStep = 0;
+            if(mSchedule.count > 1) {
+                HV507::startLoadShiftRegister(mSchedule.steps[0].next);
+                mFsm.drive = DriveState_e::LatchNext;
             } else {
                 mFsm.drive = DriveState_e::EndPulse;
             }
 
-            uint8_t min_duty = std::min(mDutyCycleA, mDutyCycleB);
-            int32_t wait_time = (DRIVE_PERIOD_US * min_duty) / 255 - TimingTimer::time_us();
+            uint32_t end_us = mSchedule.count > 0 ? mPulseStartUs + mSchedule.steps[0].endUs : 0;
+            // Left over when the last pulse ran to the end of its period
+            if(mSchedule.count > 0) {
+                sampleHvFeedback(end_us);
+            }
+            int32_t wait_time = end_us - TimingTimer::time_us();
             if(wait_time < 0) {
                 wait_time = 0;
             }
             SchedulingTimer::schedule(wait_time);
             return false;
-        } else if(mFsm.drive == DriveState_e::WaitIntermediate) {
-            uint8_t max_duty = std::max(mDutyCycleA, mDutyCycleB);
-            int32_t wait_time = DRIVE_PERIOD_US * max_duty / 255 - TimingTimer::time_us();
+        } else if(mFsm.drive == DriveState_e::LatchNext) {
+            HV507::latchShiftRegister();
+            mScheduleStep++;
+            if(mScheduleStep + 1 < mSchedule.count) {
+                HV507::startLoadShiftRegister(mSchedule.steps[mScheduleStep].next);
+            } else {
+                mFsm.drive = DriveState_e::EndPulse;
+            }
+            int32_t wait_time = mPulseStartUs + mSchedule.steps[mScheduleStep].endUs - TimingTimer::time_us();
             if(wait_time < 0) {
                 wait_time = 0;
             }
-            HV507::latchShiftRegister();
-            mFsm.drive = DriveState_e::EndPulse;
             SchedulingTimer::schedule(wait_time);
             return false;
         } else if(mFsm.drive == DriveState_e::EndPulse) {
             HV507::blank();
             mFsm.drive = DriveState_e::EndCycle;
-            int32_t wait_time = DRIVE_PERIOD_US - TimingTimer::time_us();
+            mHvSamplesDue = HV_SAMPLES_PER_PULSE;
+            sampleHvFeedback(mDrivePeriodUs);
+            int32_t wait_time = mDrivePeriodUs - TimingTimer::time_us();
             if(wait_time < 0) {
                 wait_time = 0;
             }
@@ -478,119 +676,454 @@ private:
         return true;
     }
 
-    void groupScan() {
-        if(!mScanGroups.isAnyGroupActive()) {
-            mGroupScanData.fill(0);
+    /** Read the HV rail for HvRegulator
+     *
+     * The ADC is free between integrator measurements, so the drive interrupt
+     * takes these readings, rather than have the regulator block interrupts
+     * to do it. They are taken once per pulse, at its end, or if there is no
+     * time left there, early in the next pulse, while waiting for the first
+     * group to end.
+     *
+     * Each reading is only started while at least HV_SAMPLE_SLACK_US remain
+     * before `deadline_us`, the time of the next step. Readings which do not
+     * fit are left for the next chance, rather than delay that step.
+     */
+    void sampleHvFeedback(uint32_t deadline_us) {
+        while(mHvSamplesDue > 0 && (int32_t)(deadline_us - TimingTimer::time_us()) >= HV_SAMPLE_SLACK_US) {
+            HV507::sampleHvFeedback();
+            mHvSamplesDue--;
+        }
+    }
+
+    /** Take up changes to the timing parameters
+     *
+     * Called at the start of each drive cycle, so that a change never cuts a
+     * pulse short or leaves the two polarities unbalanced.
+     */
+    void latchTiming() {
+        uint32_t period = AppConfig::DrivePeriod();
+        if(period < MIN_DRIVE_PERIOD_US) {
+            period = MIN_DRIVE_PERIOD_US;
+        } else if(period > MAX_DRIVE_PERIOD_US) {
+            period = MAX_DRIVE_PERIOD_US;
+        }
+        if(period != mDrivePeriodUs) {
+            mDrivePeriodUs = period;
+            mScheduleDirty = true;
+        }
+        mScanPeriod = AppConfig::ScanPeriod();
+        mGroupScanPeriod = AppConfig::GroupScanPeriod();
+    }
+
+    /** Apply a change to the opto-isolator polarity, at the start of a drive
+     * cycle
+     *
+     * The control pins and SPI clock are inverted, and the drive schedule and
+     * group scan plan rebuilt with inverted masks, only when the parameter
+     * changes.
+     */
+    void latchOptoPolarity() {
+        if constexpr(AppConfig::INVERTED_OPTO_FIXED) {
             return;
         }
-        for(uint32_t group=0; group<AppConfig::N_CAP_GROUPS; group++) {
-            if(mScanGroups.isGroupActive(group)) {
-                mShadowShiftReg = mScanGroups.getGroupMask(group);
-                if(AppConfig::InvertedOpto()) {
-                    for(size_t i=0; i<mShadowShiftReg.size(); i++) {
-                        mShadowShiftReg[i] = ~mShadowShiftReg[i];
-                    }
+        bool inverted = AppConfig::InvertedOpto();
+        if(inverted != mOptoInverted) {
+            mOptoInverted = inverted;
+            HV507::setOptoInverted(inverted);
+            mScheduleDirty = true;
+            mScanGroups.invalidatePlan();
+        }
+    }
+
+    /** Whether masks must be inverted before loading the shift register */
+    bool optoInverted() const {
+        if constexpr(AppConfig::INVERTED_OPTO_FIXED) {
+            return AppConfig::InvertedOpto();
+        }
+        return mOptoInverted;
+    }
+
+    /** Build the drive schedule from the drive groups
+     *
+     * Groups with no electrodes, or a zero duty cycle, are left out. Groups
+     * with equal duty cycles share a step. Duty cycles are a fraction of the
+     * time after the start latch, which comes one shift register load into the
+     * pulse, so that they stay in proportion however long the chain is.
+     */
+    void buildSchedule() {
+        // Driven groups, sorted by duty cycle, shortest first
+        std::array<uint8_t, AppConfig::N_DRIVE_GROUPS> order;
+        uint32_t n = 0;
+        for(uint32_t g=0; g<AppConfig::N_DRIVE_GROUPS; g++) {
+            bool empty = true;
+            for(auto b : mDriveGroups[g]) {
+                if(b != 0) {
+                    empty = false;
+                    break;
                 }
-                uint16_t calibration_offset;
-                bool low_gain = mScanGroups.getGroupSetting(group) & 1;
-                if(low_gain) {
-                    calibration_offset = mOffsetCalibrationLowGain;
-                    HV507::setGain(GainSetting::Low);
-                } else {
-                    calibration_offset = mOffsetCalibration;
-                    HV507::setGain(GainSetting::High);
+            }
+            if(empty || mDutyCycles[g] == 0) {
+                continue;
+            }
+            uint32_t i = n++;
+            while(i > 0 && mDutyCycles[order[i-1]] > mDutyCycles[g]) {
+                order[i] = order[i-1];
+                i--;
+            }
+            order[i] = g;
+        }
+
+        mSchedule.start.fill(0);
+        for(uint32_t i=0; i<n; i++) {
+            for(uint32_t b=0; b<HV507::N_BYTES; b++) {
+                mSchedule.start[b] |= mDriveGroups[order[i]][b];
+            }
+        }
+
+        mSchedule.count = 0;
+        uint32_t i = 0;
+        while(i < n) {
+            uint8_t duty = mDutyCycles[order[i]];
+            while(i < n && mDutyCycles[order[i]] == duty) {
+                i++;
+            }
+            auto &step = mSchedule.steps[mSchedule.count++];
+            step.endUs = (mDrivePeriodUs - HV507::LOAD_TIME_US) * duty / 255;
+            step.next.fill(0);
+            for(uint32_t j=i; j<n; j++) {
+                for(uint32_t b=0; b<HV507::N_BYTES; b++) {
+                    step.next[b] |= mDriveGroups[order[j]][b];
                 }
-                HV507::blank();
-                // Presently assuming the SPI transfer time is more than enough blanking time,
-                // so this is not adjustable
-                HV507::loadShiftRegister(mShadowShiftReg);
-                HV507::latchShiftRegister();
+            }
+        }
 
-                // Use 10,000 + group number to trigger on a particular group measurement
-                bool fire_sync_pulse = AppConfig::ScanSyncPin() == (int32_t)(10000 + group);
-                auto sample = sampleCapacitance(low_gain, fire_sync_pulse);
-                mGroupScanData[group] = sample.sample1 - sample.sample0 - calibration_offset - mGroupElectrodeOffsets[group];
-                if(mGroupScanData[group] > 32767) {
-                    mGroupScanData[group] = 0;
+        if(optoInverted()) {
+            for(auto &b : mSchedule.start) {
+                b = ~b;
+            }
+            for(uint32_t k=0; k<mSchedule.count; k++) {
+                for(auto &b : mSchedule.steps[k].next) {
+                    b = ~b;
                 }
-            } else {
-                mGroupScanData[group] = 0;
             }
         }
-        mAsyncEventQ.push(AsyncEvent_e::SendGroupCap);
     }
 
-    /** Perform capacitance scan of all electrodes */
-    void scan() {
-        // Takes over bitbang control of the SPI pins, after loading a single
-        // '1' into the shift register. This 1 is shifted through all positions,
-        // and the capacitance is measured for each.
-        uint16_t offset_calibration;
-        // Clear all bits in the shift register except the first
-        for(uint32_t i=0; i < HV507::N_BYTES - 1; i++) {
-            if(AppConfig::InvertedOpto()) {
-                HV507::Spi::transferBlocking(0xff);
+    /** Advance the electrode sequence at the start of a drive cycle
+     *
+     * Each step is held for its dwell time, then the next step is loaded in
+     * its place. After the last step, the sequence stops and its electrodes
+     * are left enabled.
+     */
+    void stepSequence() {
+        if(mSequenceDwell > 0) {
+            mSequenceDwell--;
+        }
+        if(mSequenceDwell > 0) {
+            return;
+        }
+        if(mSequenceStep >= mSequenceLength) {
+            mSequenceRunning = false;
+            publishSequenceProgress(false);
+            return;
+        }
+        const SequenceStep &step = mSequence[mSequenceStep];
+        for(uint32_t i=0; i<HV507::N_BYTES; i++) {
+            mDriveGroups[0][i] = modm::bitReverse(step.maskA[i]);
+            mDriveGroups[1][i] = modm::bitReverse(step.maskB[i]);
+        }
+        mDutyCycles[0] = step.dutyCycleA;
+        mDutyCycles[1] = step.dutyCycleB;
+        mScheduleDirty = true;
+        mActiveElectrodeOffset = mSequenceOffsets[mSequenceStep];
+        mSequenceDwell = step.dwellCycles > 0 ? step.dwellCycles : 1;
+        publishSequenceProgress(true);
+        mSequenceStep++;
+    }
+
+    /** Check whether the pending hand-off should be made, once per cycle
+     *
+     * Arrival is only tested on cycles with a fresh group scan, but the
+     * timeout counts every cycle.
+     */
+    void checkHandoff(bool scanned) {
+        mHandoffCycles++;
+        uint16_t value = mGroupScanData[mHandoff.scanGroup];
+        bool arrived = false;
+        if(scanned) {
+            if(mHandoff.below) {
+                arrived = value < mHandoff.threshold;
             } else {
-                HV507::Spi::transferBlocking(0);
+                arrived = value >= mHandoff.threshold;
             }
         }
-        if(AppConfig::InvertedOpto()) {
-            HV507::Spi::transferBlocking(0xfe);
-        } else {
-            HV507::Spi::transferBlocking(0x01);
+        if(arrived || (mHandoff.timeoutCycles > 0 && mHandoffCycles >= mHandoff.timeoutCycles)) {
+            mHandoffArrived = arrived;
+            mHandoffValue = value;
+            mHandoffReady = true;
         }
-        // Convert SCK and MOSI pins from alternate function to outputs
-        HV507::Pins::MOSI::setOutput(0);
-        HV507::Pins::SCK::setOutput(0);
+    }
 
-        HV507::setPolarity(true);
-        HV507::blank();
+    /** Swap in the queued electrodes at the start of a drive cycle */
+    void completeHandoff() {
+        for(uint32_t i=0; i<HV507::N_BYTES; i++) {
+            mDriveGroups[mHandoff.groupID][i] = modm::bitReverse(mHandoff.values[i]);
+        }
+        mDutyCycles[mHandoff.groupID] = mHandoff.setting;
+        if(mHandoff.groupID == 0) {
+            mActiveElectrodeOffset = mHandoffOffset;
+        }
+        mScheduleDirty = true;
+        mHandoffPending = false;
+        events::HandoffComplete event;
+        event.arrived = mHandoffArrived;
+        event.groupValue = mHandoffValue;
+        event.cycles = mHandoffCycles;
+        event.timestamp = modm::chrono::micro_clock::now().time_since_epoch().count();
+        mBroker->publishFromIsr(event);
+    }
+
+    void publishSequenceProgress(bool running) {
+        events::SequenceProgress event;
+        event.running = running;
+        event.step = running ? mSequenceStep : mSequenceLength;
+        event.stepCount = mSequenceLength;
+        event.timestamp = modm::chrono::micro_clock::now().time_since_epoch().count();
+        mBroker->publishFromIsr(event);
+    }
+
+    /** Measure each active scan group
+     *
+     * Walks the prepared scan plan, which is rebuilt only after the groups,
+     * calibration or opto polarity change. Inactive groups report 0.
+     */
+    void groupScan() {
+        if(mScanGroups.isPlanStale()) {
+            mScanGroups.buildPlan(optoInverted(), [this](uint8_t group, bool lowGain) {
+                uint16_t calibration = lowGain ? mOffsetCalibrationLowGain : mOffsetCalibration;
+                return (uint16_t)(calibration + mGroupElectrodeOffsets[group]);
+            });
+            mGroupScanData.fill(0);
+        }
+        if(mScanGroups.planSize() == 0) {
+            return;
+        }
+        for(auto entry = mScanGroups.planBegin(); entry != mScanGroups.planEnd(); entry++) {
+            // Blanking and the gain switch overlap the transfer
+            HV507::startLoadShiftRegister(entry->load);
+            HV507::setGain(entry->lowGain ? GainSetting::Low : GainSetting::High);
+            HV507::blank();
+            // Presently assuming the SPI transfer time is more than enough blanking time,
+            // so this is not adjustable
+            HV507::latchShiftRegister();
+
+            // Use 10,000 + group number to trigger on a particular group measurement
+            bool fire_sync_pulse = AppConfig::ScanSyncPin() == (int32_t)(10000 + entry->group);
+            auto sample = sampleCapacitance(entry->lowGain, fire_sync_pulse);
+            uint16_t value = sample.sample1 - sample.sample0 - entry->offset;
+            if(value > 32767) {
+                value = 0;
+            }
+            mGroupScanData[entry->group] = value;
+        }
+        events::CapGroups event;
+        event.count = (mScanGroups.planEnd() - 1)->group + 1;
+        event.measurements = mGroupScanData;
+        event.settings = mScanGroups.getGroupSettings();
+        mBroker->publishFromIsr(event);
+
+        // The group scan falls between the negative and positive pulses, so
+        // new duty cycles apply from the positive pulse of this cycle
+        std::array<uint8_t, AppConfig::N_DRIVE_GROUPS> dutyCycles;
+        uint8_t mask = mGroupScanController(event, dutyCycles);
+        if(mask != 0 && setDutyCycles(mask, dutyCycles)) {
+            mBroker->publishFromIsr(dutyCycleUpdate());
+        }
+    }
 
+    /** Perform capacitance scan of all electrodes selected by the scan mask
+     *
+     * Returns false if no electrodes are selected.
+     */
+    bool scan() {
+        latchScanSettings();
+        int32_t pin = skipUnselected(HV507::N_PINS - 1, false);
+        if(pin < 0) {
+            return false;
+        }
+        beginScan(pin);
         modm::delay(std::chrono::nanoseconds(AppConfig::ScanStartDelay()));
+        while(pin >= 0) {
+            scanPin(pin);
+            pin = skipUnselected(pin - 1, true);
+        }
+        endScan();
+        return true;
+    }
 
-        for(int32_t i = HV507::N_PINS-1; i >= 0; i--) {
-            bool lowGain = getGain(i) == GainSetting::Low;
-            if(lowGain) {
-                offset_calibration = mOffsetCalibrationLowGain;
-                HV507::setGain(GainSetting::Low);
-            } else {
-                offset_calibration = mOffsetCalibration;
-                HV507::setGain(GainSetting::High);
+    /** True if a sliced scan is under way, or a new sweep is due
+     *
+     * Sweeps start every mScanPeriod cycles, or as soon as the last one
+     * finishes if it took longer. A sweep under way is always finished.
+     */
+    bool sliceDue() {
+        if(mScanPos != HV507::N_PINS - 1) {
+            return true;
+        }
+        if(AppConfig::ScanSliceSize() == 0 || mScanPeriod == 0) {
+            return false;
+        }
+        if(mCyclesSinceScan >= mScanPeriod) {
+            mCyclesSinceScan = 0;
+            latchScanSettings();
+            return true;
+        }
+        return false;
+    }
+
+    /** Continue a capacitance scan which is spread over many drive cycles
+     *
+     * Measures up to ScanSliceSize of the electrodes selected by the scan
+     * mask, continuing from where the previous slice stopped. Both are taken
+     * by sliceDue at the start of each sweep. Returns true when the last
+     * electrode has been measured, and the back frame holds a complete scan.
+     */
+    bool scanSlice() {
+        if(skipUnselected(HV507::N_PINS - 1, false) < 0) {
+            // Nothing to scan
+            return false;
+        }
+        int32_t pin = skipUnselected(mScanPos, false);
+        if(pin >= 0) {
+            beginScan(pin);
+            for(uint32_t n=0; n < mSweepSliceSize && pin >= 0; n++) {
+                scanPin(pin);
+                pin = skipUnselected(pin - 1, true);
             }
-            // Skip the common top plate electrode
-            if(i == (int)AppConfig::TopPlatePin()) {
+            endScan();
+        }
+
+        if(pin < 0) {
+            mScanPos = HV507::N_PINS - 1;
+            return true;
+        }
+        mScanPos = pin;
+        return false;
+    }
+
+    /** Hand the completed scan over to consumers */
+    void publishScan() {
+        auto &frame = mScanBuffer.back();
+        frame.sequence = ++mScanSequence;
+        frame.timestamp = modm::chrono::micro_clock::now().time_since_epoch().count();
+        events::CapScan event;
+        event.sequence = frame.sequence;
+        event.timestamp = frame.timestamp;
+        event.buffer = &mScanBuffer;
+        mScanBuffer.commit();
+        mBroker->publishFromIsr(event);
+    }
+
+    /** Take up changes to the scan mask and slice size, at the start of a scan
+     *
+     * A sliced scan keeps the settings it started with until it completes,
+     * so that every electrode in a published frame is measured the same way.
+     */
+    void latchScanSettings() {
+        mSweepMask = mScanMask;
+        int32_t topPlate = AppConfig::TopPlatePin();
+        if(topPlate >= 0 && topPlate < (int32_t)HV507::N_PINS) {
+            mSweepMask[topPlate / 8] &= ~(1 << (topPlate % 8));
+        }
+        mSweepSliceSize = AppConfig::ScanSliceSize();
+    }
+
+    inline bool isScanPin(int32_t pin) {
+        return mSweepMask[pin / 8] & (1 << (pin % 8));
+    }
+
+    /** Find the next electrode to be measured, at or below `pin`
+     *
+     * Results for skipped pins are cleared, and if `clock` is set, the
+     * enabled bit is clocked past them. Returns -1 if there are none left.
+     */
+    int32_t skipUnselected(int32_t pin, bool clock) {
+        while(pin >= 0 && !isScanPin(pin)) {
+            mScanBuffer.back().values[pin] = 0;
+            if(clock) {
                 HV507::Pins::SCK::setOutput(true);
                 modm::delay(80ns);
                 HV507::Pins::SCK::setOutput(false);
-                continue;
             }
+            pin--;
+        }
+        return pin;
+    }
 
-            HV507::latchShiftRegister();
-            modm::delay(std::chrono::nanoseconds(AppConfig::ScanBlankDelay()));
-
-            // Assert sync pulse on the requested pin for scope triggering
-            bool fire_sync_pulse = i == AppConfig::ScanSyncPin();
-            SampleData sample = sampleCapacitance(lowGain, fire_sync_pulse);
-            mScanData[i] = sample.sample1 - sample.sample0 - offset_calibration - electrodeOffset(i, lowGain);
-            // It can go negative on overflow; clip it to zero when that happens
-            if(mScanData[i] > 32767) {
-                mScanData[i] = 0;
+    /** Prepare to step a single enabled electrode through the shift register
+     *
+     * Loads a '1' at `firstPin`, then takes over bitbang control of the SPI
+     * pins so that it can be clocked down one position at a time.
+     */
+    void beginScan(uint32_t firstPin) {
+        typename HV507::PinMask mask;
+        mask.fill(0);
+        mask[firstPin / 8] = 0x80 >> (firstPin % 8);
+        if(optoInverted()) {
+            for(size_t i=0; i<mask.size(); i++) {
+                mask[i] = ~mask[i];
             }
-
-            HV507::blank();
-
-            // Clock in the next bit
-            HV507::Pins::SCK::setOutput(true);
-            modm::delay(80ns);
-            HV507::Pins::SCK::setOutput(false);
         }
+        HV507::loadShiftRegister(mask);
+        // Convert SCK and MOSI pins from alternate function to outputs
+        HV507::Pins::MOSI::setOutput(0);
+        HV507::Pins::SCK::setOutput(0);
+
+        HV507::setPolarity(true);
+        HV507::blank();
+    }
 
+    void endScan() {
         // Restore GPIOs to alternate fucntion
         HV507::Spi::template connect<
             typename HV507::Pins::SCK::Sck,
             typename HV507::Pins::MOSI::Mosi>();
     }
 
+    /** Measure the electrode currently in the shift register, and clock the
+     * enabled bit on to the next pin
+     */
+    void scanPin(int32_t i) {
+        uint16_t offset_calibration;
+        bool lowGain = getGain(i) == GainSetting::Low;
+        if(lowGain) {
+            offset_calibration = mOffsetCalibrationLowGain;
+            HV507::setGain(GainSetting::Low);
+        } else {
+            offset_calibration = mOffsetCalibration;
+            HV507::setGain(GainSetting::High);
+        }
+        HV507::latchShiftRegister();
+        modm::delay(std::chrono::nanoseconds(AppConfig::ScanBlankDelay()));
+
+        // Assert sync pulse on the requested pin for scope triggering
+        bool fire_sync_pulse = i == AppConfig::ScanSyncPin();
+        SampleData sample = sampleCapacitance(lowGain, fire_sync_pulse);
+        uint16_t *scanData = mScanBuffer.back().values;
+        scanData[i] = sample.sample1 - sample.sample0 - offset_calibration - electrodeOffset(i, lowGain);
+        // It can go negative on overflow; clip it to zero when that happens
+        if(scanData[i] > 32767) {
+            scanData[i] = 0;
+        }
+
+        HV507::blank();
+
+        // Clock in the next bit
+        HV507::Pins::SCK::setOutput(true);
+        modm::delay(80ns);
+        HV507::Pins::SCK::setOutput(false);
+    }
+
     void calibrateOffset() {
         static const uint32_t nSample = 100;
         int32_t accum = 0;
@@ -619,6 +1152,7 @@ private:
             accum = 0;
         }
         mOffsetCalibrationLowGain = accum / nSample;
+        mScanGroups.invalidatePlan();
     }
 
     GainSetting getGain(uint32_t channel) {
@@ -632,16 +1166,31 @@ private:
     }
 
     void handleSetDutyCycle(events::SetDutyCycle &e) {
-        if(e.updateA) {
-            mDutyCycleA = e.dutyCycleA;
+        if(setDutyCycles(e.updateMask, e.dutyCycles)) {
+            auto update_event = dutyCycleUpdate();
+            mBroker->publish(update_event);
         }
-        if(e.updateB) {
-            mDutyCycleB = e.dutyCycleB;
+    }
+
+    /** Update the duty cycles of the drive groups selected by mask
+     *
+     * Returns true if group 0 or 1, which are reported to the host, changed.
+     */
+    bool setDutyCycles(uint8_t mask, const std::array<uint8_t, AppConfig::N_DRIVE_GROUPS> &dutyCycles) {
+        for(uint32_t i=0; i<AppConfig::N_DRIVE_GROUPS; i++) {
+            if(mask & (1<<i)) {
+                mDutyCycles[i] = dutyCycles[i];
+            }
         }
-        events::DutyCycleUpdated update_event;
-        update_event.dutyCycleA = mDutyCycleA;
-        update_event.dutyCycleB = mDutyCycleB;
-        mBroker->publish(update_event);
+        mScheduleDirty = true;
+        return (mask & 0x3) != 0;
+    }
+
+    events::DutyCycleUpdated dutyCycleUpdate() {
+        events::DutyCycleUpdated event;
+        event.dutyCycleA = mDutyCycles[0];
+        event.dutyCycleB = mDutyCycles[1];
+        return event;
     }
 
     void handleSetElectrodes(events::SetElectrodes &e) {
@@ -650,43 +1199,105 @@ private:
             if(scanGroup >= AppConfig::N_CAP_GROUPS) {
                 return;
             }
-            // Compute the total electrode compenation offset for the scan group
-            mGroupElectrodeOffsets[scanGroup] = 0;
-            bool lowGain = e.setting & 1;
-            for(uint32_t i=0; i<HV507::N_PINS; i++) {
-                if(mScanGroups.isPinActive(scanGroup, i)) {
-                    mGroupElectrodeOffsets[scanGroup] += electrodeOffset(i, lowGain);
-                }
-            }
             std::array<uint8_t, sizeof(e.values)> reversedValues;
             for(uint32_t i=0; i<reversedValues.size(); i++) {
                 reversedValues[i] = modm::bitReverse(e.values[i]);
             }
             mScanGroups.setGroup(scanGroup, e.setting, &reversedValues[0]);
-        } else if(e.groupID == 0) {
-            mActiveElectrodeOffset = 0;
-            // Compute the total electrode compensation offset for the active measurement
-            for(uint32_t i=0; i<HV507::N_PINS; i++) {
-                uint8_t byteidx = i/8;
-                uint8_t bit = i%8;
-                if(e.values[byteidx] & (1<<bit)) {
-                    mActiveElectrodeOffset += electrodeOffset(i, AppConfig::ActiveCapLowGain());
-                }
+            updateGroupElectrodeOffset(scanGroup);
+        } else if(e.groupID < AppConfig::N_DRIVE_GROUPS) {
+            // The sequence player drives groups 0 and 1
+            if(e.groupID <= 1) {
+                stopSequence();
             }
-            for(uint32_t i=0; i<HV507::N_BYTES; i++) {
-                mShiftRegA[i] = modm::bitReverse(e.values[i]);
+            if(e.groupID == 0) {
+                mActiveElectrodeOffset = activeElectrodeOffset(e.values);
             }
-            mDutyCycleA = e.setting;
-            mShiftRegDirty = true;
-        } else if(e.groupID == 1) {
             for(uint32_t i=0; i<HV507::N_BYTES; i++) {
-                mShiftRegB[i] = modm::bitReverse(e.values[i]);
+                mDriveGroups[e.groupID][i] = modm::bitReverse(e.values[i]);
             }
-            mDutyCycleB = e.setting;
+            mDutyCycles[e.groupID] = e.setting;
+            mScheduleDirty = true;
             mShiftRegDirty = true;
         }
     }
 
+    // Compute the total electrode compensation offset for the active measurement
+    uint16_t activeElectrodeOffset(const uint8_t *values) {
+        uint16_t offset = 0;
+        for(uint32_t i=0; i<HV507::N_PINS; i++) {
+            uint8_t byteidx = i/8;
+            uint8_t bit = i%8;
+            if(values[byteidx] & (1<<bit)) {
+                offset += electrodeOffset(i, AppConfig::ActiveCapLowGain());
+            }
+        }
+        return offset;
+    }
+
+    // Stop the sequence where it is, e.g. when the host takes over the electrodes
+    void stopSequence() {
+        if(mSequenceRunning) {
+            mSequenceRunning.store(false);
+            std::atomic_signal_fence(std::memory_order_seq_cst);
+            events::SequenceProgress event;
+            event.running = false;
+            event.step = mSequenceStep;
+            event.stepCount = mSequenceLength;
+            event.timestamp = modm::chrono::micro_clock::now().time_since_epoch().count();
+            mBroker->publish(event);
+        }
+    }
+
+    void handleQueueHandoff(events::QueueHandoff &e) {
+        if(e.groupID >= AppConfig::N_DRIVE_GROUPS || e.scanGroup >= AppConfig::N_CAP_GROUPS) {
+            return;
+        }
+        // The hand-off takes over the electrodes from a running sequence
+        stopSequence();
+        // Take the pending hand-off back from the IRQ before replacing it. The
+        // fence keeps the writes below from being moved ahead of the release.
+        mHandoffPending.store(false);
+        std::atomic_signal_fence(std::memory_order_seq_cst);
+        mHandoff = e;
+        if(e.groupID == 0) {
+            mHandoffOffset = activeElectrodeOffset(e.values);
+        }
+        mHandoffReady = false;
+        mHandoffCycles = 0;
+        mHandoffPending.store(true, std::memory_order_release);
+    }
+
+    void handleSequenceControl(events::SequenceControl &e) {
+        stopSequence();
+        if(!e.start || e.stepCount == 0 || e.stepCount > AppConfig::N_SEQUENCE_STEPS) {
+            return;
+        }
+        for(uint32_t i=0; i<e.stepCount; i++) {
+            mSequenceOffsets[i] = activeElectrodeOffset(mSequence[i].maskA);
+        }
+        mSequenceLength = e.stepCount;
+        mSequenceStep = 0;
+        mSequenceDwell = 0;
+        // Hand over to the IRQ, which loads the first step at the start of
+        // the next drive cycle
+        mSequenceRunning.store(true, std::memory_order_release);
+    }
+
+    void handleUpdateElectrodeSequence(events::UpdateElectrodeSequence &e) {
+        if(mSequenceRunning || e.offset + e.length > sizeof(mSequence)) {
+            // Refuse to change a running sequence, or overrun the table
+            return;
+        }
+        memcpy((uint8_t*)mSequence + e.offset, e.data, e.length);
+    }
+
+    void handleSetScanMask(events::SetScanMask &e) {
+        // Keep the IRQ from taking up a half-written mask
+        modm::atomic::Lock lck;
+        memcpy(&mScanMask[0], e.values, HV507::N_BYTES);
+    }
+
     void handleSetGain(events::SetGain &e) {
         for(uint32_t i=0; i<HV507::N_PINS; i++) {
             uint32_t offset = i / 8;
@@ -706,6 +1317,20 @@ private:
             return;
         }
         memcpy((uint8_t*)&mElectrodeCalibration + e.offset, e.data, e.length);
+        buildOffsetTable();
+    }
+
+    /** Compute the total electrode compensation offset for a scan group */
+    void updateGroupElectrodeOffset(uint8_t group) {
+        uint16_t offset = 0;
+        bool lowGain = mScanGroups.getGroupSetting(group) & 1;
+        for(uint32_t i=0; i<HV507::N_PINS; i++) {
+            if(mScanGroups.isPinActive(group, i)) {
+                offset += electrodeOffset(i, lowGain);
+            }
+        }
+        mGroupElectrodeOffsets[group] = offset;
+        mScanGroups.invalidatePlan();
     }
 };
 
@@ -1,6 +1,13 @@
 #pragma once
 
-#include <functional>
+#include <atomic>
+#include <cstdint>
+#include <new>
+#include <type_traits>
+
+#include <modm/architecture/interface/assert.hpp>
+
+#include "InplaceFunction.hpp"
 
 /** Simple event publishing framework
  *
@@ -8,13 +15,65 @@
  * the library with no heap allocation.
  *
  * An event may be any class inheriting from EventEx::Event.
+ *
+ * Handlers are kept in a separate list for each event type, so publishing an
+ * event only visits the handlers subscribed to that type. No RTTI is used.
+ *
+ * Events may be published from interrupt context with `publishFromIsr`, which
+ * copies the event into a fixed pool of slots. Queued events are delivered,
+ * in order, by calling `EventBroker::poll` from the main loop.
  */
+
+// Maximum number of distinct event types which may be registered with a broker
+#ifndef EVENTEX_MAX_EVENT_TYPES
+#define EVENTEX_MAX_EVENT_TYPES 32
+#endif
+
+// Number of events which may be queued from interrupts between calls to poll
+#ifndef EVENTEX_DEFERRED_SLOTS
+#define EVENTEX_DEFERRED_SLOTS 16
+#endif
+
+// Maximum size of an event published from an interrupt
+#ifndef EVENTEX_DEFERRED_SLOT_SIZE
+#define EVENTEX_DEFERRED_SLOT_SIZE 128
+#endif
+
 namespace EventEx {
 
 struct Event {
 
 };
 
+/** Provides a small, dense integer ID for each event type
+ *
+ * The ID is bound to the type by template instantiation, and assigned in
+ * order of first use, so it can be used directly as an index into a table of
+ * handler lists. Using more than MAX_TYPES types is a fatal error.
+ */
+struct EventTypeIndex {
+    static const uint32_t MAX_TYPES = EVENTEX_MAX_EVENT_TYPES;
+
+    template<typename T>
+    static uint32_t get() {
+        static const uint32_t index = assign();
+        return index;
+    }
+
+private:
+    static uint32_t assign() {
+        uint32_t index = next()++;
+        modm_assert(index < MAX_TYPES, "evtypes",
+            "Too many event types; increase EVENTEX_MAX_EVENT_TYPES");
+        return index;
+    }
+
+    static uint32_t &next() {
+        static uint32_t count = 0;
+        return count;
+    }
+};
+
 struct Registerable {
     struct Owner {
         virtual void remove(Registerable *) = 0;
@@ -36,7 +95,6 @@ struct Registerable {
 protected:
     Registerable *mNext;
     Owner *mOwner;
-    std::type_info *mEventTypeId;
 
     friend class RegistrationList;
     friend class EventBroker;
@@ -56,13 +114,6 @@ struct EventHandler : public Registerable {
     }
 
     virtual void operator ()(T &event) = 0;
-
-    void dispatch(Event &event) {
-        (*this)(dynamic_cast<T &>(event));
-    }
-
-private:
-
 };
 
 /** Utility class for creating an EventHandler from a lambda.
@@ -71,24 +122,25 @@ private:
  *
  *      EventHandlerFunction<SomeEvent> handler([&](SomeEvent &e) { this->HandleSomeEvent(e); })
  *
- * As I understand it, creating std::functions *can* allocate but almost certainly
- * will not do so when only storing a single pointer (e.g. `this`) with the lambda,
- * even if this isn't strictly guaranteed by C++17.
+ * The lambda is stored in an InplaceFunction, so it never allocates; a lambda
+ * with too large a capture will fail to compile.
  */
 template <typename T>
 struct EventHandlerFunction : public EventHandler<T> {
+    typedef InplaceFunction<void(T &)> Function;
+
     EventHandlerFunction() {}
 
-    EventHandlerFunction(std::function<void(T &)> f) : mFunc(f) {}
+    EventHandlerFunction(Function f) : mFunc(f) {}
 
-    void setFunction(std::function<void(T &)> f) {
+    void setFunction(Function f) {
         mFunc = f;
     }
 
     void operator()(T &event) override { mFunc(event); }
 
 private:
-    std::function<void(T &)> mFunc;
+    Function mFunc;
 };
 
 struct RegistrationList : public Registerable::Owner {
@@ -148,40 +200,163 @@ struct RegistrationList : public Registerable::Owner {
         }
     }
 
+    /** Remove all items, leaving them unowned */
+    void clear() {
+        Registerable *p = mTop;
+        while(p != nullptr) {
+            p->mOwner = nullptr;
+            p = p->mNext;
+        }
+        mTop = nullptr;
+    }
+
 private:
     Registerable *mTop;
 };
 
+struct EventBroker;
+
+/** Bounded, lock-free queue of event copies for delivery from the main loop
+ *
+ * Any number of interrupt priorities may push; only the main loop may pop.
+ * Each slot carries a sequence number: a producer claims a slot by advancing
+ * the head, copies the event in, then publishes the slot by updating its
+ * sequence. The consumer delivers slots strictly in claim order, so a slot
+ * claimed by a preempted producer holds back later events until it is
+ * complete.
+ */
+struct DeferredEventQueue {
+    static const uint32_t N_SLOTS = EVENTEX_DEFERRED_SLOTS;
+    static const uint32_t SLOT_SIZE = EVENTEX_DEFERRED_SLOT_SIZE;
+
+    DeferredEventQueue() : mHead(0), mTail(0), mOverflowCount(0) {
+        for(uint32_t i=0; i<N_SLOTS; i++) {
+            mSlots[i].seq.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    template<typename T>
+    bool push(const T &event) {
+        static_assert(sizeof(T) <= SLOT_SIZE, "Event is too large to publish from ISR; increase EVENTEX_DEFERRED_SLOT_SIZE");
+        static_assert(std::is_trivially_copyable<T>::value, "Events published from ISR must be trivially copyable");
+
+        uint32_t pos = mHead.load(std::memory_order_relaxed);
+        Slot *slot;
+        while(true) {
+            slot = &mSlots[pos % N_SLOTS];
+            int32_t diff = (int32_t)(slot->seq.load(std::memory_order_acquire) - pos);
+            if(diff == 0) {
+                if(mHead.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if(diff < 0) {
+                mOverflowCount.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            } else {
+                pos = mHead.load(std::memory_order_relaxed);
+            }
+        }
+        new (slot->data) T(event);
+        slot->deliver = &deliver<T>;
+        slot->seq.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    /** Deliver all complete events through the broker; returns number delivered */
+    uint32_t drain(EventBroker *broker) {
+        uint32_t count = 0;
+        while(true) {
+            Slot *slot = &mSlots[mTail % N_SLOTS];
+            if(slot->seq.load(std::memory_order_acquire) != mTail + 1) {
+                break;
+            }
+            slot->deliver(broker, slot->data);
+            slot->seq.store(mTail + N_SLOTS, std::memory_order_release);
+            mTail++;
+            count++;
+        }
+        return count;
+    }
+
+    /** Number of events refused because all slots were full */
+    uint32_t overflowCount() const {
+        return mOverflowCount.load(std::memory_order_relaxed);
+    }
+
+private:
+    struct Slot {
+        std::atomic<uint32_t> seq;
+        void (*deliver)(EventBroker *broker, void *data);
+        alignas(8) uint8_t data[SLOT_SIZE];
+    };
+
+    template<typename T>
+    static void deliver(EventBroker *broker, void *data);
+
+    Slot mSlots[N_SLOTS];
+    std::atomic<uint32_t> mHead;
+    uint32_t mTail;
+    std::atomic<uint32_t> mOverflowCount;
+};
+
 struct EventBroker {
 
     ~EventBroker() {
-        for(auto event : mEvents) {
-            event.unregister();
+        for(auto &list : mHandlers) {
+            list.clear();
         }
     }
 
     template<typename T>
     void publish(T &event) {
-        for(auto &handler : mEvents) {
-            if(*handler.mEventTypeId == typeid(event)) {
-                static_cast<EventHandler<Event>*>(&handler)->dispatch(event);
-            }
+        uint32_t index = EventTypeIndex::get<T>();
+        for(auto &handler : mHandlers[index]) {
+            // Only EventHandler<T> objects are ever added to this list
+            (*static_cast<EventHandler<T>*>(&handler))(event);
         }
     }
 
+    /** Subscribe a handler to events of type T */
     template<typename T>
     void registerHandler(EventHandler<T> *handler) {
-        handler->mOwner = &mEvents;
-        handler->mEventTypeId = const_cast<std::type_info*>(&typeid(T));
-        mEvents.push_back(handler);
+        uint32_t index = EventTypeIndex::get<T>();
+        handler->unregister();
+        handler->mOwner = &mHandlers[index];
+        mHandlers[index].push_back(handler);
     }
 
     void unregisterHandler(Registerable *reg) {
-        mEvents.remove(reg);
+        reg->unregister();
+    }
+
+    /** Queue a copy of an event for delivery from the main loop
+     *
+     * Safe to call from interrupt context. Returns false, and increments the
+     * overflow count, if the queue is full.
+     */
+    template<typename T>
+    bool publishFromIsr(const T &event) {
+        return mDeferred.push(event);
+    }
+
+    /** Deliver events queued by publishFromIsr; to be called from main loop */
+    void poll() {
+        mDeferred.drain(this);
+    }
+
+    /** Number of events dropped by publishFromIsr because the queue was full */
+    uint32_t deferredOverflowCount() const {
+        return mDeferred.overflowCount();
     }
 
 private:
-    RegistrationList mEvents;
+    RegistrationList mHandlers[EventTypeIndex::MAX_TYPES];
+    DeferredEventQueue mDeferred;
 };
 
+template<typename T>
+void DeferredEventQueue::deliver(EventBroker *broker, void *data) {
+    broker->publish(*std::launder(static_cast<T*>(data)));
+}
+
 } // namespace EventEx
\ No newline at end of file
@@ -1,9 +1,12 @@
 #pragma once
 
+#include <array>
+
 #include "AppConfig.hpp"
 
 #include "EventEx.hpp"
-#include "ScanGroups.hpp"
+#include "InplaceFunction.hpp"
+#include "ScanBuffer.hpp"
 
 using namespace EventEx;
 
@@ -26,13 +29,24 @@ struct CapActive : public Event {
 
 struct CapOffsetCalibrationRequest : public Event {}; 
 
+/** Announces a completed full capacitance scan
+ *
+ * The results are read from `buffer`, which holds the most recent scan. It
+ * may be newer than the one which triggered this event, if several scans
+ * complete before the event is delivered.
+ */
 struct CapScan : public Event {
-    const uint16_t *measurements; // Size is N_HV507 * 64
+    uint32_t sequence;
+    uint32_t timestamp; // us
+    ScanBuffer<AppConfig::N_PINS> *buffer;
 };
 
 struct CapGroups : public Event {
+    // Number of groups up to and including the last active one
+    uint8_t count;
     std::array<uint16_t, AppConfig::N_CAP_GROUPS> measurements;
-    ScanGroups<AppConfig::N_PINS, AppConfig::N_CAP_GROUPS> scanGroups;
+    // Setting byte of each group; bit 0 indicates low gain
+    std::array<uint8_t, AppConfig::N_CAP_GROUPS> settings;
 };
 
 struct ElectrodesUpdated : public Event {};
@@ -42,7 +56,7 @@ struct GpioControl : public Event {
     bool value;
     bool outputEnable;
     bool write;
-    std::function<void(uint8_t pin, bool value)> callback;
+    InplaceFunction<void(uint8_t pin, bool value)> callback;
 };
 
 struct SetGain : public Event {
@@ -50,13 +64,13 @@ struct SetGain : public Event {
 
     uint8_t data[(AppConfig::N_PINS + 3) / 4];
 
-    uint8_t get_channel(uint8_t channel) {
+    uint8_t get_channel(uint16_t channel) {
         uint32_t offset = channel / 4;
         uint32_t shift = (channel % 4) * 2;
         return (data[offset] >> shift) & 0x3;
     }
 
-    void set_channel(uint8_t channel, uint8_t value) {
+    void set_channel(uint16_t channel, uint8_t value) {
         uint32_t offset = channel / 4;
         uint32_t shift = (channel % 4) * 2;
         if(offset < sizeof(data)/sizeof(data[0])) {
@@ -72,24 +86,45 @@ struct SetElectrodes : public Event {
     uint8_t values[AppConfig::N_BYTES];
 };
 
+// Selects which electrodes are measured by the full capacitance scan
+struct SetScanMask : public Event {
+    // Bit N of byte M is set to include pin M*8+N
+    uint8_t values[AppConfig::N_BYTES];
+};
+
 struct SetDutyCycle : public Event {
-    bool updateA;
-    bool updateB;
-    uint8_t dutyCycleA;
-    uint8_t dutyCycleB;
+    // Bit n is set to update drive group n
+    uint8_t updateMask;
+    std::array<uint8_t, AppConfig::N_DRIVE_GROUPS> dutyCycles;
 };
 
+// Reports the duty cycles of drive groups 0 and 1
 struct DutyCycleUpdated : public Event {
     uint8_t dutyCycleA;
     uint8_t dutyCycleB;
 };
 
+// Configures one feedback loop. FeedbackCommandMsg sets loop 0, driving
+// groups 0 and 1 with the gain parameters.
 struct FeedbackCommand : public Event {
+    FeedbackCommand() :
+        target(0), mode(0), measureGroupsPMask(0), measureGroupsNMask(0), baseline(0),
+        loop(0), driveGroupA(0), driveGroupB(1), parameterGains(true), kp(0), ki(0), kd(0) {}
+
     float target;
     uint8_t mode;
-    uint8_t measureGroupsPMask;
-    uint8_t measureGroupsNMask;
+    uint32_t measureGroupsPMask;
+    uint32_t measureGroupsNMask;
     uint8_t baseline;
+    uint8_t loop;
+    // Drive groups for the positive and negative outputs
+    uint8_t driveGroupA;
+    uint8_t driveGroupB;
+    // Use the Feedback KP/KI/KD parameters, rather than kp/ki/kd
+    bool parameterGains;
+    float kp;
+    float ki;
+    float kd;
 };
 
 struct HvRegulatorUpdate : public Event {
@@ -102,7 +137,7 @@ struct SetParameter : public Event {
     ConfigOptionValue paramValue;
     // If set, this message is setting a param. If clear, this is requesting the current value.
     uint8_t writeFlag;
-    std::function<void(const uint32_t &idx, const ConfigOptionValue &paramValue)> callback;
+    InplaceFunction<void(const uint32_t &idx, const ConfigOptionValue &paramValue)> callback;
 };
 
 struct SetPwm : public Event {
@@ -122,4 +157,49 @@ struct UpdateElectrodeCalibration : public Event {
     const uint8_t *data; // Source data to copy
 };
 
+// Partial update of the electrode sequence table
+// Like calibrations, the table is sent via DataBlob messages, in chunks.
+struct UpdateElectrodeSequence : public Event {
+    uint16_t offset; // Offset of first byte to update
+    uint16_t length; // Number of bytes to copy
+    const uint8_t *data; // Source data to copy
+};
+
+// Starts or stops playback of the electrode sequence table
+struct SequenceControl : public Event {
+    bool start;
+    uint16_t stepCount; // Number of steps from the table to play
+};
+
+// Queues an electrode update to be made when a droplet arrives
+//
+// The update is made at the start of the first drive cycle after the
+// capacitance of `scanGroup` crosses `threshold`, or after `timeoutCycles`
+// drive cycles. A newly queued hand-off replaces any pending one.
+struct QueueHandoff : public Event {
+    uint8_t groupID; // Drive group to update
+    uint8_t setting; // Duty cycle for the group
+    uint8_t values[AppConfig::N_BYTES];
+    uint8_t scanGroup;
+    bool below; // Trigger when the capacitance falls below the threshold, rather than rises to it
+    uint16_t threshold;
+    uint16_t timeoutCycles; // 0 for no timeout
+};
+
+// Published when a queued hand-off is made
+struct HandoffComplete : public Event {
+    bool arrived; // False if the hand-off was made on timeout
+    uint16_t groupValue; // Scan group capacitance which triggered the hand-off
+    uint16_t cycles; // Drive cycles spent waiting
+    uint32_t timestamp; // us
+};
+
+// Published when the sequence moves to a new step, and when it stops
+struct SequenceProgress : public Event {
+    bool running;
+    uint16_t step; // Step now being driven; equal to stepCount once finished
+    uint16_t stepCount;
+    uint32_t timestamp; // us
+};
+
 } //namespace events
\ No newline at end of file
@@ -1,5 +1,7 @@
 #include "FeedbackControl.hpp"
 
+#include "modm/platform.hpp"
+
 static constexpr float INTEGRAL_MAX = 100.0;
 
 enum ControlMode_e : uint8_t {
@@ -10,7 +12,22 @@ enum ControlMode_e : uint8_t {
 
 void FeedbackControl::init(EventBroker *event_broker) {
     mEventBroker = event_broker;
-    mLastError = 0.0;
+    mMainLoopUpdating = false;
+    for(auto &loop : mLoops) {
+        loop.mode = Disabled;
+        loop.baseline = 0;
+        loop.driveGroupA = 0;
+        loop.driveGroupB = 1;
+        loop.target = 0;
+        loop.inputCount = 0;
+        loop.groupMask = 0;
+        loop.parameterGains = true;
+        loop.kp = loop.ki = loop.kd = 0;
+    }
+    buildCoefficients();
+    mFilterType = AppConfig::FeedbackFilter();
+    mFilterLength = AppConfig::FeedbackFilterLength();
+    mFilter.configure((InputFilterType)mFilterType, mFilterLength);
 
     mCapGroupsHandler.setFunction([this](auto &e){HandleCapGroups(e);});
     mEventBroker->registerHandler(&mCapGroupsHandler);
@@ -18,49 +35,127 @@ void FeedbackControl::init(EventBroker *event_broker) {
     mEventBroker->registerHandler(&mFeedbackCommandHandler);
 }
 
-void FeedbackControl::HandleCapGroups(events::CapGroups &event) {
-    float x = 0.0;
-    float kp = AppConfig::FeedbackKp();
-    float ki = AppConfig::FeedbackKi();
-    float kd = AppConfig::FeedbackKd();
+void FeedbackControl::poll() {
+    if(AppConfig::FeedbackKp() != mKp ||
+        AppConfig::FeedbackKi() != mKi ||
+        AppConfig::FeedbackKd() != mKd ||
+        AppConfig::HvControlTarget() != mHvTarget ||
+        AppConfig::LowGainR() != mLowGainR ||
+        AppConfig::HighGainR() != mHighGainR)
+    {
+        buildCoefficients();
+    }
+    if(AppConfig::FeedbackFilter() != mFilterType ||
+        AppConfig::FeedbackFilterLength() != mFilterLength)
+    {
+        mFilterType = AppConfig::FeedbackFilter();
+        mFilterLength = AppConfig::FeedbackFilterLength();
+        modm::atomic::Lock lck;
+        mFilter.configure((InputFilterType)mFilterType, mFilterLength);
+    }
+}
+
+void FeedbackControl::buildCoefficients() {
+    mKp = AppConfig::FeedbackKp();
+    mKi = AppConfig::FeedbackKi();
+    mKd = AppConfig::FeedbackKd();
+    mHvTarget = AppConfig::HvControlTarget();
+    mLowGainR = AppConfig::LowGainR();
+    mHighGainR = AppConfig::HighGainR();
+
+    // Counts per pF, per ohm of sense resistance
+    float gain = AppConfig::CapAmplifierGain() * mHvTarget * 1e-12f * 4096 / 3.3f;
+    auto highScale = Pid::inputCoefficient(1.0f / (gain * mHighGainR));
+    auto lowScale = Pid::inputCoefficient(1.0f / (gain * mLowGainR));
 
-    if(mCmd.mode == Disabled) {
-        mIntegral = 0;
+    modm::atomic::Lock lck;
+    mCountScale[0] = highScale;
+    mCountScale[1] = lowScale;
+    for(auto &loop : mLoops) {
+        if(loop.parameterGains) {
+            setLoopGains(loop);
+        }
+    }
+}
+
+void FeedbackControl::setLoopGains(Loop &loop) {
+    if(loop.parameterGains) {
+        loop.pid.setGains(mKp, mKi, mKd, INTEGRAL_MAX);
+    } else {
+        loop.pid.setGains(loop.kp, loop.ki, loop.kd, INTEGRAL_MAX);
+    }
+}
+
+uint8_t FeedbackControl::updateFromIsr(const events::CapGroups &e, DutyCycles &dutyCycles) {
+    if(!AppConfig::FeedbackInIrq() || mMainLoopUpdating) {
+        return 0;
+    }
+    return update(e, dutyCycles);
+}
+
+void FeedbackControl::HandleCapGroups(events::CapGroups &e) {
+    // The controller state is shared with the interrupt path, which may
+    // start running at any time when the parameter is changed. Rather than
+    // hold off the drive interrupt for the whole update, it is told to leave
+    // the controllers alone until this one is done.
+    mMainLoopUpdating = true;
+    if(AppConfig::FeedbackInIrq()) {
+        mMainLoopUpdating = false;
         return;
     }
+    events::SetDutyCycle set_event;
+    set_event.updateMask = update(e, set_event.dutyCycles);
+    mMainLoopUpdating = false;
+    if(set_event.updateMask != 0) {
+        mEventBroker->publish(set_event);
+    }
+}
 
-    // Always Sum all of the positive feedback inputs
-    // In differential mode, also sum the negative feedback inputs
-    for(uint32_t ch=0; ch<event.measurements.size(); ch++) {
-        // Compute scale value to convert raw counts to pF
-        float gain = AppConfig::CapAmplifierGain() * AppConfig::HvControlTarget() * 1e-12 * 4096 / 3.3;
-        if(event.scanGroups.getGroupSetting(ch) & 1) {
-            gain *= AppConfig::LowGainR();
+uint8_t FeedbackControl::update(const events::CapGroups &event, DutyCycles &dutyCycles) {
+    uint32_t groups = 0;
+    for(auto &loop : mLoops) {
+        if(loop.mode == Disabled) {
+            loop.pid.resetIntegral();
         } else {
-            gain *= AppConfig::HighGainR();
-        }
-        if(mCmd.measureGroupsPMask & (1<<ch)) {
-            x += event.measurements[ch] / gain;
+            groups |= loop.groupMask;
         }
-        if(mCmd.mode == Differential && mCmd.measureGroupsNMask & (1<<ch)) {
-            x -= event.measurements[ch] / gain;
+    }
+
+    // Each input group is filtered once, however many loops use it
+    uint16_t measurements[AppConfig::N_CAP_GROUPS];
+    for(uint32_t ch=0; ch<AppConfig::N_CAP_GROUPS; ch++) {
+        if(groups & (1ul<<ch)) {
+            measurements[ch] = mFilter.push(ch, event.measurements[ch], event.settings[ch]);
         }
     }
 
-    float error = mCmd.target - x;
+    uint8_t mask = 0;
+    // Where loops share a drive group, the higher numbered loop wins
+    for(auto &loop : mLoops) {
+        if(loop.mode != Disabled) {
+            updateLoop(loop, event, measurements, dutyCycles);
+            mask |= (1 << loop.driveGroupA) | (1 << loop.driveGroupB);
+        }
+    }
+    return mask;
+}
 
-    mIntegral += error * ki;
-    if(mIntegral * ki > INTEGRAL_MAX) {
-        mIntegral = INTEGRAL_MAX / ki;
-    } else if(mIntegral *ki < -INTEGRAL_MAX) {
-        mIntegral = -INTEGRAL_MAX / ki;
+void FeedbackControl::updateLoop(Loop &loop, const events::CapGroups &event, const uint16_t *measurements, DutyCycles &dutyCycles) {
+    Pid::Accumulator x = 0;
+    for(uint32_t i=0; i<loop.inputCount; i++) {
+        uint8_t ch = loop.inputs[i].group;
+        auto value = Pid::scale(mCountScale[event.settings[ch] & 1], measurements[ch]);
+        if(loop.inputs[i].negative) {
+            x -= value;
+        } else {
+            x += value;
+        }
     }
 
-    int16_t feedback = (int16_t)(error * kp + mIntegral * ki + (error - mLastError) * kd);
-    mLastError = error;
+    int16_t feedback = loop.pid.update(Pid::value(loop.target - x));
     int16_t pos_output, neg_output;
     if(feedback > 0) {
-        pos_output = (int16_t)mCmd.baseline + feedback;
+        pos_output = (int16_t)loop.baseline + feedback;
         if(pos_output > 255) {
             pos_output = 255;
         }
@@ -69,7 +164,7 @@ void FeedbackControl::HandleCapGroups(events::CapGroups &event) {
             neg_output = 0;
         }
     } else {
-        neg_output = (int16_t)mCmd.baseline - feedback;
+        neg_output = (int16_t)loop.baseline - feedback;
         if(neg_output > 255) {
             neg_output = 255;
         }
@@ -79,14 +174,47 @@ void FeedbackControl::HandleCapGroups(events::CapGroups &event) {
         }
     }
 
-    events::SetDutyCycle set_event;
-    set_event.updateA = true;
-    set_event.updateB = true;
-    set_event.dutyCycleA = (uint8_t)pos_output;
-    set_event.dutyCycleB = (uint8_t)neg_output;
-    mEventBroker->publish(set_event);
+    dutyCycles[loop.driveGroupA] = (uint8_t)pos_output;
+    dutyCycles[loop.driveGroupB] = (uint8_t)neg_output;
 }
 
 void FeedbackControl::HandleFeedbackCommand(events::FeedbackCommand &e) {
-    mCmd = e;
-}
\ No newline at end of file
+    if(e.loop >= AppConfig::N_FEEDBACK_LOOPS ||
+        e.driveGroupA >= AppConfig::N_DRIVE_GROUPS ||
+        e.driveGroupB >= AppConfig::N_DRIVE_GROUPS)
+    {
+        return;
+    }
+
+    // Always sum all of the positive feedback inputs
+    // In differential mode, also subtract the negative feedback inputs
+    std::array<Input, 2 * AppConfig::N_CAP_GROUPS> inputs;
+    uint32_t count = 0;
+    uint32_t groupMask = 0;
+    for(uint8_t ch=0; ch<AppConfig::N_CAP_GROUPS; ch++) {
+        if(e.measureGroupsPMask & (1ul<<ch)) {
+            inputs[count++] = {ch, false};
+            groupMask |= 1ul<<ch;
+        }
+        if(e.mode == Differential && e.measureGroupsNMask & (1ul<<ch)) {
+            inputs[count++] = {ch, true};
+            groupMask |= 1ul<<ch;
+        }
+    }
+
+    modm::atomic::Lock lck;
+    Loop &loop = mLoops[e.loop];
+    loop.mode = e.mode;
+    loop.baseline = e.baseline;
+    loop.driveGroupA = e.driveGroupA;
+    loop.driveGroupB = e.driveGroupB;
+    loop.target = Pid::fromFloat(e.target);
+    loop.inputs = inputs;
+    loop.inputCount = count;
+    loop.groupMask = groupMask;
+    loop.parameterGains = e.parameterGains;
+    loop.kp = e.kp;
+    loop.ki = e.ki;
+    loop.kd = e.kd;
+    setLoopGains(loop);
+}
@@ -1,26 +1,95 @@
 #pragma once
 
+#include <array>
+#include <atomic>
+
 #include "Events.hpp"
+#include "FeedbackPid.hpp"
+#include "InputFilter.hpp"
+
+// Set to 1 to use the fixed point controller, for parts without an FPU
+#ifndef PURPLEDROP_FIXED_POINT_FEEDBACK
+#define PURPLEDROP_FIXED_POINT_FEEDBACK 0
+#endif
 
 /** Capacitance feedback controller. 
-* Implements the control loop by listening to capacitance measurement events
-* and firing SetDutyCycle events. 
+* Implements the control loops by listening to capacitance measurement events
+* and firing SetDutyCycle events. Each of the N_FEEDBACK_LOOPS loops has its
+* own target, input groups, gains and pair of drive groups, and all are
+* updated from the same group scan.
 */
 class FeedbackControl {
 public:
+#if PURPLEDROP_FIXED_POINT_FEEDBACK
+    typedef FixedPid Pid;
+#else
+    typedef FloatPid Pid;
+#endif
+    typedef std::array<uint8_t, AppConfig::N_DRIVE_GROUPS> DutyCycles;
 
     void init(EventBroker *event_broker);
 
+    /** Rebuild the controller coefficients after a change of parameters
+     *
+     * Called from the main loop.
+     */
+    void poll();
+
+    /** Run the control loops on a group scan, from the drive interrupt
+     *
+     * Used when the FeedbackInIrq parameter is set, in which case the main
+     * loop handler ignores CapGroups events. Returns a mask of the drive
+     * groups given new duty cycles.
+     */
+    uint8_t updateFromIsr(const events::CapGroups &e, DutyCycles &dutyCycles);
+
 private:
+    // A group measurement summed into a loop's input
+    struct Input {
+        uint8_t group;
+        bool negative;
+    };
+
+    struct Loop {
+        uint8_t mode;
+        uint8_t baseline;
+        uint8_t driveGroupA;
+        uint8_t driveGroupB;
+        Pid::Value target;
+        // Groups selected by the positive and negative masks of the command
+        std::array<Input, 2 * AppConfig::N_CAP_GROUPS> inputs;
+        uint32_t inputCount;
+        // Bit n set if group n is an input
+        uint32_t groupMask;
+        // Gains from the command, unless following the parameters
+        bool parameterGains;
+        float kp, ki, kd;
+        Pid pid;
+    };
+
     EventBroker *mEventBroker;
+    // Set while the main loop runs the controllers, so that the interrupt
+    // path skips a scan rather than run them at the same time, should the
+    // FeedbackInIrq parameter change
+    std::atomic<bool> mMainLoopUpdating;
 
     EventEx::EventHandlerFunction<events::CapGroups> mCapGroupsHandler;
     EventEx::EventHandlerFunction<events::FeedbackCommand> mFeedbackCommandHandler;
 
-    events::FeedbackCommand mCmd;
-    float mLastError;
-    float mIntegral;
+    std::array<Loop, AppConfig::N_FEEDBACK_LOOPS> mLoops;
+    // Applied to the input groups of all loops, ahead of the controllers
+    InputFilter<AppConfig::N_CAP_GROUPS> mFilter;
+    uint32_t mFilterType, mFilterLength;
+    // Conversion from measured counts to pF, for high and low gain
+    Pid::Coefficient mCountScale[2];
+    // Parameters the coefficients were computed from
+    float mKp, mKi, mKd;
+    float mHvTarget, mLowGainR, mHighGainR;
 
+    void buildCoefficients();
+    void setLoopGains(Loop &loop);
+    uint8_t update(const events::CapGroups &e, DutyCycles &dutyCycles);
+    void updateLoop(Loop &loop, const events::CapGroups &e, const uint16_t *measurements, DutyCycles &dutyCycles);
     void HandleCapGroups(events::CapGroups &e);
     void HandleFeedbackCommand(events::FeedbackCommand &e);
-};
\ No newline at end of file
+};
@@ -0,0 +1,172 @@
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <limits>
+
+/** Floating point PID controller
+ *
+ * The integral of the error is accumulated scaled by ki, and scaled by ki
+ * again for the output; it is limited so that its contribution to the
+ * output stays within +/- integralMax.
+ *
+ * Coefficients are computed once, when the gains change, so that update
+ * does no divides. FixedPid has the same interface.
+ */
+struct FloatPid {
+    typedef float Value;
+    // Sum of several Values, before it is converted back with value()
+    typedef float Accumulator;
+    typedef float Coefficient;
+
+    static Coefficient coefficient(float x) { return x; }
+    // Coefficient for scale() which converts an integer input to a Value
+    static Coefficient inputCoefficient(float x) { return x; }
+    static Value fromFloat(float x) { return x; }
+    static float toFloat(Value x) { return x; }
+    static Value value(Accumulator x) { return x; }
+    static Value scale(Coefficient c, int32_t x) { return c * x; }
+
+    FloatPid() : mIntegral(0), mLastError(0) {
+        setGains(0, 0, 0, 0);
+    }
+
+    void setGains(float kp, float ki, float kd, float integralMax) {
+        mKp = kp;
+        mKi = ki;
+        mKd = kd;
+        mIntegralLimit = ki != 0 ? std::fabs(integralMax / ki) : std::numeric_limits<float>::infinity();
+    }
+
+    void resetIntegral() {
+        mIntegral = 0;
+    }
+
+    /** Return the output for a new error value, truncated to an integer */
+    int16_t update(Value error) {
+        mIntegral += error * mKi;
+        if(mIntegral > mIntegralLimit) {
+            mIntegral = mIntegralLimit;
+        } else if(mIntegral < -mIntegralLimit) {
+            mIntegral = -mIntegralLimit;
+        }
+        float output = error * mKp + mIntegral * mKi + (error - mLastError) * mKd;
+        mLastError = error;
+        if(output > INT16_MAX) {
+            return INT16_MAX;
+        } else if(output < INT16_MIN) {
+            return INT16_MIN;
+        }
+        return (int16_t)output;
+    }
+
+private:
+    float mKp, mKi, mKd;
+    float mIntegralLimit;
+    float mIntegral;
+    float mLastError;
+};
+
+/** Fixed point equivalent of FloatPid
+ *
+ * Values are Q16.16. Each coefficient is a Q31 mantissa with a right shift,
+ * so gains from well below 1 up to 2^31 keep full precision, and applying
+ * one is a single 32x32->64 bit multiply and shift. The integral, and so
+ * the limit on it, saturates at the largest Value.
+ */
+struct FixedPid {
+    typedef int32_t Value;
+    typedef int64_t Accumulator;
+    struct Coefficient {
+        int32_t mantissa;
+        uint8_t shift;
+    };
+
+    static Coefficient coefficient(float x) {
+        int exp;
+        // x = f * 2^exp, with 0.5 <= |f| < 1
+        float f = std::frexp(x, &exp);
+        int shift = 31 - exp;
+        if(x == 0 || !std::isfinite(x) || shift > 62) {
+            return {0, 0};
+        }
+        if(shift < 0) {
+            return {x < 0 ? -INT32_MAX : INT32_MAX, 0};
+        }
+        int64_t mantissa = std::llround(std::ldexp(f, 31));
+        if(mantissa > INT32_MAX) {
+            mantissa = INT32_MAX;
+        } else if(mantissa < -INT32_MAX) {
+            mantissa = -INT32_MAX;
+        }
+        return {(int32_t)mantissa, (uint8_t)shift};
+    }
+
+    static Coefficient inputCoefficient(float x) {
+        return coefficient(x * 65536);
+    }
+
+    static Value fromFloat(float x) {
+        return value(std::llround((double)x * 65536));
+    }
+
+    static float toFloat(Value x) {
+        return x / 65536.0f;
+    }
+
+    static Value value(Accumulator x) {
+        if(x > INT32_MAX) {
+            return INT32_MAX;
+        } else if(x < -INT32_MAX) {
+            return -INT32_MAX;
+        }
+        return (Value)x;
+    }
+
+    static Value scale(Coefficient c, int32_t x) {
+        return value(((int64_t)x * c.mantissa) >> c.shift);
+    }
+
+    FixedPid() : mIntegral(0), mLastError(0) {
+        setGains(0, 0, 0, 0);
+    }
+
+    void setGains(float kp, float ki, float kd, float integralMax) {
+        mKp = coefficient(kp);
+        mKi = coefficient(ki);
+        mKd = coefficient(kd);
+        mIntegralLimit = ki != 0 ? fromFloat(std::fabs(integralMax / ki)) : INT32_MAX;
+    }
+
+    void resetIntegral() {
+        mIntegral = 0;
+    }
+
+    /** Return the output for a new error value, truncated to an integer */
+    int16_t update(Value error) {
+        Accumulator integral = (Accumulator)mIntegral + scale(mKi, error);
+        if(integral > mIntegralLimit) {
+            integral = mIntegralLimit;
+        } else if(integral < -mIntegralLimit) {
+            integral = -mIntegralLimit;
+        }
+        mIntegral = (Value)integral;
+        Value change = value((Accumulator)error - mLastError);
+        Accumulator output = (Accumulator)scale(mKp, error) + scale(mKi, mIntegral) + scale(mKd, change);
+        mLastError = error;
+        // Truncate towards zero, as the float cast does
+        output /= 65536;
+        if(output > INT16_MAX) {
+            return INT16_MAX;
+        } else if(output < INT16_MIN) {
+            return INT16_MIN;
+        }
+        return (int16_t)output;
+    }
+
+private:
+    Coefficient mKp, mKi, mKd;
+    Value mIntegralLimit;
+    Value mIntegral;
+    Value mLastError;
+};
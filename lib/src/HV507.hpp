@@ -1,19 +1,16 @@
 
+#pragma once
 #include <modm/platform.hpp>
 
-using std::literals::chrono_literals::operator""ns;
+#include "AppConfig.hpp"
 
-static uint16_t medianof3(uint16_t a, uint16_t b, uint16_t c) {
-    if(a < b && a < c) {
-        return std::min(b, c);
-    } else if(b < a && b < c) {
-        return std::min(a, c);
-    } else {
-        return std::min(a, b);
-    }
-}
+using std::literals::chrono_literals::operator""ns;
 
 /** Provides low level control of a pair of HV507 chips
+ *
+ * SPI must provide a non-blocking transmit, `startTransfer(tx, length)`, and
+ * `waitTransfer()` to block until it has finished, e.g. StmDmaSpi or
+ * SamPdcSpi, in addition to the modm SpiMaster interface.
  */
 template<typename PINS, class SPI, class Analog>
 class HV507 {
@@ -25,6 +22,10 @@ public:
     static const uint32_t N_BYTES = AppConfig::N_BYTES;
     typedef std::array<uint8_t, N_BYTES> PinMask;
 
+    static const uint32_t SPI_BAUDRATE = 6000000;
+    // Time to shift a full mask into the chain, rounded up
+    static const uint32_t LOAD_TIME_US = (N_BYTES * 8 * 1000000 + SPI_BAUDRATE - 1) / SPI_BAUDRATE;
+
     enum class GainSetting : uint8_t{
         High = 0,
         Low
@@ -33,8 +34,9 @@ public:
     template<typename SystemClock>
     static void
     init() {
-        SPI::template initialize<SystemClock, 6000000>();
+        SPI::template initialize<SystemClock, SPI_BAUDRATE>();
         SPI::setDataOrder(SPI::DataOrder::MsbFirst);
+        setOptoInverted(AppConfig::InvertedOpto());
 
         PINS::SCAN_SYNC::setOutput(false);
         PINS::INT_RESET::setOutput(true);
@@ -45,6 +47,27 @@ public:
         PINS::LE::setOutput(false);
     }
 
+    /** Set the polarity of the opto-isolators on the control lines
+     *
+     * Inverts the control pins and the SPI clock. Any transfer in progress is
+     * completed first.
+     */
+    static void
+    setOptoInverted(bool inverted) {
+        waitShiftRegister();
+        if(inverted) {
+            SPI::setDataMode(SPI::DataMode::Mode2); // Set CPOL = 1, inverted clock
+        } else {
+            SPI::setDataMode(SPI::DataMode::Mode0); // Set CPOL = 0, non-inverted clock
+        }
+        PINS::POL::setInvert(inverted);
+        PINS::BL::setInvert(inverted);
+        PINS::LE::setInvert(inverted);
+        PINS::SCK::setInvert(inverted);
+        PINS::MOSI::setInvert(inverted);
+        PINS::AUGMENT_ENABLE::setInvert(inverted);
+    }
+
     inline static void
     setPolarity(bool pol) {
         if(pol) {
@@ -97,13 +120,34 @@ public:
         PINS::INT_RESET::reset();
     }
 
+    /** Begin shifting `shift_reg` into the HV507s, without waiting for it
+     *
+     * The transfer runs in the background. The outputs are not affected until
+     * the next latchShiftRegister, which waits for the transfer to finish.
+     */
+    inline static void
+    startLoadShiftRegister(const PinMask &shift_reg) {
+        // The SPI reads from sTxBuffer until the previous transfer is done
+        SPI::waitTransfer();
+        sTxBuffer = shift_reg;
+        SPI::startTransfer(&sTxBuffer[0], N_BYTES);
+    }
+
+    /** Wait until a load started by startLoadShiftRegister has completed */
+    inline static void
+    waitShiftRegister() {
+        SPI::waitTransfer();
+    }
+
     inline static void
-    loadShiftRegister(PinMask shift_reg) {
-        SPI::transferBlocking(&shift_reg[0], 0, N_BYTES);
+    loadShiftRegister(const PinMask &shift_reg) {
+        startLoadShiftRegister(shift_reg);
+        waitShiftRegister();
     }
 
     inline static void
     latchShiftRegister() {
+        waitShiftRegister();
         PINS::LE::setOutput(true);
         // Per datasheet, min LE pulse width is 80ns
         modm::delay(80ns);
@@ -129,5 +173,21 @@ public:
     readIntVout() {
         return Analog::readIntVout();
     }
+
+    /** Take `n` back-to-back readings of the integrator output */
+    inline static void
+    readIntVoutBurst(uint16_t *samples, uint32_t n) {
+        Analog::readIntVoutBurst(samples, n);
+    }
+
+    /** Read the HV rail feedback into the regulator's sample ring */
+    inline static void
+    sampleHvFeedback() {
+        Analog::sampleVhvDiff();
+    }
+
+private:
+    // Source of the SPI transfer; must not change while it is in progress
+    alignas(4) inline static PinMask sTxBuffer;
 };
 
@@ -26,7 +26,7 @@ concept IDacOut = requires(T a) {
 
 template<IDacOut Dac, class Analog>
 struct HvRegulator {
-    HvRegulator() : mTimer(CONTROL_PERIOD_US), mIntegral(0.0) {}
+    HvRegulator() : mTimer(CONTROL_PERIOD_US), mVoltageMeasure(0.0), mIntegral(0.0) {}
 
     void init(EventEx::EventBroker *broker) {
         mBroker = broker;
@@ -36,11 +36,17 @@ struct HvRegulator {
         if(mTimer.poll()) {
             events::HvRegulatorUpdate event;
             uint16_t output = 0;
-            int32_t vdiff = 0;
-            for(uint32_t i=0; i<N_OVERSAMPLE; i++) {
-                vdiff += Analog::readVhvDiff();
+            // Readings are normally taken by the drive interrupt; read them
+            // directly only if it has not
+            float vdiff;
+            if(!Analog::takeVhvDiffMean(vdiff)) {
+                int32_t sum = 0;
+                for(uint32_t i=0; i<N_OVERSAMPLE; i++) {
+                    sum += Analog::readVhvDiff();
+                }
+                vdiff = (float)sum / N_OVERSAMPLE;
             }
-            float vcal = (float)vdiff/N_OVERSAMPLE * VSCALE;
+            float vcal = vdiff * VSCALE;
             mVoltageMeasure = mVoltageMeasure * (1 - FILTER) + vcal * FILTER;
             if(AppConfig::HvControlEnabled()) {
                 float target = AppConfig::HvControlTarget();
@@ -0,0 +1,125 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+// Default storage for captured state, in bytes
+#ifndef INPLACE_FUNCTION_CAPACITY
+#define INPLACE_FUNCTION_CAPACITY (4 * sizeof(void*))
+#endif
+
+template<typename Signature, size_t Capacity = INPLACE_FUNCTION_CAPACITY>
+struct InplaceFunction;
+
+/** Fixed capacity replacement for std::function which never allocates
+ *
+ * The callable is stored in a buffer inside the object. Storing a callable
+ * which does not fit is a compile error, so the capacity may need to be
+ * increased for lambdas with larger captures.
+ *
+ * Calling an empty InplaceFunction does nothing, and returns a
+ * default-constructed value.
+ */
+template<typename R, typename... Args, size_t Capacity>
+struct InplaceFunction<R(Args...), Capacity> {
+    InplaceFunction() : mOps(nullptr) {}
+
+    InplaceFunction(std::nullptr_t) : mOps(nullptr) {}
+
+    template<
+        typename F,
+        typename = typename std::enable_if<!std::is_same<typename std::decay<F>::type, InplaceFunction>::value>::type
+    >
+    InplaceFunction(F &&f) : mOps(nullptr) {
+        assign(std::forward<F>(f));
+    }
+
+    InplaceFunction(const InplaceFunction &other) : mOps(other.mOps) {
+        if(mOps) {
+            mOps->copy(mStorage, other.mStorage);
+        }
+    }
+
+    ~InplaceFunction() {
+        reset();
+    }
+
+    InplaceFunction & operator=(const InplaceFunction &other) {
+        if(this != &other) {
+            reset();
+            if(other.mOps) {
+                other.mOps->copy(mStorage, other.mStorage);
+                mOps = other.mOps;
+            }
+        }
+        return *this;
+    }
+
+    InplaceFunction & operator=(std::nullptr_t) {
+        reset();
+        return *this;
+    }
+
+    template<
+        typename F,
+        typename = typename std::enable_if<!std::is_same<typename std::decay<F>::type, InplaceFunction>::value>::type
+    >
+    InplaceFunction & operator=(F &&f) {
+        reset();
+        assign(std::forward<F>(f));
+        return *this;
+    }
+
+    R operator()(Args... args) const {
+        if(mOps == nullptr) {
+            return R();
+        }
+        return mOps->invoke(const_cast<uint8_t*>(mStorage), std::forward<Args>(args)...);
+    }
+
+    explicit operator bool() const { return mOps != nullptr; }
+
+private:
+    struct Ops {
+        R (*invoke)(void *f, Args... args);
+        void (*copy)(void *dst, const void *src);
+        void (*destroy)(void *f);
+    };
+
+    template<typename F>
+    struct OpsFor {
+        static R invoke(void *f, Args... args) {
+            return (*static_cast<F*>(f))(std::forward<Args>(args)...);
+        }
+        static void copy(void *dst, const void *src) {
+            new (dst) F(*static_cast<const F*>(src));
+        }
+        static void destroy(void *f) {
+            static_cast<F*>(f)->~F();
+        }
+        static constexpr Ops ops = {&invoke, &copy, &destroy};
+    };
+
+    template<typename F>
+    void assign(F &&f) {
+        typedef typename std::decay<F>::type Fn;
+        static_assert(sizeof(Fn) <= Capacity, "Callable is too large for InplaceFunction; increase its capacity");
+        static_assert(alignof(Fn) <= alignof(std::max_align_t), "Callable alignment is not supported by InplaceFunction");
+        static_assert(std::is_copy_constructible<Fn>::value, "InplaceFunction requires a copyable callable");
+        new (mStorage) Fn(std::forward<F>(f));
+        mOps = &OpsFor<Fn>::ops;
+    }
+
+    void reset() {
+        if(mOps) {
+            mOps->destroy(mStorage);
+            mOps = nullptr;
+        }
+    }
+
+    const Ops *mOps;
+    alignas(std::max_align_t) uint8_t mStorage[Capacity];
+};
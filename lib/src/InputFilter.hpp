@@ -0,0 +1,130 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+
+// Limit of the configurable filter length
+static const uint32_t MAX_INPUT_FILTER_LENGTH = 8;
+
+enum class InputFilterType : uint8_t {
+    None = 0,
+    // Exponential moving average, with alpha = 2 / (length + 1)
+    Ema = 1,
+    // Mean of the last `length` readings
+    MovingAverage = 2,
+    // Median of the last `length` readings
+    Median = 3
+};
+
+/** Smooths a stream of readings on each of N channels
+ *
+ * State is kept per channel in fixed-size buffers. Each reading carries a
+ * tag, e.g. the gain setting it was measured with; readings are only combined
+ * with earlier ones of the same tag, and a change of tag restarts the
+ * channel. Until a channel has `length` readings, the average and median use
+ * those it has.
+ */
+template<uint32_t N, uint32_t MAX_LENGTH = MAX_INPUT_FILTER_LENGTH>
+class InputFilter {
+public:
+    InputFilter() : mType(InputFilterType::None), mLength(1), mEmaAlpha(0) {
+        reset();
+    }
+
+    /** Select the filter; channel history is cleared if it changes */
+    void configure(InputFilterType type, uint32_t length) {
+        if(type > InputFilterType::Median) {
+            type = InputFilterType::None;
+        }
+        if(length < 1) {
+            length = 1;
+        } else if(length > MAX_LENGTH) {
+            length = MAX_LENGTH;
+        }
+        if(type == mType && length == mLength) {
+            return;
+        }
+        mType = type;
+        mLength = length;
+        // Q16
+        mEmaAlpha = (2 << 16) / (length + 1);
+        reset();
+    }
+
+    InputFilterType type() const { return mType; }
+    uint32_t length() const { return mLength; }
+
+    void reset() {
+        mCount.fill(0);
+    }
+
+    /** Add a reading to a channel and return the filtered value */
+    uint16_t push(uint32_t ch, uint16_t x, uint8_t tag = 0) {
+        if(mType == InputFilterType::None) {
+            return x;
+        }
+        if(mCount[ch] == 0 || mTag[ch] != tag) {
+            mTag[ch] = tag;
+            mCount[ch] = 0;
+            mPos[ch] = 0;
+            mState[ch] = 0;
+        }
+
+        if(mType == InputFilterType::Ema) {
+            if(mCount[ch] == 0) {
+                mState[ch] = (uint32_t)x << 16;
+                mCount[ch] = 1;
+            } else {
+                int64_t delta = ((int64_t)x << 16) - mState[ch];
+                mState[ch] += (delta * mEmaAlpha) >> 16;
+            }
+            return ((uint64_t)mState[ch] + 0x8000) >> 16;
+        }
+
+        // The moving average keeps a running sum of the history
+        auto &history = mHistory[ch];
+        if((uint32_t)mCount[ch] == mLength) {
+            mState[ch] -= history[mPos[ch]];
+        } else {
+            mCount[ch]++;
+        }
+        history[mPos[ch]] = x;
+        mState[ch] += x;
+        uint32_t next = (uint32_t)mPos[ch] + 1;
+        mPos[ch] = next == mLength ? 0 : next;
+
+        uint32_t n = mCount[ch];
+        if(mType == InputFilterType::MovingAverage) {
+            return (mState[ch] + n / 2) / n;
+        }
+        return median(history.data(), n);
+    }
+
+private:
+    static uint16_t median(const uint16_t *values, uint32_t n) {
+        uint16_t sorted[MAX_LENGTH];
+        for(uint32_t i=0; i<n; i++) {
+            uint16_t v = values[i];
+            uint32_t j = i;
+            while(j > 0 && sorted[j - 1] > v) {
+                sorted[j] = sorted[j - 1];
+                j--;
+            }
+            sorted[j] = v;
+        }
+        if(n % 2 == 1) {
+            return sorted[n / 2];
+        }
+        return ((uint32_t)sorted[n / 2 - 1] + sorted[n / 2] + 1) / 2;
+    }
+
+    InputFilterType mType;
+    uint32_t mLength;
+    uint32_t mEmaAlpha;
+    std::array<std::array<uint16_t, MAX_LENGTH>, N> mHistory;
+    // Running sum for the moving average, or Q16 value for the EMA
+    std::array<uint32_t, N> mState;
+    std::array<uint8_t, N> mCount;
+    std::array<uint8_t, N> mPos;
+    std::array<uint8_t, N> mTag;
+};
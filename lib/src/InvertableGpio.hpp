@@ -1,14 +1,30 @@
+#pragma once
+
+#include "AppConfig.hpp"
+
 /** Wrapper for Gpio to allow for runtime inversion
+ *
+ * If Polarity is 0 or 1, the pin is fixed as non-inverted or inverted at
+ * compile time, and setInvert has no effect. The default follows the
+ * PURPLEDROP_INVERTED_OPTO build option.
  */
-template < class Pin >
+template < class Pin, int Polarity = PURPLEDROP_INVERTED_OPTO >
 class InvertableGpio : public Pin
 {
 public:
-	
-    inline static bool isInverted = false;
+    static constexpr bool FIXED = Polarity >= 0;
+
+    inline static bool isInverted() {
+        if constexpr(FIXED) {
+            return Polarity > 0;
+        }
+        return sInverted;
+    }
 
     inline static void setInvert(bool invert) {
-        isInverted = invert;
+        if constexpr(!FIXED) {
+            sInverted = invert;
+        }
     }
 
 	using Pin::setOutput;
@@ -20,17 +36,13 @@ public:
 	inline static void
 	setOutput(bool value)
 	{
-        if(isInverted) {
-		    Pin::setOutput(!value);
-        } else {
-            Pin::setOutput(value);
-        }
+        Pin::setOutput(value != isInverted());
 	}
 
 	inline static void
 	set()
 	{
-        if(isInverted) {
+        if(isInverted()) {
 		    Pin::reset();
         } else {
             Pin::set();
@@ -40,17 +52,13 @@ public:
 	inline static void
 	set(bool value)
 	{
-        if(isInverted) {
-		    Pin::set(!value);
-        } else {
-            Pin::set(value);
-        }
+        Pin::set(value != isInverted());
 	}
 
 	inline static void
 	reset()
 	{
-        if(isInverted) {
+        if(isInverted()) {
 		    Pin::set();
         } else {
             Pin::reset();
@@ -60,20 +68,15 @@ public:
 	inline static bool
 	read()
 	{
-        if(isInverted) {
-		    return !Pin::read();
-        } else {
-            return Pin::read();
-        }
+        return Pin::read() != isInverted();
 	}
 
 	inline static bool
 	isSet()
 	{
-        if(isInverted) {
-		    return !Pin::isSet();
-        } else {
-            return Pin::isSet();
-        }
+        return Pin::isSet() != isInverted();
 	}
+
+private:
+    inline static bool sInverted = false;
 };
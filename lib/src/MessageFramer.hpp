@@ -31,8 +31,11 @@ struct Checksum {
 };
 
 /* Parses framed messages to provide unescaped payloads
+ *
+ * By default the buffer is sized for the largest frame TParser can predict,
+ * given by its MAX_SIZE.
 */
-template<typename TParser, uint32_t MAX_SIZE = 256>
+template<typename TParser, uint32_t MAX_SIZE = TParser::MAX_SIZE>
 struct MessageFramer {
 
     MessageFramer() {
@@ -57,6 +60,11 @@ struct MessageFramer {
         if(!mParsing) {
             return false;
         }
+        if(mCount >= MAX_SIZE) {
+            // Too long to be a valid message
+            reset();
+            return false;
+        }
 
         mBuf[mCount] = b;
         mCount++;
@@ -91,27 +99,48 @@ struct MessageFramer {
 private:
     bool mEscaping;
     bool mParsing;
-    uint8_t mCount;
+    uint16_t mCount;
     uint8_t mBuf[MAX_SIZE];
 };
 
+/** Destination for frames built by a Serializer
+ *
+ * Provides the buffer in which the Serializer builds each frame, and then
+ * receives the complete frame in a single call. A sink must accept all of a
+ * frame, or none of it, so that a partial frame is never sent.
+ */
+struct FrameSink {
+    FrameSink(uint8_t *buf, uint32_t size) : frameBuffer(buf), frameBufferSize(size) {}
+
+    /** Send a complete frame; returns false if it was refused */
+    virtual bool writeFrame(const uint8_t *frame, uint32_t length) = 0;
+
+    uint8_t *const frameBuffer;
+    const uint32_t frameBufferSize;
+};
+
+/** Frames and escapes message payloads
+ *
+ * With a FrameSink, the escaped frame is built in the sink's buffer and
+ * handed over whole by `finish`. A frame which overflows the buffer is
+ * discarded. With an IProducer, bytes are passed on one at a time as they are
+ * pushed.
+ */
 struct Serializer{
-    Serializer() : Serializer(nullptr) {}
+    Serializer() : Serializer((IProducer<uint8_t>*)nullptr) {}
+
+    Serializer(IProducer<uint8_t> *sink) :
+        mStarted(false), mSink(sink), mFrameSink(nullptr), mLength(0), mOverflow(false) {}
 
-    Serializer(IProducer<uint8_t> *sink) : mStarted(false), mSink(sink)  {}
+    Serializer(FrameSink *sink) :
+        mStarted(false), mSink(nullptr), mFrameSink(sink), mLength(0), mOverflow(false) {}
 
-    void setSink(IProducer<uint8_t>  *sink) { mSink = sink; };
+    void setSink(IProducer<uint8_t>  *sink) { mSink = sink; mFrameSink = nullptr; };
+
+    void setSink(FrameSink *sink) { mFrameSink = sink; mSink = nullptr; };
 
     void push(uint8_t b, bool last = false)  {
-        if(!mSink) {
-            return;
-        }
-        if(!mStarted) {
-            mSink->push(0x7e); // preface with start of frame code
-            mStarted = true;
-        }
-        mCs.push(b);
-        send_with_escape(b);
+        pushBytes(&b, 1);
         if(last) {
             finish();
         }
@@ -119,17 +148,54 @@ struct Serializer{
 
     template<typename T>
     void push(T value, bool last = false) {
-        uint8_t *p = (uint8_t*)&value;
-        for(uint32_t i=0; i<sizeof(value); i++) {
-            push(p[i]);
-        }
+        pushBytes((const uint8_t*)&value, sizeof(value));
         if(last) {
             finish();
         }
     }
 
+    /** Push a block of payload bytes */
+    void pushBytes(const uint8_t *data, uint32_t length) {
+        if(!start()) {
+            return;
+        }
+        if(mFrameSink) {
+            // Worst case, every byte must be escaped
+            if(mLength + 2 * length > mFrameSink->frameBufferSize) {
+                mOverflow = true;
+                return;
+            }
+            uint8_t *out = mFrameSink->frameBuffer + mLength;
+            for(uint32_t i=0; i<length; i++) {
+                uint8_t b = data[i];
+                mCs.push(b);
+                if(b == 0x7d || b == 0x7e) {
+                    *out++ = 0x7d;
+                    *out++ = b ^ 0x20;
+                } else {
+                    *out++ = b;
+                }
+            }
+            mLength = out - mFrameSink->frameBuffer;
+        } else {
+            for(uint32_t i=0; i<length; i++) {
+                mCs.push(data[i]);
+                send_with_escape(data[i]);
+            }
+        }
+    }
+
     void send_with_escape(uint8_t b) {
-        if(b == 0x7d || b == 0x7e) {
+        if(mFrameSink) {
+            if(mLength + 2 > mFrameSink->frameBufferSize) {
+                mOverflow = true;
+            } else if(b == 0x7d || b == 0x7e) {
+                mFrameSink->frameBuffer[mLength++] = 0x7d;
+                mFrameSink->frameBuffer[mLength++] = b ^ 0x20;
+            } else {
+                mFrameSink->frameBuffer[mLength++] = b;
+            }
+        } else if(b == 0x7d || b == 0x7e) {
             mSink->push(0x7d);
             mSink->push(b ^ 0x20);
         } else {
@@ -137,17 +203,53 @@ struct Serializer{
         }
     }
 
-    void finish() {
-        // Send the CRC
-        send_with_escape(mCs.a);
-        send_with_escape(mCs.b);
+    /** Complete the frame
+     *
+     * Returns false if the frame could not be sent.
+     */
+    bool finish() {
+        bool sent = true;
+        if(start()) {
+            // Send the CRC
+            send_with_escape(mCs.a);
+            send_with_escape(mCs.b);
+            if(mFrameSink) {
+                sent = !mOverflow && mFrameSink->writeFrame(mFrameSink->frameBuffer, mLength);
+            }
+        }
         // Setup to be re-used on a new packet
         mStarted = false;
         mCs.reset();
+        mLength = 0;
+        mOverflow = false;
+        return sent;
     }
 
 private:
+    /** Begin the frame if it hasn't been already; returns false if there is
+     * nowhere to send it */
+    bool start() {
+        if(mFrameSink) {
+            if(!mStarted) {
+                mFrameSink->frameBuffer[0] = 0x7e;
+                mLength = 1;
+                mStarted = true;
+            }
+            return true;
+        } else if(mSink) {
+            if(!mStarted) {
+                mSink->push(0x7e); // preface with start of frame code
+                mStarted = true;
+            }
+            return true;
+        }
+        return false;
+    }
+
     bool mStarted;
     Checksum mCs;
     IProducer<uint8_t> *mSink;
-};
\ No newline at end of file
+    FrameSink *mFrameSink;
+    uint32_t mLength;
+    bool mOverflow;
+};
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <algorithm>
 #include <cstdint>
 #include <cstring>
 #include "MessageFramer.hpp"
@@ -51,7 +52,7 @@ struct ElectrodeEnableMsg {
     static int predictSize(uint8_t *buf, uint32_t length) {
         (void)buf;
         (void)length;
-        return 19;
+        return 3 + AppConfig::N_BYTES;
     }
 
     bool fill(uint8_t* buf, uint32_t length) {
@@ -61,29 +62,29 @@ struct ElectrodeEnableMsg {
 
         groupID = buf[1];
         setting = buf[2];
-        for(int i=0; i<16; i++) {
+        for(uint32_t i=0; i<AppConfig::N_BYTES; i++) {
             values[i] = buf[i+3];
         }
 
         return true;
     }
 
-    uint8_t groupID; // Which enable group is being set
+    uint8_t groupID; // Which enable group is being set: 0-7 drive groups, 100+ scan groups
     uint8_t setting; // Context dependent, e.g. may be a duty cycle or a gain setting
-    uint8_t values[16]; // Bit mask for 128 electrodes
+    uint8_t values[AppConfig::N_BYTES]; // Bit mask for all electrodes
 };
 
 struct BulkCapacitanceMsg {
     static const uint8_t ID = 2;
     static const uint8_t MAX_VALUES = 16;
 
-    BulkCapacitanceMsg() : groupScan(0), startIndex(0), count(0) {}
+    BulkCapacitanceMsg() : groupScan(0), startIndex(0), count(0), sequence(0) {}
 
     static int predictSize(uint8_t *buf, uint32_t length) {
-        if(length < 4) {
+        if(length < 5) {
             return 0;
         } else {
-            return buf[3] * 2 + 4;
+            return buf[4] * 2 + 7;
         }
     }
 
@@ -93,13 +94,14 @@ struct BulkCapacitanceMsg {
         }
 
         groupScan = buf[1];
-        startIndex = buf[2];
-        count = buf[3];
+        startIndex = (uint16_t)buf[2] + (uint16_t)buf[3] * 256;
+        count = buf[4];
         if(count > MAX_VALUES) {
             return false;
         }
+        sequence = (uint16_t)buf[5] + (uint16_t)buf[6] * 256;
         for(int i=0; i<count; i++) {
-            values[i] = (uint16_t)buf[4 + i*2] + (uint16_t)buf[5 + i*2] * 256;
+            values[i] = (uint16_t)buf[7 + i*2] + (uint16_t)buf[8 + i*2] * 256;
         }
         return true;
     }
@@ -107,23 +109,27 @@ struct BulkCapacitanceMsg {
     void serialize(Serializer &ser) {
         ser.push(ID);
         ser.push(groupScan);
-        ser.push(startIndex);
+        ser.push((uint8_t)(startIndex & 0xff));
+        ser.push((uint8_t)(startIndex >> 8));
         ser.push(count);
-        for(int i=0; i<count; i++) {
-            ser.push((uint8_t)(values[i] & 0xff));
-            ser.push((uint8_t)(values[i] >> 8));
-        }
+        ser.push((uint8_t)(sequence & 0xff));
+        ser.push((uint8_t)(sequence >> 8));
+        // Values are little-endian on the wire, as they are in memory
+        ser.pushBytes((const uint8_t*)values, count * 2);
         ser.finish();
     }
 
     uint8_t groupScan; // 0 - full scan, 1 - group scan
-    uint8_t startIndex;
+    uint16_t startIndex;
     uint8_t count;
+    // Low 16 bits of the full scan sequence number; 0 for group scans
+    uint16_t sequence;
     uint16_t values[MAX_VALUES];
 };
 
 struct ActiveCapacitanceMsg {
     static const uint8_t ID = 3;
+    static const uint32_t MAX_PAYLOAD_SIZE = 6;
 
     uint16_t baseline;
     uint16_t measurement;
@@ -141,6 +147,7 @@ struct ActiveCapacitanceMsg {
 struct CommandAckMsg {
     static const uint8_t ID = 4;
     static const uint8_t MAX_VALUES = 64;
+    static const uint32_t MAX_PAYLOAD_SIZE = 2;
 
     CommandAckMsg() : acked_id(0) {}
 
@@ -149,7 +156,7 @@ struct CommandAckMsg {
     static int predictSize(uint8_t *buf, uint32_t length) {
         (void)buf;
         (void)length;
-        return 2;
+        return MAX_PAYLOAD_SIZE;
     }
 
     bool fill(uint8_t *buf, uint32_t length) {
@@ -213,6 +220,7 @@ struct ParameterMsg {
 struct TemperatureMsg {
     static const uint8_t ID = 7;
     static const uint32_t MAX_COUNT = AppConfig::N_TEMP_SENSOR;
+    static const uint32_t MAX_PAYLOAD_SIZE = 2 + 2 * MAX_COUNT;
     uint8_t count; // Number
     int16_t temps[MAX_COUNT]; // degC * 100
 
@@ -231,6 +239,7 @@ struct TemperatureMsg {
 
 struct HvRegulatorMsg {
     static const uint8_t ID = 8;
+    static const uint32_t MAX_PAYLOAD_SIZE = 7;
 
     float voltage;
     uint16_t vTargetOut;
@@ -270,11 +279,13 @@ struct SetPwmMsg {
 enum DataBlobId : uint16_t {
     SoftwareVersionBlob = 0,
     OffsetCalibration = 1,
+    ElectrodeSequence = 2,
 };
 
 struct DataBlobMsg {
     static const uint8_t ID = 10;
     static const uint32_t MAX_SIZE = 250;
+    static const uint32_t MAX_PAYLOAD_SIZE = 5 + MAX_SIZE;
 
     uint8_t blob_id;
     uint8_t payload_size;
@@ -312,27 +323,25 @@ struct DataBlobMsg {
         ser.push(blob_id);
         ser.push(size);
         ser.push(chunk_index);
-        for(uint32_t i=0; i<size; i++) {
-            ser.push(data[i]);
-        }
+        ser.pushBytes(data, size);
         ser.finish();
     }
 };
 
 struct SetGainMsg {
     static const uint8_t ID = 11;
-    static const uint8_t MAX_COUNT = 128;
-    static const uint8_t MAX_BYTES = (MAX_COUNT+3) / 4; // round up
-    uint8_t count;
+    static const uint32_t MAX_COUNT = AppConfig::N_PINS;
+    static const uint32_t MAX_BYTES = (MAX_COUNT+3) / 4; // round up
+    uint16_t count;
     uint8_t data[MAX_BYTES];
     SetGainMsg() : count(0), data{0} {}
 
     static int predictSize(uint8_t *buf, uint32_t length) {
-        (void)buf;
-        if(length < 2) {
+        if(length < 3) {
             return 0;
         } else {
-            return 2 + (buf[1] + 3) / 4;
+            uint32_t count = (uint32_t)buf[1] + (uint32_t)buf[2] * 256;
+            return 3 + (count + 3) / 4;
         }
     }
 
@@ -341,14 +350,17 @@ struct SetGainMsg {
             return false;
         }
 
-        count = buf[1];
-        for(uint32_t i=0; i<count && i <MAX_COUNT; i+=4) {
-            data[i/4] = buf[i/4+2];
+        count = (uint16_t)buf[1] + (uint16_t)buf[2] * 256;
+        if(count > MAX_COUNT) {
+            count = MAX_COUNT;
+        }
+        for(uint32_t i=0; i<count; i+=4) {
+            data[i/4] = buf[i/4+3];
         }
         return true;
     }
 
-    uint8_t get_channel(uint8_t channel) {
+    uint8_t get_channel(uint16_t channel) {
         uint32_t offset = channel / 4;
         uint32_t shift = (channel % 4) * 2;
         return (data[offset] >> shift) & 0x3;
@@ -384,7 +396,6 @@ struct ParameterDescriptorMsg {
     }    
 
     void serialize(Serializer &ser) {
-        uint32_t len;
         // Total size of name + description + type  + the two null terminators separating them
         uint16_t str_size = strlen(name) + strlen(description) + strlen(type) + 2;
         
@@ -394,20 +405,10 @@ struct ParameterDescriptorMsg {
         ser.push(*((uint32_t*)defaultValue));
         ser.push(sequence_number);
         ser.push(sequence_total);
-        len = strlen(name);
-        for(uint32_t i=0; i<len; i++) {
-            ser.push(name[i]);
-        }
-        ser.push((uint8_t)0); // null separator
-        len = strlen(description);
-        for(uint32_t i=0; i<len; i++) {
-            ser.push(description[i]);
-        }
-        ser.push((uint8_t)0); // null separator
-        len = strlen(type);
-        for(uint32_t i=0; i<len; i++) {
-            ser.push(type[i]);
-        }
+        // Strings are sent including their null separators
+        ser.pushBytes((const uint8_t*)name, strlen(name) + 1);
+        ser.pushBytes((const uint8_t*)description, strlen(description) + 1);
+        ser.pushBytes((const uint8_t*)type, strlen(type));
         ser.finish();
     }
 };
@@ -487,6 +488,7 @@ struct GpioControlMsg {
 
 struct DutyCycleUpdatedMsg {
     static const uint8_t ID = 15;
+    static const uint32_t MAX_PAYLOAD_SIZE = 3;
 
     void serialize(Serializer &ser) {
         ser.push(ID);
@@ -539,10 +541,417 @@ struct FeedbackCommandMsg {
     uint8_t baseline;
 };
 
+/** Carries a complete capacitance scan, or a range of one, in a single message
+ *
+ * Unlike BulkCapacitanceMsg, the count is 16-bit, so a scan of any size fits
+ * in one frame.
+ */
+struct CapScanMsg {
+    static const uint8_t ID = 18;
+    static const uint16_t MAX_VALUES = AppConfig::N_PINS;
+    static const uint32_t HEADER_SIZE = 13;
+
+    CapScanMsg() : sequence(0), timestamp(0), startIndex(0), count(0) {}
+
+    static int predictSize(uint8_t *buf, uint32_t length) {
+        if(length < HEADER_SIZE) {
+            return 0;
+        }
+        uint16_t count = (uint16_t)buf[11] + (uint16_t)buf[12] * 256;
+        if(count > MAX_VALUES) {
+            return -1;
+        }
+        return HEADER_SIZE + count * 2;
+    }
+
+    bool fill(uint8_t *buf, uint32_t length) {
+        if(length == 0 || (int)length != predictSize(buf, length)) {
+            return false;
+        }
+        memcpy(&sequence, &buf[1], 4);
+        memcpy(&timestamp, &buf[5], 4);
+        startIndex = (uint16_t)buf[9] + (uint16_t)buf[10] * 256;
+        count = (uint16_t)buf[11] + (uint16_t)buf[12] * 256;
+        for(uint32_t i=0; i<count; i++) {
+            values[i] = (uint16_t)buf[HEADER_SIZE + i*2] + (uint16_t)buf[HEADER_SIZE + 1 + i*2] * 256;
+        }
+        return true;
+    }
+
+    void serialize(Serializer &ser) {
+        serialize(ser, sequence, timestamp, startIndex, count, values);
+    }
+
+    /** Serialize values held elsewhere, e.g. in a scan frame, without first
+     * copying them into a message */
+    static void serialize(Serializer &ser, uint32_t sequence, uint32_t timestamp, uint16_t startIndex, uint16_t count, const uint16_t *values) {
+        ser.push(ID);
+        ser.push(sequence);
+        ser.push(timestamp);
+        ser.push(startIndex);
+        ser.push(count);
+        ser.pushBytes((const uint8_t*)values, count * 2);
+        ser.finish();
+    }
+
+    uint32_t sequence; // Scan sequence number, incremented for each full scan
+    uint32_t timestamp; // us; time at which the scan completed
+    uint16_t startIndex;
+    uint16_t count;
+    uint16_t values[MAX_VALUES];
+};
+
+/** Selects the electrodes included in the full capacitance scan
+ *
+ * Unselected electrodes are skipped, and reported as 0 in scan results. An
+ * empty mask stops the full scan.
+ */
+struct ScanMaskMsg {
+    static const uint8_t ID = 17;
+
+    ScanMaskMsg() : values{0} {}
+
+    ScanMaskMsg(uint8_t *buf, uint32_t length) : ScanMaskMsg() {
+        fill(buf, length);
+    }
+
+    static int predictSize(uint8_t *buf, uint32_t length) {
+        (void)buf;
+        (void)length;
+        return 1 + AppConfig::N_BYTES;
+    }
+
+    bool fill(uint8_t *buf, uint32_t length) {
+        if(length == 0 || (int)length != predictSize(buf, length)) {
+            return false;
+        }
+        for(uint32_t i=0; i<AppConfig::N_BYTES; i++) {
+            values[i] = buf[i+1];
+        }
+        return true;
+    }
+
+    void serialize(Serializer &ser) {
+        ser.push(ID);
+        ser.pushBytes(values, AppConfig::N_BYTES);
+        ser.finish();
+    }
+
+    uint8_t values[AppConfig::N_BYTES]; // Bit mask for all electrodes
+};
+
+/** Number of messages the device has dropped, in each priority class
+ *
+ * Sent periodically whenever the counts change. Counts are totals since
+ * reset, in the order: replies, telemetry, bulk capacitance data, and
+ * events raised in interrupts which were lost because the queue for them
+ * was full.
+ */
+struct TxDropCountMsg {
+    static const uint8_t ID = 19;
+    static const uint32_t N_COUNTS = 4;
+    static const uint32_t MAX_PAYLOAD_SIZE = 1 + 4 * N_COUNTS;
+
+    TxDropCountMsg() : counts{0} {}
+
+    static int predictSize(uint8_t *buf, uint32_t length) {
+        (void)buf;
+        (void)length;
+        return MAX_PAYLOAD_SIZE;
+    }
+
+    bool fill(uint8_t *buf, uint32_t length) {
+        if(length == 0 || (int)length != predictSize(buf, length)) {
+            return false;
+        }
+        memcpy(counts, &buf[1], sizeof(counts));
+        return true;
+    }
+
+    void serialize(Serializer &ser) {
+        ser.push(ID);
+        ser.pushBytes((const uint8_t*)counts, sizeof(counts));
+        ser.finish();
+    }
+
+    uint32_t counts[N_COUNTS];
+};
+
+/** Starts or stops the on-device electrode sequence
+ *
+ * The sequence table is uploaded beforehand with ElectrodeSequence data blobs.
+ * Starting plays the first `stepCount` steps of the table, beginning on the
+ * next drive cycle.
+ */
+struct SequenceControlMsg {
+    static const uint8_t ID = 20;
+
+    enum Command : uint8_t {
+        Stop = 0,
+        Start = 1,
+    };
+
+    SequenceControlMsg() : command(Stop), stepCount(0) {}
+
+    SequenceControlMsg(uint8_t *buf, uint32_t length) : SequenceControlMsg() {
+        fill(buf, length);
+    }
+
+    static int predictSize(uint8_t *buf, uint32_t length) {
+        (void)buf;
+        (void)length;
+        return 4;
+    }
+
+    bool fill(uint8_t *buf, uint32_t length) {
+        if(length == 0 || (int)length != predictSize(buf, length)) {
+            return false;
+        }
+        command = buf[1];
+        stepCount = (uint16_t)buf[2] + (uint16_t)buf[3] * 256;
+        return true;
+    }
+
+    void serialize(Serializer &ser) {
+        ser.push(ID);
+        ser.push(command);
+        ser.push(stepCount);
+        ser.finish();
+    }
+
+    uint8_t command;
+    uint16_t stepCount;
+};
+
+/** Reports progress of the on-device electrode sequence
+ *
+ * Sent when each step begins, and when the sequence stops.
+ */
+struct SequenceStatusMsg {
+    static const uint8_t ID = 21;
+    static const uint32_t MAX_PAYLOAD_SIZE = 10;
+
+    SequenceStatusMsg() : running(0), step(0), stepCount(0), timestamp(0) {}
+
+    static int predictSize(uint8_t *buf, uint32_t length) {
+        (void)buf;
+        (void)length;
+        return MAX_PAYLOAD_SIZE;
+    }
+
+    bool fill(uint8_t *buf, uint32_t length) {
+        if(length == 0 || (int)length != predictSize(buf, length)) {
+            return false;
+        }
+        running = buf[1];
+        step = (uint16_t)buf[2] + (uint16_t)buf[3] * 256;
+        stepCount = (uint16_t)buf[4] + (uint16_t)buf[5] * 256;
+        memcpy(&timestamp, &buf[6], 4);
+        return true;
+    }
+
+    void serialize(Serializer &ser) {
+        ser.push(ID);
+        ser.push(running);
+        ser.push(step);
+        ser.push(stepCount);
+        ser.push(timestamp);
+        ser.finish();
+    }
+
+    uint8_t running;
+    uint16_t step; // Step now being driven; equal to stepCount once finished
+    uint16_t stepCount;
+    uint32_t timestamp; // us
+};
+
+/** Queues an electrode update to be made when a droplet arrives
+ *
+ * The device makes the update at the start of the first drive cycle after
+ * the capacitance of `scanGroup` reaches `threshold` (or falls below it, if
+ * the Below flag is set), or after `timeoutCycles` drive cycles if not zero.
+ * It then sends a HandoffStatusMsg.
+ */
+struct HandoffMsg {
+    static const uint8_t ID = 22;
+    static const uint8_t BelowFlag = 1;
+
+    HandoffMsg() : groupID(0), setting(0), values{0}, scanGroup(0), flags(0), threshold(0), timeoutCycles(0) {}
+
+    HandoffMsg(uint8_t *buf, uint32_t length) : HandoffMsg() {
+        fill(buf, length);
+    }
+
+    static int predictSize(uint8_t *buf, uint32_t length) {
+        (void)buf;
+        (void)length;
+        return 9 + AppConfig::N_BYTES;
+    }
+
+    bool fill(uint8_t *buf, uint32_t length) {
+        if(length == 0 || (int)length != predictSize(buf, length)) {
+            return false;
+        }
+        groupID = buf[1];
+        setting = buf[2];
+        memcpy(values, &buf[3], AppConfig::N_BYTES);
+        uint8_t *p = &buf[3 + AppConfig::N_BYTES];
+        scanGroup = p[0];
+        flags = p[1];
+        threshold = (uint16_t)p[2] + (uint16_t)p[3] * 256;
+        timeoutCycles = (uint16_t)p[4] + (uint16_t)p[5] * 256;
+        return true;
+    }
+
+    void serialize(Serializer &ser) {
+        ser.push(ID);
+        ser.push(groupID);
+        ser.push(setting);
+        ser.pushBytes(values, AppConfig::N_BYTES);
+        ser.push(scanGroup);
+        ser.push(flags);
+        ser.push(threshold);
+        ser.push(timeoutCycles);
+        ser.finish();
+    }
+
+    uint8_t groupID;
+    uint8_t setting;
+    uint8_t values[AppConfig::N_BYTES];
+    uint8_t scanGroup;
+    uint8_t flags;
+    uint16_t threshold;
+    uint16_t timeoutCycles;
+};
+
+/** Reports that a queued hand-off has been made */
+struct HandoffStatusMsg {
+    static const uint8_t ID = 23;
+    static const uint32_t MAX_PAYLOAD_SIZE = 10;
+
+    HandoffStatusMsg() : arrived(0), groupValue(0), cycles(0), timestamp(0) {}
+
+    static int predictSize(uint8_t *buf, uint32_t length) {
+        (void)buf;
+        (void)length;
+        return MAX_PAYLOAD_SIZE;
+    }
+
+    bool fill(uint8_t *buf, uint32_t length) {
+        if(length == 0 || (int)length != predictSize(buf, length)) {
+            return false;
+        }
+        arrived = buf[1];
+        groupValue = (uint16_t)buf[2] + (uint16_t)buf[3] * 256;
+        cycles = (uint16_t)buf[4] + (uint16_t)buf[5] * 256;
+        memcpy(&timestamp, &buf[6], 4);
+        return true;
+    }
+
+    void serialize(Serializer &ser) {
+        ser.push(ID);
+        ser.push(arrived);
+        ser.push(groupValue);
+        ser.push(cycles);
+        ser.push(timestamp);
+        ser.finish();
+    }
+
+    uint8_t arrived; // 0 if the hand-off was made on timeout
+    uint16_t groupValue; // Scan group capacitance which triggered the hand-off
+    uint16_t cycles; // Drive cycles spent waiting
+    uint32_t timestamp; // us; start of the drive cycle with the new electrodes
+};
+
+/** Configures one of the feedback control loops
+ *
+ * Each loop sums the scan groups in measureGroupsPMask (less those in
+ * measureGroupsNMask, in differential mode), and drives driveGroupA and
+ * driveGroupB around the baseline duty cycle to hold the sum at target. All
+ * loops are updated from the same group scan. Mode 0 stops the loop.
+ * FeedbackCommandMsg is equivalent to loop 0 driving groups 0 and 1 with the
+ * gain parameters.
+ */
+struct FeedbackLoopMsg {
+    static const uint8_t ID = 24;
+    static const uint8_t ParameterGainsFlag = 1;
+
+    FeedbackLoopMsg() :
+        loop(0), mode(0), baseline(0), driveGroupA(0), driveGroupB(1), flags(0),
+        target(0), measureGroupsPMask(0), measureGroupsNMask(0), kp(0), ki(0), kd(0) {}
+
+    FeedbackLoopMsg(uint8_t *buf, uint32_t length) : FeedbackLoopMsg() {
+        fill(buf, length);
+    }
+
+    static int predictSize(uint8_t *buf, uint32_t length) {
+        (void)buf;
+        (void)length;
+        return 31;
+    }
+
+    bool fill(uint8_t *buf, uint32_t length) {
+        if(length == 0 || (int)length != predictSize(buf, length)) {
+            return false;
+        }
+        loop = buf[1];
+        mode = buf[2];
+        baseline = buf[3];
+        driveGroupA = buf[4];
+        driveGroupB = buf[5];
+        flags = buf[6];
+        memcpy(&target, &buf[7], 4);
+        memcpy(&measureGroupsPMask, &buf[11], 4);
+        memcpy(&measureGroupsNMask, &buf[15], 4);
+        memcpy(&kp, &buf[19], 4);
+        memcpy(&ki, &buf[23], 4);
+        memcpy(&kd, &buf[27], 4);
+        return true;
+    }
+
+    void serialize(Serializer &ser) {
+        ser.push(ID);
+        ser.push(loop);
+        ser.push(mode);
+        ser.push(baseline);
+        ser.push(driveGroupA);
+        ser.push(driveGroupB);
+        ser.push(flags);
+        ser.push(target);
+        ser.push(measureGroupsPMask);
+        ser.push(measureGroupsNMask);
+        ser.push(kp);
+        ser.push(ki);
+        ser.push(kd);
+        ser.finish();
+    }
+
+    uint8_t loop;
+    uint8_t mode;
+    uint8_t baseline;
+    uint8_t driveGroupA;
+    uint8_t driveGroupB;
+    uint8_t flags;
+    float target;
+    uint32_t measureGroupsPMask;
+    uint32_t measureGroupsNMask;
+    // Used unless ParameterGainsFlag is set
+    float kp;
+    float ki;
+    float kd;
+};
+
 #define PREDICT(msgname) case msgname::ID: \
     return msgname::predictSize(buf, length);
 
 struct Messages {
+    // Largest frame the parser may need to hold, including the checksum: a
+    // full CapScanMsg, or a data blob of the largest size its length field allows
+    static const uint32_t MAX_SIZE = std::max<uint32_t>(
+        CapScanMsg::HEADER_SIZE + 2 * CapScanMsg::MAX_VALUES,
+        5 + UINT8_MAX
+    ) + 2;
+
     static int predictSize(uint8_t *buf, uint32_t length) {
         if(length < 1) {
             return 0; // No message type yet, so no idea how long
@@ -552,14 +961,22 @@ struct Messages {
         switch(id) {
             PREDICT(BulkCapacitanceMsg)
             PREDICT(CalibrateCommandMsg)
+            PREDICT(CapScanMsg)
             PREDICT(DataBlobMsg)
             PREDICT(ElectrodeEnableMsg)
             PREDICT(FeedbackCommandMsg)
+            PREDICT(FeedbackLoopMsg)
             PREDICT(GpioControlMsg)
+            PREDICT(HandoffMsg)
+            PREDICT(HandoffStatusMsg)
             PREDICT(ParameterDescriptorMsg)
             PREDICT(ParameterMsg)
+            PREDICT(ScanMaskMsg)
+            PREDICT(SequenceControlMsg)
+            PREDICT(SequenceStatusMsg)
             PREDICT(SetGainMsg)
             PREDICT(SetPwmMsg)
+            PREDICT(TxDropCountMsg)
             default:
                 return -1;
         }
@@ -10,6 +10,7 @@
 struct PeriodicPollingTimer {
     PeriodicPollingTimer(uint32_t period_us, bool drop_on_overrun = false) : 
         mPeriod(period_us), 
+        mNextTime(0),
         mDropOnOverrun(drop_on_overrun) 
     {}
 
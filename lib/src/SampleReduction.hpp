@@ -0,0 +1,54 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+
+/** Ways to combine repeated ADC readings of the same value */
+enum class SampleReduction : uint8_t {
+    // Average of all readings
+    Mean = 0,
+    // Average of the median of each group of three readings
+    Median3 = 1,
+    // Average of all readings but the lowest and highest
+    TrimmedMean = 2,
+};
+
+static inline uint16_t medianof3(uint16_t a, uint16_t b, uint16_t c) {
+    if(a < b && a < c) {
+        return std::min(b, c);
+    } else if(b < a && b < c) {
+        return std::min(a, c);
+    } else {
+        return std::min(a, b);
+    }
+}
+
+/** Combine `n` readings into one value
+ *
+ * Median3 uses n / 3 groups, ignoring any readings left over. Where there
+ * are too few readings for the selected reduction, the mean is used.
+ */
+static inline uint16_t reduceSamples(const uint16_t *samples, uint32_t n, SampleReduction reduction) {
+    if(n == 0) {
+        return 0;
+    }
+    uint32_t sum = 0;
+    if(reduction == SampleReduction::Median3 && n >= 3) {
+        uint32_t groups = n / 3;
+        for(uint32_t i=0; i<groups; i++) {
+            sum += medianof3(samples[3*i], samples[3*i+1], samples[3*i+2]);
+        }
+        return sum / groups;
+    }
+    uint16_t lo = samples[0];
+    uint16_t hi = samples[0];
+    for(uint32_t i=0; i<n; i++) {
+        sum += samples[i];
+        lo = std::min(lo, samples[i]);
+        hi = std::max(hi, samples[i]);
+    }
+    if(reduction == SampleReduction::TrimmedMean && n >= 3) {
+        return (sum - lo - hi) / (n - 2);
+    }
+    return sum / n;
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+/** Ring of recent readings, written from an interrupt and averaged by the
+ * main loop
+ *
+ * The writer never waits, and the reader never disables interrupts. The
+ * reader takes at most N/2 of the newest readings, so the writer would have
+ * to push N/2 more during a single read to overwrite one in use.
+ *
+ * There may be only one writer and one reader.
+ */
+template<typename T, uint32_t N>
+struct SampleRing {
+    static_assert(N > 0 && (N & (N - 1)) == 0, "N must be a power of 2");
+
+    SampleRing() : mRead(0), mWritten(0) {}
+
+    void push(T x) {
+        uint32_t w = mWritten.load(std::memory_order_relaxed);
+        mValues[w % N] = x;
+        mWritten.store(w + 1, std::memory_order_release);
+    }
+
+    /** Sum the readings pushed since the last call, up to N/2 of the newest
+     *
+     * Returns the number of readings summed.
+     */
+    uint32_t takeSum(int32_t &sum) {
+        uint32_t w = mWritten.load(std::memory_order_acquire);
+        uint32_t n = w - mRead;
+        if(n > N / 2) {
+            n = N / 2;
+        }
+        sum = 0;
+        for(uint32_t i=0; i<n; i++) {
+            sum += mValues[(w - 1 - i) % N];
+        }
+        mRead = w;
+        return n;
+    }
+
+private:
+    T mValues[N];
+    // Owned by the reader
+    uint32_t mRead;
+    // Total readings pushed; wraps
+    std::atomic<uint32_t> mWritten;
+};
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+/** A complete set of capacitance scan results */
+template<uint32_t N>
+struct ScanFrame {
+    // Incremented for each completed scan, starting from 1
+    uint32_t sequence;
+    // Time at which the scan completed, in us
+    uint32_t timestamp;
+    uint16_t values[N];
+};
+
+/** Triple buffer for handing scan results from an interrupt to the main loop
+ *
+ * The writer fills the back frame, and commits it when the scan is complete.
+ * The reader acquires the most recently committed frame, which remains
+ * unchanged until its next call to acquire, no matter how many scans are
+ * committed in the meantime. Neither side ever waits or copies a frame.
+ *
+ * There may be only one writer and one reader.
+ */
+template<uint32_t N>
+struct ScanBuffer {
+    typedef ScanFrame<N> Frame;
+
+    ScanBuffer() : mBack(0), mFront(2), mState(1) {
+        for(auto &frame : mFrames) {
+            frame.sequence = 0;
+            frame.timestamp = 0;
+            for(auto &v : frame.values) {
+                v = 0;
+            }
+        }
+    }
+
+    /** Frame to be filled by the writer */
+    Frame & back() {
+        return mFrames[mBack];
+    }
+
+    /** Make the back frame available to the reader, and start a new one */
+    void commit() {
+        uint8_t prev = mState.exchange(mBack | FRESH_FLAG, std::memory_order_acq_rel);
+        mBack = prev & INDEX_MASK;
+    }
+
+    /** Return the newest committed frame
+     *
+     * If no frame has been committed since the last call, the same frame is
+     * returned again.
+     */
+    const Frame & acquire() {
+        if(mState.load(std::memory_order_relaxed) & FRESH_FLAG) {
+            uint8_t prev = mState.exchange(mFront, std::memory_order_acq_rel);
+            mFront = prev & INDEX_MASK;
+        }
+        return mFrames[mFront];
+    }
+
+private:
+    static const uint8_t INDEX_MASK = 0x3;
+    static const uint8_t FRESH_FLAG = 0x4;
+
+    Frame mFrames[3];
+    // Owned by the writer
+    uint8_t mBack;
+    // Owned by the reader
+    uint8_t mFront;
+    // Index of the frame between writer and reader, and whether it is newer
+    // than the reader's
+    std::atomic<uint8_t> mState;
+};
@@ -1,4 +1,5 @@
 #pragma once
+#include <array>
 #include <cstdint>
 
 /** Data structure for representing capacitance scan groups
@@ -15,6 +16,16 @@ public:
     static const uint32_t N_BYTES = (N_PINS + 7) / 8;
     typedef std::array<uint8_t, N_BYTES> PinMask;
 
+    /** A prepared measurement of one active group */
+    struct PlanEntry {
+        uint8_t group;
+        bool lowGain;
+        // Total calibration offset to subtract from the measurement
+        uint16_t offset;
+        // Group mask as it is loaded to the shift register
+        PinMask load;
+    };
+
     bool isAnyGroupActive() {
         for(uint8_t group = 0; group < MAX_GROUPS; group++) {
             if(isGroupActive(group)) {
@@ -41,6 +52,53 @@ public:
         for(uint32_t i=0; i<N_BYTES; i++) {
             mGroupMasks[group][i] = mask[i];
         }
+        mPlanStale = true;
+    }
+
+    /** Mark the scan plan for rebuilding, after a change to the opto
+     * polarity or calibration */
+    void invalidatePlan() {
+        mPlanStale = true;
+    }
+
+    bool isPlanStale() {
+        return mPlanStale;
+    }
+
+    /** Prepare the scan plan: an entry for each active group, in order
+     *
+     * `offset(group, lowGain)` returns the calibration offset for a group,
+     * and masks are inverted for loading if `inverted` is set.
+     */
+    template<typename OffsetFn>
+    void buildPlan(bool inverted, OffsetFn offset) {
+        mPlanStale = false;
+        mPlanSize = 0;
+        uint8_t invert = inverted ? 0xff : 0;
+        for(uint8_t group = 0; group < MAX_GROUPS; group++) {
+            if(!isGroupActive(group)) {
+                continue;
+            }
+            PlanEntry &entry = mPlan[mPlanSize++];
+            entry.group = group;
+            entry.lowGain = mGroupSettings[group] & 1;
+            entry.offset = offset(group, entry.lowGain);
+            for(uint32_t i=0; i<N_BYTES; i++) {
+                entry.load[i] = mGroupMasks[group][i] ^ invert;
+            }
+        }
+    }
+
+    const PlanEntry * planBegin() const {
+        return &mPlan[0];
+    }
+
+    const PlanEntry * planEnd() const {
+        return &mPlan[mPlanSize];
+    }
+
+    uint32_t planSize() const {
+        return mPlanSize;
     }
 
     PinMask getGroupMask(uint8_t group) {
@@ -51,6 +109,10 @@ public:
         }
     }
 
+    const std::array<uint8_t, MAX_GROUPS> & getGroupSettings() {
+        return mGroupSettings;
+    }
+
     /** Get setting byte for a group */
     uint8_t getGroupSetting(uint8_t group) {
         if(group < MAX_GROUPS) {
@@ -60,13 +122,18 @@ public:
         }
     }
 
-    inline bool isPinActive(uint8_t group, uint8_t pin) {
-        uint8_t byteidx = pin / 8;
-        uint8_t bit = pin % 8;
-        return mGroupMasks[group][byteidx] & (1<<bit);
+    /** Check a pin in a group mask; masks are stored as loaded to the shift
+     * register, with the first pin of each byte in the MSB */
+    inline bool isPinActive(uint8_t group, uint16_t pin) {
+        uint32_t byteidx = pin / 8;
+        uint32_t bit = pin % 8;
+        return mGroupMasks[group][byteidx] & (0x80 >> bit);
     }
 
 private:
-    PinMask mGroupMasks[MAX_GROUPS];
-    uint8_t mGroupSettings[MAX_GROUPS];
+    PinMask mGroupMasks[MAX_GROUPS] = {};
+    std::array<uint8_t, MAX_GROUPS> mGroupSettings = {};
+    PlanEntry mPlan[MAX_GROUPS];
+    uint32_t mPlanSize = 0;
+    volatile bool mPlanStale = true;
 };
\ No newline at end of file
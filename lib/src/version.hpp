@@ -1 +1,3 @@
-extern const char *VERSION_STRING;
\ No newline at end of file
+#pragma once
+
+extern const char *VERSION_STRING;
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <modm/platform.hpp>
+
+/** Adds back-to-back conversions of the selected channel to the modm Adc
+ *
+ * Uses free run mode, so that each conversion starts as soon as the last one
+ * ends, without waiting for software to start it. Must be called with
+ * interrupts disabled, so that no result is overwritten before it is read.
+ */
+template <typename ADC_DEV>
+class SamAdcBurst : public ADC_DEV {
+public:
+    static void readBurst(uint16_t *samples, uint32_t n) {
+        if(n == 0) {
+            return;
+        }
+        // Discard any stale result
+        (void)ADC->ADC_LCDR;
+        ADC->ADC_MR |= ADC_MR_FREERUN_ON;
+        for(uint32_t i=0; i<n; i++) {
+            while(!(ADC->ADC_ISR & ADC_ISR_DRDY)) {}
+            // Reading LCDR clears DRDY
+            samples[i] = ADC->ADC_LCDR & ADC_LCDR_LDATA_Msk;
+        }
+        // A conversion is in progress when free run is turned off; let it
+        // finish and discard it
+        ADC->ADC_MR &= ~ADC_MR_FREERUN_ON;
+        while(!(ADC->ADC_ISR & ADC_ISR_DRDY)) {}
+        (void)ADC->ADC_LCDR;
+    }
+};
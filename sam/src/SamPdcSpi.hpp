@@ -0,0 +1,46 @@
+#pragma once
+
+#include <modm/platform.hpp>
+
+/** Adds a non-blocking PDC transmit to a modm SpiMaster
+ *
+ * Only the transmit side uses the peripheral DMA controller; received data is
+ * discarded. The buffer passed to startTransfer must remain unchanged until
+ * waitTransfer returns.
+ *
+ * SpiRegs provides `static Spi *get()`, returning the CMSIS register
+ * definition of the same peripheral as SPI_MASTER, e.g. SPI4 for SpiMaster4.
+ */
+template <typename SPI_MASTER, typename SpiRegs>
+class SamPdcSpi : public SPI_MASTER {
+public:
+    /* Start transmitting `length` bytes from `tx` */
+    static void startTransfer(const uint8_t *tx, std::size_t length) {
+        waitTransfer();
+        spi()->SPI_TPR = (uint32_t)tx;
+        spi()->SPI_TCR = length;
+        spi()->SPI_PTCR = SPI_PTCR_TXTEN;
+        sBusy = true;
+    }
+
+    /* Block until the last byte has been shifted out */
+    static void waitTransfer() {
+        if(!sBusy) {
+            return;
+        }
+        while((spi()->SPI_SR & (SPI_SR_ENDTX | SPI_SR_TXEMPTY)) != (SPI_SR_ENDTX | SPI_SR_TXEMPTY)) {}
+        spi()->SPI_PTCR = SPI_PTCR_TXTDIS;
+        // Discard the received data and clear the overrun, so that a
+        // following blocking transfer does not read a stale byte
+        (void)spi()->SPI_RDR;
+        (void)spi()->SPI_SR;
+        sBusy = false;
+    }
+
+private:
+    static Spi * spi() {
+        return SpiRegs::get();
+    }
+
+    inline static volatile bool sBusy = false;
+};
@@ -20,8 +20,10 @@
 #include "Max31865.hpp"
 #include "PwmDac.hpp"
 #include "PwmOutput.hpp"
+#include "SamAdcBurst.hpp"
 #include "SamCallbackTimer.hpp"
 #include "SamFlash.hpp"
+#include "SamPdcSpi.hpp"
 #include "ScanGroups.hpp"
 #include "SystemClock.hpp"
 #include "TempSensors.hpp"
@@ -62,7 +64,11 @@ struct Hv507_Pins {
     // Debug IO, useful for syncing scope capacitance scan
     using SCAN_SYNC = GpioB11;
 };
-using Hv507_SPI = SpiMaster4;
+// Shift register loads are sent by the PDC of the FLEXCOM4 SPI
+struct Hv507_SpiRegs {
+    static Spi * get() { return SPI4; }
+};
+using Hv507_SPI = SamPdcSpi<SpiMaster4, Hv507_SpiRegs>;
 
 struct TempSensor_Pins {
     using SCK = GpioA15;
@@ -91,7 +97,7 @@ using ElectrodeTimingTimer = SamCallbackTimer<TimerChannel4>;
 
 using VHV_TARGET = GpioA0;
 using Dac = PwmDac<TimerChannel0, VHV_TARGET>;
-using AnalogImpl = Analog<modm::platform::Adc, INT_VOUT, ISENSE, VHV_FB_P, VHV_FB_N>;
+using AnalogImpl = Analog<SamAdcBurst<modm::platform::Adc>, INT_VOUT, ISENSE, VHV_FB_P, VHV_FB_N>;
 
 AppConfigController<SamFlash, 0, 1> appConfigController;
 AuxGpios<AuxGpioArray> auxGpios;
@@ -190,6 +196,9 @@ int main() {
 
     appConfigController.init(&broker);
     auxGpios.init(&broker);
+    hvControl.setGroupScanController([](auto &e, auto &dutyCycles) {
+        return feedbackControl.updateFromIsr(e, dutyCycles);
+    });
     hvControl.init<SystemClock>(&broker);
     feedbackControl.init(&broker);
     hvRegulator.init(&broker);
@@ -212,8 +221,10 @@ int main() {
         comms.poll();
         tempSensors.poll();
         hvRegulator.poll();
-        // pwmOutput.poll();
         hvControl.poll();
+        feedbackControl.poll();
+        // pwmOutput.poll();
+        broker.poll();
     }
 }
 
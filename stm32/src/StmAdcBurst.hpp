@@ -0,0 +1,40 @@
+#pragma once
+
+#include <modm/platform.hpp>
+
+/** Adds back-to-back conversions of the selected channel to a modm Adc
+ *
+ * Uses continuous mode, so that each conversion starts as soon as the last
+ * one ends, without waiting for software to start it. Must be called with
+ * interrupts disabled, so that no result is overwritten before it is read.
+ *
+ * AdcBase is the ADC peripheral address, e.g. ADC1_BASE.
+ */
+template <typename ADC_DEV, uint32_t AdcBase>
+class StmAdcBurst : public ADC_DEV {
+public:
+    static void readBurst(uint16_t *samples, uint32_t n) {
+        if(n == 0) {
+            return;
+        }
+        // Status flags are cleared by writing 0
+        adc()->SR = ~(ADC_SR_EOC | ADC_SR_OVR);
+        adc()->CR2 |= ADC_CR2_CONT;
+        adc()->CR2 |= ADC_CR2_SWSTART;
+        for(uint32_t i=0; i<n; i++) {
+            while(!(adc()->SR & ADC_SR_EOC)) {}
+            // Reading DR clears EOC
+            samples[i] = adc()->DR;
+        }
+        // One more conversion was started before continuous mode could be
+        // turned off; let it finish and discard it
+        adc()->CR2 &= ~ADC_CR2_CONT;
+        while(!(adc()->SR & ADC_SR_EOC)) {}
+        (void)adc()->DR;
+    }
+
+private:
+    static ADC_TypeDef * adc() {
+        return reinterpret_cast<ADC_TypeDef *>(AdcBase);
+    }
+};
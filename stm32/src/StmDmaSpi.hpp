@@ -0,0 +1,82 @@
+#pragma once
+
+#include <modm/platform.hpp>
+
+/** Adds a non-blocking DMA transmit to a modm SpiMaster
+ *
+ * Only the transmit side uses DMA; received data is discarded. The buffer
+ * passed to startTransfer must remain unchanged until waitTransfer returns.
+ *
+ * SpiBase is the SPI peripheral address, and the DMA stream and channel must
+ * be those mapped to its TX request, e.g. DMA1 stream 5, channel 0 for SPI3.
+ */
+template <typename SPI_MASTER, uint32_t SpiBase, uint32_t DmaBase, uint32_t Stream, uint32_t Channel>
+class StmDmaSpi : public SPI_MASTER {
+public:
+    template<class SystemClock, uint32_t baudrate>
+    static void initialize() {
+        SPI_MASTER::template initialize<SystemClock, baudrate>();
+        if(DmaBase == DMA1_BASE) {
+            RCC->AHB1ENR |= RCC_AHB1ENR_DMA1EN;
+        } else {
+            RCC->AHB1ENR |= RCC_AHB1ENR_DMA2EN;
+        }
+        __DSB();
+    }
+
+    /* Start transmitting `length` bytes from `tx` */
+    static void startTransfer(const uint8_t *tx, std::size_t length) {
+        waitTransfer();
+        // Flags from the previous transfer must be cleared before the stream
+        // is enabled again
+        clearFlags();
+        stream()->PAR = (uint32_t)&spi()->DR;
+        stream()->M0AR = (uint32_t)tx;
+        stream()->NDTR = length;
+        stream()->CR = (Channel << DMA_SxCR_CHSEL_Pos) | DMA_SxCR_MINC | DMA_SxCR_DIR_0;
+        spi()->CR2 |= SPI_CR2_TXDMAEN;
+        stream()->CR |= DMA_SxCR_EN;
+        sBusy = true;
+    }
+
+    /* Block until the last byte has been shifted out */
+    static void waitTransfer() {
+        if(!sBusy) {
+            return;
+        }
+        while(stream()->CR & DMA_SxCR_EN) {}
+        while(!(spi()->SR & SPI_SR_TXE)) {}
+        while(spi()->SR & SPI_SR_BSY) {}
+        spi()->CR2 &= ~SPI_CR2_TXDMAEN;
+        // Discard the received data and clear the overrun, so that a
+        // following blocking transfer does not read a stale byte
+        (void)spi()->DR;
+        (void)spi()->SR;
+        sBusy = false;
+    }
+
+private:
+    static SPI_TypeDef * spi() {
+        return reinterpret_cast<SPI_TypeDef *>(SpiBase);
+    }
+
+    static DMA_TypeDef * dma() {
+        return reinterpret_cast<DMA_TypeDef *>(DmaBase);
+    }
+
+    static DMA_Stream_TypeDef * stream() {
+        return reinterpret_cast<DMA_Stream_TypeDef *>(DmaBase + 0x10 + 0x18 * Stream);
+    }
+
+    static void clearFlags() {
+        // Each register holds the flags of four streams, at these offsets
+        static const uint8_t shift[4] = {0, 6, 16, 22};
+        if(Stream < 4) {
+            dma()->LIFCR = 0x3Dul << shift[Stream % 4];
+        } else {
+            dma()->HIFCR = 0x3Dul << shift[Stream % 4];
+        }
+    }
+
+    inline static volatile bool sBusy = false;
+};
@@ -12,7 +12,9 @@ extern "C" {
 
 #include "Analog.hpp"
 #include "AuxGpios.hpp"
+#include "StmAdcBurst.hpp"
 #include "StmCallbackTimer.hpp"
+#include "StmDmaSpi.hpp"
 #include "CircularBuffer.hpp"
 #include "AppConfigController.hpp"
 #include "Comms.hpp"
@@ -54,7 +56,8 @@ struct Hv507_Pins {
     using V_HV_TARGET = GpioA4; // Dac output pin
     using AUGMENT_ENABLE = InvertableGpio<GpioA3>;
 };
-using Hv507_SPI = SpiMaster3;
+// Shift register loads are sent by DMA1 stream 5, channel 0 (SPI3_TX)
+using Hv507_SPI = StmDmaSpi<SpiMaster3, SPI3_BASE, DMA1_BASE, 5, 0>;
 
 struct AnalogPins {
     using INT_VOUT = modm::platform::GpioA2;
@@ -86,7 +89,7 @@ struct DacWrapper {
 };
 
 using AnalogImpl = Analog<
-    Adc1,
+    StmAdcBurst<Adc1, ADC1_BASE>,
     AnalogPins::INT_VOUT,
     AnalogPins::ISENSE,
     AnalogPins::VHV_FB_P,
@@ -186,6 +189,9 @@ int main() {
 
     appConfigController.init(&broker);
     auxGpios.init(&broker);
+    hvControl.setGroupScanController([](auto &e, auto &dutyCycles) {
+        return feedbackControl.updateFromIsr(e, dutyCycles);
+    });
     hvControl.init<SystemClock>(&broker);
     feedbackControl.init(&broker);
     hvRegulator.init(&broker);
@@ -206,8 +212,10 @@ int main() {
         comms.poll();
         tempSensors.poll();
         hvRegulator.poll();
-        pwmOutput.poll();
         hvControl.poll();
+        feedbackControl.poll();
+        pwmOutput.poll();
+        broker.poll();
         LoopTimingPin::reset();
     }
 }
@@ -0,0 +1,351 @@
+#include <vector>
+#include "gtest/gtest.h"
+#include "SimClock.hpp"
+
+#include "Comms.hpp"
+#include "Events.hpp"
+
+using modm::platform::UsbUart0;
+
+struct CommsTest : public ::testing::Test {
+    void SetUp() {
+        sim::Clock::reset();
+        UsbUart0::reset();
+        AppConfig::init();
+    }
+
+    void TearDown() {
+        UsbUart0::reset();
+    }
+
+    // Message IDs of the frames written so far, in order. Escaping means a
+    // start byte can only begin a frame.
+    std::vector<uint8_t> sentIds() {
+        std::vector<uint8_t> ids;
+        for(uint32_t i=0; i+1<UsbUart0::tx.size(); i++) {
+            if(UsbUart0::tx[i] == 0x7e) {
+                ids.push_back(UsbUart0::tx[i+1]);
+            }
+        }
+        return ids;
+    }
+
+    void sendAck(TusbTx::Sink &sink, uint8_t id) {
+        Serializer ser(&sink);
+        CommandAckMsg msg(id);
+        msg.serialize(ser);
+    }
+
+    void sendActive(TusbTx::Sink &sink, uint16_t measurement) {
+        Serializer ser(&sink);
+        ActiveCapacitanceMsg msg;
+        msg.baseline = 0;
+        msg.measurement = measurement;
+        msg.settings = 0;
+        msg.serialize(ser);
+    }
+
+    void sendBulk(TusbTx::Sink &sink, uint32_t count) {
+        Serializer ser(&sink);
+        CapScanMsg msg;
+        msg.count = count;
+        for(uint32_t i=0; i<count; i++) {
+            msg.values[i] = i;
+        }
+        msg.serialize(ser);
+    }
+};
+
+TEST_F(CommsTest, RepliesAreHeldAndSentFirst) {
+    TusbTx tx;
+    TusbTx::Sink reply(&tx, TxClass::Reply);
+    TusbTx::Sink active(&tx, TxClass::Telemetry, ActiveCapacitanceSlot);
+    TusbTx::Sink bulk(&tx, TxClass::Bulk);
+
+    UsbUart0::txCapacity = 0;
+    sendAck(reply, 1);
+    sendAck(reply, 2);
+    sendActive(active, 100);
+    sendBulk(bulk, 4);
+    ASSERT_EQ(UsbUart0::tx.size(), 0u);
+    ASSERT_TRUE(tx.replyPending());
+    ASSERT_EQ(tx.dropCount(TxClass::Reply), 0u);
+    ASSERT_EQ(tx.dropCount(TxClass::Bulk), 1u);
+
+    // Only part of the backlog fits at first; nothing may overtake it
+    UsbUart0::txCapacity = 3;
+    tx.flush();
+    sendBulk(bulk, 4);
+    ASSERT_EQ(tx.dropCount(TxClass::Bulk), 2u);
+
+    UsbUart0::txCapacity = 1024;
+    tx.flush();
+    ASSERT_FALSE(tx.replyPending());
+    std::vector<uint8_t> expected = {CommandAckMsg::ID, CommandAckMsg::ID, ActiveCapacitanceMsg::ID};
+    ASSERT_EQ(sentIds(), expected);
+    ASSERT_EQ(UsbUart0::tx[2], 1);
+    ASSERT_EQ(tx.dropCount(TxClass::Reply), 0u);
+}
+
+TEST_F(CommsTest, TelemetryKeepsOnlyLatest) {
+    TusbTx tx;
+    TusbTx::Sink active(&tx, TxClass::Telemetry, ActiveCapacitanceSlot);
+
+    UsbUart0::txCapacity = 0;
+    sendActive(active, 100);
+    sendActive(active, 200);
+    sendActive(active, 300);
+    ASSERT_EQ(tx.dropCount(TxClass::Telemetry), 2u);
+
+    UsbUart0::txCapacity = 1024;
+    tx.flush();
+    ASSERT_EQ(sentIds(), std::vector<uint8_t>{ActiveCapacitanceMsg::ID});
+    uint16_t measurement;
+    memcpy(&measurement, &UsbUart0::tx[4], 2);
+    ASSERT_EQ(measurement, 300);
+
+    // Once sent, the slot is free and nothing more is dropped
+    sendActive(active, 400);
+    ASSERT_EQ(tx.dropCount(TxClass::Telemetry), 2u);
+    ASSERT_EQ(sentIds().size(), 2u);
+}
+
+TEST_F(CommsTest, TusbTxRefusesFrameWhichDoesNotFit) {
+    TusbTx tx;
+    TusbTx::Sink bulk(&tx, TxClass::Bulk);
+    TusbTx::Sink active(&tx, TxClass::Telemetry, ActiveCapacitanceSlot);
+
+    // Room for most, but not all, of the frame
+    UsbUart0::txCapacity = CapScanMsg::HEADER_SIZE + 2 * CapScanMsg::MAX_VALUES;
+    sendBulk(bulk, CapScanMsg::MAX_VALUES);
+    ASSERT_EQ(UsbUart0::tx.size(), 0u);
+    ASSERT_EQ(tx.dropCount(TxClass::Bulk), 1u);
+
+    // Nor is a telemetry frame started until all of it fits
+    UsbUart0::txCapacity = 3;
+    sendActive(active, 100);
+    ASSERT_EQ(UsbUart0::tx.size(), 0u);
+
+    UsbUart0::txCapacity = SIZE_MAX;
+    tx.flush();
+    sendBulk(bulk, CapScanMsg::MAX_VALUES);
+    ASSERT_EQ(tx.dropCount(TxClass::Bulk), 1u);
+    std::vector<uint8_t> expected = {ActiveCapacitanceMsg::ID, CapScanMsg::ID};
+    ASSERT_EQ(sentIds(), expected);
+
+    // The scan arrives whole and ends the output. The parser only knows
+    // messages to the device, and skips the telemetry frame.
+    MessageFramer<Messages> framer;
+    uint32_t frames = 0;
+    uint32_t lastFrameEnd = 0;
+    for(uint32_t i=0; i<UsbUart0::tx.size(); i++) {
+        uint8_t *buf;
+        uint16_t len;
+        if(framer.push(UsbUart0::tx[i], buf, len)) {
+            frames++;
+            lastFrameEnd = i + 1;
+        }
+    }
+    ASSERT_EQ(frames, 1u);
+    ASSERT_EQ(lastFrameEnd, UsbUart0::tx.size());
+}
+
+TEST_F(CommsTest, CommandsWaitForRoomForReplies) {
+    EventBroker broker;
+    Comms comms;
+    comms.init(&broker);
+    comms.poll();
+
+    // Far more acked commands than the backlog can hold replies for
+    const uint32_t N_COMMANDS = 2 * TusbTx::REPLY_BACKLOG_SIZE / maxFrameSize(CommandAckMsg::MAX_PAYLOAD_SIZE);
+    StaticCircularBuffer<uint8_t, 128> fifo;
+    Serializer ser(&fifo);
+    for(uint32_t i=0; i<N_COMMANDS; i++) {
+        ScanMaskMsg msg;
+        msg.serialize(ser);
+        while(!fifo.empty()) {
+            UsbUart0::rx.push_back(fifo.pop());
+        }
+    }
+
+    UsbUart0::txCapacity = 0;
+    comms.poll();
+    ASSERT_GT(UsbUart0::rx.size(), 0u);
+
+    UsbUart0::txCapacity = SIZE_MAX;
+    for(uint32_t i=0; i<10 && !UsbUart0::rx.empty(); i++) {
+        comms.poll();
+    }
+    comms.poll();
+    ASSERT_EQ(UsbUart0::rx.size(), 0u);
+    std::vector<uint8_t> expected(N_COMMANDS, (uint8_t)CommandAckMsg::ID);
+    ASSERT_EQ(sentIds(), expected);
+}
+
+TEST_F(CommsTest, DropCountsAreReported) {
+    EventBroker broker;
+    Comms comms;
+    comms.init(&broker);
+    comms.poll();
+
+    UsbUart0::txCapacity = 0;
+    events::CapActive e;
+    e.baseline = 0;
+    e.measurement = 1;
+    e.settings = 0;
+    broker.publish(e);
+    broker.publish(e);
+    UsbUart0::txCapacity = 1024;
+    comms.poll();
+    ASSERT_EQ(sentIds(), std::vector<uint8_t>{ActiveCapacitanceMsg::ID});
+
+    sim::Clock::advance(1000000000);
+    comms.poll();
+    auto ids = sentIds();
+    ASSERT_EQ(ids.size(), 2u);
+    ASSERT_EQ(ids[1], (uint8_t)TxDropCountMsg::ID);
+    uint32_t counts[TxDropCountMsg::N_COUNTS];
+    memcpy(counts, &UsbUart0::tx[UsbUart0::tx.size() - 2 - sizeof(counts)], sizeof(counts));
+    ASSERT_EQ(counts[0], 0u);
+    ASSERT_EQ(counts[1], 1u);
+    ASSERT_EQ(counts[2], 0u);
+    ASSERT_EQ(counts[3], 0u);
+
+    // Not sent again until the counts change
+    sim::Clock::advance(1000000000);
+    comms.poll();
+    ASSERT_EQ(sentIds().size(), 2u);
+}
+
+TEST_F(CommsTest, DeferredEventOverflowIsReported) {
+    EventBroker broker;
+    Comms comms;
+    comms.init(&broker);
+    comms.poll();
+
+    events::ElectrodesUpdated e;
+    for(uint32_t i=0; i<DeferredEventQueue::N_SLOTS + 2; i++) {
+        broker.publishFromIsr(e);
+    }
+    sim::Clock::advance(1000000000);
+    comms.poll();
+    auto ids = sentIds();
+    ASSERT_EQ(ids.back(), (uint8_t)TxDropCountMsg::ID);
+    uint32_t counts[TxDropCountMsg::N_COUNTS];
+    memcpy(counts, &UsbUart0::tx[UsbUart0::tx.size() - 2 - sizeof(counts)], sizeof(counts));
+    ASSERT_EQ(counts[0], 0u);
+    ASSERT_EQ(counts[1], 0u);
+    ASSERT_EQ(counts[2], 0u);
+    ASSERT_EQ(counts[3], 2u);
+}
+
+TEST_F(CommsTest, GroupScanSentInChunks) {
+    EventBroker broker;
+    Comms comms;
+    comms.init(&broker);
+    comms.poll();
+
+    events::CapGroups e;
+    e.count = 20;
+    e.measurements.fill(0);
+    e.settings.fill(0);
+    e.measurements[19] = 1234;
+    broker.publish(e);
+    comms.poll();
+
+    std::vector<uint8_t> expected = {BulkCapacitanceMsg::ID, BulkCapacitanceMsg::ID};
+    ASSERT_EQ(sentIds(), expected);
+
+    // The second message holds the last four groups
+    MessageFramer<Messages> framer;
+    std::vector<BulkCapacitanceMsg> msgs;
+    for(uint8_t b : UsbUart0::tx) {
+        uint8_t *buf;
+        uint16_t len;
+        if(framer.push(b, buf, len)) {
+            msgs.emplace_back();
+            ASSERT_TRUE(msgs.back().fill(buf, len));
+        }
+    }
+    ASSERT_EQ(msgs.size(), 2u);
+    EXPECT_EQ(msgs[0].startIndex, 0);
+    EXPECT_EQ(msgs[0].count, (uint8_t)BulkCapacitanceMsg::MAX_VALUES);
+    EXPECT_EQ(msgs[1].groupScan, 1);
+    EXPECT_EQ(msgs[1].startIndex, (uint16_t)BulkCapacitanceMsg::MAX_VALUES);
+    EXPECT_EQ(msgs[1].count, 4);
+    EXPECT_EQ(msgs[1].values[3], 1234);
+}
+
+TEST_F(CommsTest, GroupScanFilterSmoothsSentValues) {
+    AppConfig::optionValues[CapGroupsFilterId].i32 = (uint32_t)InputFilterType::MovingAverage;
+    AppConfig::optionValues[CapGroupsFilterLengthId].i32 = 2;
+    EventBroker broker;
+    Comms comms;
+    comms.init(&broker);
+    comms.poll();
+
+    events::CapGroups e;
+    e.count = 1;
+    e.measurements.fill(0);
+    e.settings.fill(0);
+    e.measurements[0] = 100;
+    broker.publish(e);
+    e.measurements[0] = 300;
+    broker.publish(e);
+    comms.poll();
+
+    MessageFramer<Messages> framer;
+    std::vector<uint16_t> values;
+    for(uint8_t b : UsbUart0::tx) {
+        uint8_t *buf;
+        uint16_t len;
+        if(framer.push(b, buf, len)) {
+            BulkCapacitanceMsg msg;
+            ASSERT_TRUE(msg.fill(buf, len));
+            values.push_back(msg.values[0]);
+        }
+    }
+    std::vector<uint16_t> expected = {100, 200};
+    ASSERT_EQ(values, expected);
+}
+
+TEST_F(CommsTest, FullScanSentFromAcquiredFrame) {
+    EventBroker broker;
+    Comms comms;
+    comms.init(&broker);
+    comms.poll();
+
+    ScanBuffer<AppConfig::N_PINS> buffer;
+    auto &frame = buffer.back();
+    frame.sequence = 7;
+    frame.timestamp = 1234;
+    for(uint32_t i=0; i<AppConfig::N_PINS; i++) {
+        frame.values[i] = i * 3;
+    }
+    buffer.commit();
+    events::CapScan e;
+    e.sequence = 7;
+    e.timestamp = 1234;
+    e.buffer = &buffer;
+    broker.publish(e);
+    comms.poll();
+
+    MessageFramer<Messages> framer;
+    std::vector<CapScanMsg> msgs;
+    for(uint8_t b : UsbUart0::tx) {
+        uint8_t *buf;
+        uint16_t len;
+        if(framer.push(b, buf, len)) {
+            msgs.emplace_back();
+            ASSERT_TRUE(msgs.back().fill(buf, len));
+        }
+    }
+    ASSERT_EQ(msgs.size(), 1u);
+    EXPECT_EQ(msgs[0].sequence, 7u);
+    EXPECT_EQ(msgs[0].timestamp, 1234u);
+    EXPECT_EQ(msgs[0].startIndex, 0);
+    ASSERT_EQ(msgs[0].count, (uint16_t)AppConfig::N_PINS);
+    for(uint32_t i=0; i<AppConfig::N_PINS; i++) {
+        ASSERT_EQ(msgs[0].values[i], i * 3);
+    }
+}
@@ -0,0 +1,985 @@
+#include <algorithm>
+#include <cmath>
+#include <initializer_list>
+#include <vector>
+#include "gtest/gtest.h"
+#include "Simulator.hpp"
+
+#include "FeedbackControl.hpp"
+
+using namespace sim;
+
+struct ElectrodesSimTest : public ::testing::Test {
+    ElectrodesSimTest() :
+        simulator([](){ ElectrodesImpl::timerIrqHandler(); }, [this](){
+            if(mainLoopRunning) {
+                electrodes.poll();
+                broker.poll();
+            }
+        })
+    {}
+
+    void SetUp() {
+        Board::reset();
+        AppConfig::init();
+        // Invert flags are static, and may be left set by a previous test
+        Hv507Pins::SCK::setInvert(false);
+        Hv507Pins::MOSI::setInvert(false);
+        Hv507Pins::POL::setInvert(false);
+        Hv507Pins::BL::setInvert(false);
+        Hv507Pins::LE::setInvert(false);
+        Hv507Pins::AUGMENT_ENABLE::setInvert(false);
+
+        scanHandler.setFunction([this](auto &e) {
+            auto &frame = e.buffer->acquire();
+            lastScan.assign(frame.values, frame.values + AppConfig::N_PINS);
+            lastScanSequence = frame.sequence;
+            scanCount++;
+        });
+        broker.registerHandler(&scanHandler);
+        groupsHandler.setFunction([this](auto &e) {
+            lastGroups = e.measurements;
+            lastGroupCount = e.count;
+            groupsCount++;
+        });
+        broker.registerHandler(&groupsHandler);
+        activeHandler.setFunction([this](auto &e) {
+            lastActive = e;
+            activeValues.push_back(e.measurement - e.baseline);
+            activeCount++;
+        });
+        broker.registerHandler(&activeHandler);
+        updatedHandler.setFunction([this](auto &) { updatedCount++; });
+        broker.registerHandler(&updatedHandler);
+    }
+
+    // On the last HV507 in the chain, however many there are
+    static const uint32_t LAST_PIN = AppConfig::N_PINS - 1;
+
+    void init() {
+        electrodes.init<SystemClock>(&broker);
+    }
+
+    /** Start times of the drive cycles, each of which switches POL from the
+     * positive pulse to the negative
+     *
+     * The trace has the MCU pin levels, before the opto-isolators, so the
+     * logical level depends on their polarity. Until the first positive
+     * pulse, POL is only being set up.
+     */
+    std::vector<uint64_t> cycleStarts() {
+        bool negative = AppConfig::InvertedOpto();
+        auto starts = Board::trace.times(POL, negative);
+        auto positive = Board::trace.times(POL, !negative);
+        if(positive.empty()) {
+            return {};
+        }
+        starts.erase(starts.begin(), std::lower_bound(starts.begin(), starts.end(), positive[0]));
+        return starts;
+    }
+
+    void setElectrodes(uint8_t groupID, uint8_t setting, std::initializer_list<uint32_t> pins) {
+        events::SetElectrodes e;
+        e.groupID = groupID;
+        e.setting = setting;
+        memset(e.values, 0, sizeof(e.values));
+        for(auto pin : pins) {
+            e.values[pin / 8] |= 1 << (pin % 8);
+        }
+        broker.publish(e);
+    }
+
+    void runMs(uint32_t ms) {
+        simulator.runFor((uint64_t)ms * 1000000);
+    }
+
+    EventBroker broker;
+    ElectrodesImpl electrodes;
+    Simulator<ElectrodesTimer> simulator;
+
+    EventHandlerFunction<events::CapScan> scanHandler;
+    EventHandlerFunction<events::CapGroups> groupsHandler;
+    EventHandlerFunction<events::CapActive> activeHandler;
+    EventHandlerFunction<events::ElectrodesUpdated> updatedHandler;
+
+    std::vector<uint16_t> lastScan;
+    std::array<uint16_t, AppConfig::N_CAP_GROUPS> lastGroups;
+    uint32_t lastGroupCount = 0;
+    events::CapActive lastActive;
+    std::vector<int32_t> activeValues;
+    uint32_t scanCount = 0;
+    uint32_t lastScanSequence = 0;
+    uint32_t groupsCount = 0;
+    uint32_t activeCount = 0;
+    uint32_t updatedCount = 0;
+    // Cleared to model a main loop held up by other work
+    bool mainLoopRunning = true;
+};
+
+TEST_F(ElectrodesSimTest, drive_cycles_run_at_nominal_period) {
+    init();
+    runMs(100);
+
+    // Each cycle is a negative and a positive drive pulse
+    auto cycle_starts = cycleStarts();
+    ASSERT_GE(cycle_starts.size(), 45u);
+    for(uint32_t i=1; i<cycle_starts.size(); i++) {
+        uint64_t period_us = (cycle_starts[i] - cycle_starts[i-1]) / 1000;
+        EXPECT_GE(period_us, 2 * AppConfig::DrivePeriod());
+        EXPECT_LE(period_us, 2 * AppConfig::DrivePeriod() + 50);
+    }
+    // One active capacitance measurement per cycle
+    EXPECT_NEAR(activeCount, cycle_starts.size(), 1);
+}
+
+TEST_F(ElectrodesSimTest, full_scan_measures_each_electrode) {
+    Board::hv507.capacitance[5] = 10.0;
+    Board::hv507.capacitance[LAST_PIN] = 30.0;
+    init();
+    runMs(1100);
+
+    ASSERT_EQ(scanCount, 1u);
+    ASSERT_EQ(lastScan.size(), (size_t)AppConfig::N_PINS);
+    EXPECT_NEAR(lastScan[5], 100, 2);
+    EXPECT_NEAR(lastScan[LAST_PIN], 300, 2);
+    EXPECT_NEAR(lastScan[6], 0, 2);
+    EXPECT_NEAR(lastScan[0], 0, 2);
+}
+
+TEST_F(ElectrodesSimTest, full_scan_with_inverted_opto) {
+    AppConfig::optionValues[InvertedOptoId].i32 = 1;
+    Board::hv507.capacitance[42] = 10.0;
+    init();
+    runMs(1100);
+
+    ASSERT_EQ(scanCount, 1u);
+    EXPECT_NEAR(lastScan[42], 100, 2);
+    EXPECT_NEAR(lastScan[43], 0, 2);
+}
+
+TEST_F(ElectrodesSimTest, opto_polarity_change_applies_at_cycle_boundary) {
+    if(AppConfig::INVERTED_OPTO_FIXED) {
+        GTEST_SKIP() << "Opto-isolator polarity is fixed at build time";
+    }
+    Board::hv507.capacitance[3] = 15.0;
+    init();
+    setElectrodes(0, 255, {3});
+    runMs(10);
+    ASSERT_FALSE(Hv507Pins::POL::isInverted());
+
+    // Nothing changes until the next drive cycle starts
+    AppConfig::optionValues[InvertedOptoId].i32 = 1;
+    ASSERT_FALSE(Hv507Pins::POL::isInverted());
+    runMs(3);
+    EXPECT_TRUE(Hv507Pins::SCK::isInverted());
+    EXPECT_TRUE(Hv507Pins::AUGMENT_ENABLE::isInverted());
+    EXPECT_EQ(SimSpi::sDataMode, SimSpi::DataMode::Mode2);
+
+    activeCount = 0;
+    runMs(10);
+    ASSERT_GT(activeCount, 0u);
+    EXPECT_NEAR(lastActive.measurement - lastActive.baseline, 150, 2);
+    EXPECT_TRUE(Board::hv507.latch[3]);
+    EXPECT_EQ(Board::hv507.activeCount(), 1u);
+}
+
+TEST_F(ElectrodesSimTest, fixed_opto_polarity_ignores_set_invert) {
+    using FixedInverted = InvertableGpio<SimGpio<PinId::SCAN_SYNC>, 1>;
+    FixedInverted::setInvert(false);
+    FixedInverted::setOutput(true);
+    EXPECT_FALSE(Board::levels[SCAN_SYNC]);
+    EXPECT_TRUE(FixedInverted::read());
+
+    using FixedNormal = InvertableGpio<SimGpio<PinId::SCAN_SYNC>, 0>;
+    FixedNormal::setInvert(true);
+    FixedNormal::set();
+    EXPECT_TRUE(Board::levels[SCAN_SYNC]);
+}
+
+TEST_F(ElectrodesSimTest, sliced_scan_spreads_measurements_over_cycles) {
+    AppConfig::optionValues[ScanSliceSizeId].i32 = 8;
+    AppConfig::optionValues[ScanPeriodId].i32 = 1;
+    Board::hv507.capacitance[5] = 10.0;
+    Board::hv507.capacitance[LAST_PIN] = 30.0;
+    init();
+    runMs(100 * AppConfig::N_HV507);
+
+    // 8 cycles per sweep for each HV507
+    ASSERT_GE(scanCount, 3u);
+    EXPECT_EQ(lastScanSequence, scanCount);
+    ASSERT_EQ(lastScan.size(), (size_t)AppConfig::N_PINS);
+    EXPECT_NEAR(lastScan[5], 100, 2);
+    EXPECT_NEAR(lastScan[LAST_PIN], 300, 2);
+    EXPECT_NEAR(lastScan[6], 0, 2);
+    EXPECT_NEAR(lastScan[0], 0, 2);
+
+    // No single interrupt should be long enough to hold up a drive pulse
+    auto irq_start = Board::trace.times(IRQ, true);
+    auto irq_end = Board::trace.times(IRQ, false);
+    ASSERT_EQ(irq_start.size(), irq_end.size());
+    for(uint32_t i=0; i<irq_start.size(); i++) {
+        EXPECT_LT(irq_end[i] - irq_start[i], 300000u);
+    }
+}
+
+TEST_F(ElectrodesSimTest, sliced_scan_settle_delay_includes_group_scan) {
+    AppConfig::optionValues[ScanSliceSizeId].i32 = 16;
+    AppConfig::optionValues[ScanPeriodId].i32 = 1;
+    init();
+    setElectrodes(100, 0, {12});
+    setElectrodes(101, 0, {13});
+    // Time from the last polarity switch to the start of the last scan slice,
+    // the only interrupt long enough to be one
+    auto settleUs = [&]() {
+        auto starts = Board::trace.times(IRQ, true);
+        auto ends = Board::trace.times(IRQ, false);
+        size_t i = ends.size() - 1;
+        while(ends[i] - starts[i] < 200000) {
+            i--;
+        }
+        uint64_t edge = 0;
+        for(bool level : {false, true}) {
+            for(auto t : Board::trace.times(POL, level)) {
+                if(t < starts[i]) {
+                    edge = std::max(edge, t);
+                }
+            }
+        }
+        return (starts[i] - edge) / 1000;
+    };
+    runMs(20);
+    ASSERT_GT(groupsCount, 0u);
+    EXPECT_NEAR(settleUs(), AppConfig::ScanStartDelay() / 1000, 3);
+
+    // The group scan runs while the polarity switch settles, rather than
+    // ahead of the delay
+    AppConfig::optionValues[GroupScanPeriodId].i32 = 0;
+    runMs(20);
+    EXPECT_NEAR(settleUs(), AppConfig::ScanStartDelay() / 1000, 3);
+}
+
+TEST_F(ElectrodesSimTest, sliced_scan_with_inverted_opto) {
+    AppConfig::optionValues[InvertedOptoId].i32 = 1;
+    AppConfig::optionValues[ScanSliceSizeId].i32 = 5;
+    AppConfig::optionValues[ScanPeriodId].i32 = 1;
+    Board::hv507.capacitance[42] = 10.0;
+    init();
+    runMs(100 * AppConfig::N_HV507);
+
+    ASSERT_GE(scanCount, 1u);
+    EXPECT_NEAR(lastScan[42], 100, 2);
+    EXPECT_NEAR(lastScan[43], 0, 2);
+    EXPECT_NEAR(lastScan[41], 0, 2);
+}
+
+TEST_F(ElectrodesSimTest, scan_mask_limits_measured_electrodes) {
+    AppConfig::optionValues[ScanSliceSizeId].i32 = 2;
+    AppConfig::optionValues[ScanPeriodId].i32 = 1;
+    Board::hv507.capacitance[5] = 10.0;
+    Board::hv507.capacitance[6] = 20.0;
+    Board::hv507.capacitance[LAST_PIN] = 30.0;
+    init();
+    events::SetScanMask mask;
+    memset(mask.values, 0, sizeof(mask.values));
+    for(uint32_t pin : {5u, LAST_PIN, LAST_PIN - 8}) {
+        mask.values[pin / 8] |= 1 << (pin % 8);
+    }
+    broker.publish(mask);
+    runMs(50);
+
+    // Three electrodes in slices of two completes a scan every other cycle
+    ASSERT_GE(scanCount, 8u);
+    EXPECT_NEAR(lastScan[5], 100, 2);
+    EXPECT_NEAR(lastScan[LAST_PIN], 300, 2);
+    EXPECT_NEAR(lastScan[LAST_PIN - 8], 0, 2);
+    EXPECT_EQ(lastScan[6], 0);
+
+    // Only masked electrodes are sampled: one active measurement per cycle,
+    // plus the selected electrodes for each scan. Each sample takes three
+    // conversions, including one discarded after switching channel. HV rail
+    // readings for the regulator are left out.
+    uint32_t conversions = SimAdc::sConversions - SimAdc::sHvConversions;
+    scanCount = 0;
+    activeCount = 0;
+    runMs(50);
+    EXPECT_NEAR(SimAdc::sConversions - SimAdc::sHvConversions - conversions, 3 * (activeCount + 3 * scanCount), 6);
+}
+
+TEST_F(ElectrodesSimTest, sliced_scan_keeps_settings_until_sweep_completes) {
+    AppConfig::optionValues[ScanSliceSizeId].i32 = 8;
+    AppConfig::optionValues[ScanPeriodId].i32 = 1;
+    Board::hv507.capacitance[5] = 10.0;
+    init();
+    // Run cycle by cycle until the given number of scans is published, and
+    // return the number of cycles it took
+    auto cyclesUntilScan = [&](uint32_t count) {
+        uint32_t cycles = cycleStarts().size();
+        while(scanCount < count) {
+            runMs(2 * AppConfig::DrivePeriod() / 1000);
+        }
+        return cycleStarts().size() - cycles;
+    };
+    cyclesUntilScan(1);
+    runMs(4 * AppConfig::DrivePeriod() / 1000);
+    ASSERT_EQ(scanCount, 1u);
+
+    // Change the slice size and mask part way through the second sweep
+    events::SetScanMask mask;
+    memset(mask.values, 0xff, sizeof(mask.values));
+    mask.values[0] &= ~(1 << 5);
+    broker.publish(mask);
+    AppConfig::optionValues[ScanSliceSizeId].i32 = AppConfig::N_PINS;
+    uint32_t sweepCycles = (AppConfig::N_PINS + 7) / 8;
+    EXPECT_NEAR(cyclesUntilScan(2) + 2, sweepCycles, 1);
+    EXPECT_NEAR(lastScan[5], 100, 2);
+    EXPECT_EQ(lastScanSequence, 2u);
+
+    // The third sweep takes them up
+    EXPECT_LE(cyclesUntilScan(3), 2u);
+    EXPECT_EQ(lastScan[5], 0);
+}
+
+TEST_F(ElectrodesSimTest, empty_scan_mask_stops_scan) {
+    init();
+    events::SetScanMask mask;
+    memset(mask.values, 0, sizeof(mask.values));
+    broker.publish(mask);
+    runMs(1100);
+    EXPECT_EQ(scanCount, 0u);
+}
+
+TEST_F(ElectrodesSimTest, group_scan_sums_group_electrodes) {
+    Board::hv507.capacitance[10] = 20.0;
+    Board::hv507.capacitance[11] = 20.0;
+    Board::hv507.capacitance[12] = 50.0;
+    init();
+    setElectrodes(101, 0, {10, 11});
+    runMs(10);
+
+    ASSERT_GT(groupsCount, 0u);
+    EXPECT_EQ(lastGroups[0], 0);
+    EXPECT_NEAR(lastGroups[1], 400, 2);
+}
+
+TEST_F(ElectrodesSimTest, electrode_offsets_scale_with_hv_target) {
+    AppConfig::optionValues[ScanSliceSizeId].i32 = 8;
+    AppConfig::optionValues[ScanPeriodId].i32 = 1;
+    AppConfig::optionValues[HvControlTargetId].f32 = 50.0;
+    Board::hv507.capacitance[5] = 10.0;
+    Board::hv507.capacitance[10] = 20.0;
+    init();
+
+    // Offsets measured at 100V
+    ElectrodesImpl::ElectrodeCalibrationData cal;
+    memset(&cal, 0, sizeof(cal));
+    cal.voltage = 100.0;
+    cal.offsets[5] = 40;
+    cal.offsets[10] = 20;
+    events::UpdateElectrodeCalibration update;
+    update.offset = 0;
+    update.length = sizeof(cal);
+    update.data = (const uint8_t*)&cal;
+    broker.publish(update);
+    setElectrodes(100, 0, {10});
+    runMs(100 * AppConfig::N_HV507);
+
+    ASSERT_GE(scanCount, 1u);
+    EXPECT_NEAR(lastScan[5], 80, 2);
+    EXPECT_NEAR(lastGroups[0], 190, 2);
+
+    // The table follows a change of HV target
+    AppConfig::optionValues[HvControlTargetId].f32 = 100.0;
+    scanCount = 0;
+    runMs(100 * AppConfig::N_HV507);
+    ASSERT_GE(scanCount, 1u);
+    EXPECT_NEAR(lastScan[5], 60, 2);
+    EXPECT_NEAR(lastGroups[0], 180, 2);
+}
+
+TEST_F(ElectrodesSimTest, group_scan_plan_follows_group_changes) {
+    Board::hv507.capacitance[10] = 20.0;
+    Board::hv507.capacitance[11] = 20.0;
+    Board::hv507.capacitance[12] = 50.0;
+    init();
+    const uint8_t last = AppConfig::N_CAP_GROUPS - 1;
+    setElectrodes(100 + 20, 0, {10, 11});
+    setElectrodes(100 + last, 0, {12});
+    runMs(10);
+
+    ASSERT_GT(groupsCount, 0u);
+    EXPECT_EQ(lastGroupCount, (uint32_t)AppConfig::N_CAP_GROUPS);
+    EXPECT_NEAR(lastGroups[20], 400, 2);
+    EXPECT_NEAR(lastGroups[last], 500, 2);
+    EXPECT_EQ(lastGroups[0], 0);
+
+    // Clearing a group removes it from the plan, and its result
+    setElectrodes(100 + last, 0, {});
+    runMs(10);
+    EXPECT_EQ(lastGroupCount, 21u);
+    EXPECT_NEAR(lastGroups[20], 400, 2);
+    EXPECT_EQ(lastGroups[last], 0);
+
+    // Only the two active groups are measured, plus the active capacitance,
+    // each taking three conversions
+    setElectrodes(100 + 5, 0, {12});
+    runMs(2);
+    uint32_t conversions = SimAdc::sConversions - SimAdc::sHvConversions;
+    activeCount = 0;
+    groupsCount = 0;
+    runMs(20);
+    EXPECT_NEAR(lastGroups[5], 500, 2);
+    EXPECT_NEAR(SimAdc::sConversions - SimAdc::sHvConversions - conversions, 3 * (activeCount + 2 * groupsCount), 9);
+}
+
+TEST_F(ElectrodesSimTest, active_capacitance_follows_driven_electrodes) {
+    Board::hv507.capacitance[3] = 15.0;
+    init();
+    setElectrodes(0, 255, {3});
+    runMs(10);
+
+    ASSERT_GT(activeCount, 0u);
+    EXPECT_NEAR(lastActive.measurement - lastActive.baseline, 150, 2);
+    EXPECT_EQ(updatedCount, 1u);
+    EXPECT_TRUE(Board::hv507.latch[3]);
+    EXPECT_EQ(Board::hv507.activeCount(), 1u);
+}
+
+TEST_F(ElectrodesSimTest, oversampling_reduces_adc_noise) {
+    Board::hv507.capacitance[3] = 15.0;
+    Board::adcNoise = 20;
+    init();
+    setElectrodes(0, 255, {3});
+
+    auto spread = [this](uint32_t count) {
+        // Allow for offset calibration with the new setting
+        AppConfig::optionValues[CapSampleCountId].i32 = count;
+        runMs(5);
+        activeValues.clear();
+        runMs(100);
+        double sum = 0, sum2 = 0;
+        for(auto x : activeValues) {
+            sum += x;
+            sum2 += (double)x * x;
+        }
+        double mean = sum / activeValues.size();
+        EXPECT_NEAR(mean, 150, 3);
+        return sqrt(sum2 / activeValues.size() - mean * mean);
+    };
+    double single = spread(1);
+    double averaged = spread(16);
+    EXPECT_GT(single, 8.0);
+    EXPECT_LT(averaged, single / 3);
+}
+
+TEST_F(ElectrodesSimTest, median_oversampling_rejects_adc_glitches) {
+    Board::hv507.capacitance[3] = 15.0;
+    Board::adcGlitchPeriod = 7;
+    AppConfig::optionValues[CapSampleCountId].i32 = 6;
+    init();
+    setElectrodes(0, 255, {3});
+
+    for(auto reduction : {SampleReduction::Median3, SampleReduction::TrimmedMean}) {
+        AppConfig::optionValues[CapSampleReductionId].i32 = (uint32_t)reduction;
+        runMs(5);
+        activeValues.clear();
+        runMs(50);
+        ASSERT_GT(activeValues.size(), 20u);
+        for(auto x : activeValues) {
+            EXPECT_NEAR(x, 150, 2);
+        }
+    }
+
+    // The mean is thrown off by any reading which includes a glitch
+    AppConfig::optionValues[CapSampleReductionId].i32 = (uint32_t)SampleReduction::Mean;
+    runMs(5);
+    activeValues.clear();
+    runMs(50);
+    uint32_t off = std::count_if(activeValues.begin(), activeValues.end(),
+        [](int32_t x) { return std::abs(x - 150) > 2; });
+    EXPECT_GT(off, activeValues.size() / 4);
+}
+
+TEST_F(ElectrodesSimTest, drive_groups_have_independent_duty_cycles) {
+    init();
+    setElectrodes(0, 255, {1});
+    setElectrodes(2, 128, {2});
+    setElectrodes(5, 64, {3, 4});
+    setElectrodes(7, 128, {5});
+    runMs(10);
+    Board::hv507.driveNs.fill(0);
+    runMs(100);
+
+    // Measurement pulses unblank the active electrodes for a short time too,
+    // so allow a little extra
+    double full = Board::hv507.driveNs[1];
+    ASSERT_GT(full, 90e6);
+    EXPECT_NEAR(Board::hv507.driveNs[2] / full, 128.0 / 255, 0.03);
+    EXPECT_NEAR(Board::hv507.driveNs[3] / full, 64.0 / 255, 0.03);
+    EXPECT_EQ(Board::hv507.driveNs[3], Board::hv507.driveNs[4]);
+    EXPECT_NEAR(Board::hv507.driveNs[5] / full, 128.0 / 255, 0.03);
+    EXPECT_EQ(Board::hv507.driveNs[0], 0u);
+
+    // Three distinct end times, so each of the two pulses in a cycle has a
+    // latch at the start and two intermediate latches
+    auto cycle_starts = cycleStarts();
+    auto latches = Board::trace.times(LE, true);
+    uint64_t t0 = cycle_starts[cycle_starts.size() - 3];
+    uint64_t t1 = cycle_starts[cycle_starts.size() - 2];
+    uint32_t n = std::count_if(latches.begin(), latches.end(), [&](uint64_t t) { return t >= t0 && t < t1; });
+    EXPECT_EQ(n, 6u);
+}
+
+TEST_F(ElectrodesSimTest, feedback_in_irq_updates_duty_cycles_without_main_loop) {
+    AppConfig::optionValues[FeedbackInIrqId].i32 = 1;
+    AppConfig::optionValues[FeedbackGainPId].f32 = 1000.0;
+    FeedbackControl feedback;
+    feedback.init(&broker);
+    electrodes.setGroupScanController([&](auto &e, auto &dutyCycles) {
+        return feedback.updateFromIsr(e, dutyCycles);
+    });
+    Board::hv507.capacitance[3] = 20.0;
+    init();
+    setElectrodes(0, 128, {3});
+    setElectrodes(1, 128, {5});
+    setElectrodes(2, 255, {1});
+    setElectrodes(100, 0, {3});
+    events::FeedbackCommand cmd;
+    cmd.target = 2.0;
+    cmd.mode = 1;
+    cmd.measureGroupsPMask = 1;
+    cmd.measureGroupsNMask = 0;
+    cmd.baseline = 128;
+    broker.publish(cmd);
+    runMs(10);
+
+    // Above target, so A is driven less
+    Board::hv507.driveNs.fill(0);
+    runMs(20);
+    double full = Board::hv507.driveNs[1];
+    EXPECT_LT(Board::hv507.driveNs[3] / full, 0.05);
+    EXPECT_NEAR(Board::hv507.driveNs[5] / full, 1.0, 0.03);
+
+    // With no help from the main loop, the controller reacts to the drop
+    // moving away from the next positive pulse on
+    mainLoopRunning = false;
+    Board::hv507.capacitance[3] = 1.0;
+    runMs(5);
+    Board::hv507.driveNs.fill(0);
+    runMs(20);
+    full = Board::hv507.driveNs[1];
+    EXPECT_NEAR(Board::hv507.driveNs[3] / full, 1.0, 0.03);
+    EXPECT_LT(Board::hv507.driveNs[5] / full, 0.05);
+}
+
+TEST_F(ElectrodesSimTest, feedback_loops_drive_their_own_groups) {
+    FeedbackControl feedback;
+    feedback.init(&broker);
+    Board::hv507.capacitance[3] = 20.0;
+    Board::hv507.capacitance[10] = 1.0;
+    init();
+    setElectrodes(0, 128, {3});
+    setElectrodes(1, 128, {5});
+    setElectrodes(2, 128, {10});
+    setElectrodes(3, 128, {12});
+    setElectrodes(7, 255, {1});
+    setElectrodes(100, 0, {3});
+    setElectrodes(101, 0, {10});
+
+    // One droplet above its target, and one below, each with its own gains
+    events::FeedbackCommand cmd;
+    cmd.target = 2.0;
+    cmd.mode = 1;
+    cmd.measureGroupsPMask = 1 << 0;
+    cmd.baseline = 128;
+    cmd.parameterGains = false;
+    cmd.kp = 1000.0;
+    broker.publish(cmd);
+    cmd.loop = 1;
+    cmd.measureGroupsPMask = 1 << 1;
+    cmd.driveGroupA = 2;
+    cmd.driveGroupB = 3;
+    cmd.kp = 2000.0;
+    broker.publish(cmd);
+    runMs(10);
+
+    Board::hv507.driveNs.fill(0);
+    runMs(20);
+    double full = Board::hv507.driveNs[1];
+    EXPECT_LT(Board::hv507.driveNs[3] / full, 0.05);
+    EXPECT_NEAR(Board::hv507.driveNs[5] / full, 1.0, 0.03);
+    EXPECT_NEAR(Board::hv507.driveNs[10] / full, 1.0, 0.03);
+    EXPECT_LT(Board::hv507.driveNs[12] / full, 0.05);
+
+    // Stopping one loop leaves its groups as they were, and the other running
+    cmd.mode = 0;
+    broker.publish(cmd);
+    Board::hv507.capacitance[3] = 1.0;
+    runMs(10);
+    Board::hv507.driveNs.fill(0);
+    runMs(20);
+    full = Board::hv507.driveNs[1];
+    EXPECT_NEAR(Board::hv507.driveNs[3] / full, 1.0, 0.03);
+    EXPECT_LT(Board::hv507.driveNs[5] / full, 0.05);
+    EXPECT_NEAR(Board::hv507.driveNs[10] / full, 1.0, 0.03);
+    EXPECT_LT(Board::hv507.driveNs[12] / full, 0.05);
+}
+
+TEST_F(ElectrodesSimTest, shift_register_loads_run_in_background) {
+    init();
+    setElectrodes(0, 255, {1});
+    setElectrodes(2, 128, {2});
+    runMs(20);
+
+    auto busy_start = Board::trace.times(SPI_BUSY, true);
+    auto busy_end = Board::trace.times(SPI_BUSY, false);
+    ASSERT_EQ(busy_start.size(), busy_end.size());
+
+    // Nothing is latched while a transfer is in progress
+    for(uint64_t t : Board::trace.times(LE, true)) {
+        for(uint32_t i=0; i<busy_start.size(); i++) {
+            EXPECT_FALSE(t > busy_start[i] && t < busy_end[i]) << "latch at " << t;
+        }
+    }
+
+    // The IRQ which starts the load of the second step returns before it is
+    // complete, twice per cycle
+    auto irq_end = Board::trace.times(IRQ, false);
+    uint32_t overlapped = 0;
+    for(uint64_t t : irq_end) {
+        for(uint32_t i=0; i<busy_start.size(); i++) {
+            if(t >= busy_start[i] && t < busy_end[i]) {
+                overlapped++;
+            }
+        }
+    }
+    auto cycle_starts = cycleStarts();
+    EXPECT_GE(overlapped, 2 * (cycle_starts.size() - 1));
+}
+
+TEST_F(ElectrodesSimTest, drive_period_change_applies_at_cycle_boundary) {
+    init();
+    setElectrodes(0, 128, {1});
+    runMs(20);
+    AppConfig::optionValues[DrivePeriodId].i32 = 2500;
+    uint64_t changed_at = Clock::now_ns();
+    runMs(50);
+
+    // Every cycle is either entirely at the old period, or entirely at the new
+    auto cycle_starts = cycleStarts();
+    uint32_t n_new = 0;
+    for(uint32_t i=1; i<cycle_starts.size(); i++) {
+        uint64_t period_us = (cycle_starts[i] - cycle_starts[i-1]) / 1000;
+        if(cycle_starts[i-1] >= changed_at) {
+            EXPECT_GE(period_us, 5000u);
+            EXPECT_LE(period_us, 5050u);
+            n_new++;
+        } else {
+            EXPECT_TRUE(period_us <= 2050 || (period_us >= 5000 && period_us <= 5050)) << period_us;
+        }
+    }
+    EXPECT_GE(n_new, 8u);
+
+    // Duty cycles scale with the period; 128/255 of the old period would be
+    // only a fifth of the new one
+    Board::hv507.driveNs.fill(0);
+    runMs(100);
+    EXPECT_NEAR(Board::hv507.driveNs[1] / 100e6, 128.0 / 255, 0.03);
+}
+
+TEST_F(ElectrodesSimTest, drive_period_is_clamped) {
+    AppConfig::optionValues[DrivePeriodId].i32 = 10;
+    init();
+    runMs(20);
+
+    auto cycle_starts = cycleStarts();
+    ASSERT_GE(cycle_starts.size(), 10u);
+    for(uint32_t i=1; i<cycle_starts.size(); i++) {
+        EXPECT_GE((cycle_starts[i] - cycle_starts[i-1]) / 1000, 2 * MIN_DRIVE_PERIOD_US);
+    }
+}
+
+TEST_F(ElectrodesSimTest, scan_periods_are_configurable) {
+    AppConfig::optionValues[ScanPeriodId].i32 = 50;
+    AppConfig::optionValues[GroupScanPeriodId].i32 = 4;
+    init();
+    setElectrodes(101, 0, {10});
+    runMs(400);
+
+    // Full scans hold up a cycle, more so for longer chains
+    uint32_t cycles = cycleStarts().size();
+    EXPECT_NEAR(scanCount, cycles / 50, 1);
+    EXPECT_NEAR(groupsCount, cycles / 4, 2);
+
+    // Zero disables both
+    AppConfig::optionValues[ScanPeriodId].i32 = 0;
+    AppConfig::optionValues[GroupScanPeriodId].i32 = 0;
+    runMs(10);
+    uint32_t scans = scanCount, groups = groupsCount;
+    runMs(400);
+    EXPECT_EQ(scanCount, scans);
+    EXPECT_EQ(groupsCount, groups);
+    EXPECT_GT(activeCount, 300u);
+}
+
+TEST_F(ElectrodesSimTest, scan_period_sets_sliced_sweep_rate) {
+    AppConfig::optionValues[ScanSliceSizeId].i32 = 16;
+    AppConfig::optionValues[ScanPeriodId].i32 = 50;
+    init();
+    runMs(400);
+
+    // Each sweep takes a few cycles, then waits for the next period
+    uint32_t cycles = cycleStarts().size();
+    EXPECT_NEAR(scanCount, cycles / 50, 1);
+
+    // A period shorter than a sweep runs them back to back
+    AppConfig::optionValues[ScanPeriodId].i32 = 1;
+    runMs(10);
+    uint32_t scans = scanCount;
+    cycles = cycleStarts().size();
+    runMs(200);
+    cycles = cycleStarts().size() - cycles;
+    uint32_t sweepCycles = (AppConfig::N_PINS + 15) / 16;
+    EXPECT_NEAR(scanCount - scans, cycles / sweepCycles, 1);
+}
+
+TEST_F(ElectrodesSimTest, scan_period_zero_stops_sliced_scan) {
+    AppConfig::optionValues[ScanSliceSizeId].i32 = 16;
+    AppConfig::optionValues[ScanPeriodId].i32 = 0;
+    init();
+    runMs(100);
+    EXPECT_EQ(scanCount, 0u);
+}
+
+TEST_F(ElectrodesSimTest, hv_rail_sampled_each_pulse) {
+    // Mirrors the HV feedback divider in HvRegulator.hpp
+    const float vscale = (3.3 / 4096.) / (6.65 / (412.0*3));
+    Board::hvVoltage = 150.0;
+    init();
+    // Full duty: readings are taken in the next pulse, without extending it
+    setElectrodes(100, 0, {10});
+    runMs(2);
+    float mean;
+    AnalogImpl::takeVhvDiffMean(mean);
+    uint32_t conversions = SimAdc::sHvConversions;
+    uint32_t cycles = cycleStarts().size();
+    runMs(20);
+    cycles = cycleStarts().size() - cycles;
+
+    // Two polarities per cycle, two channels per reading
+    EXPECT_NEAR(SimAdc::sHvConversions - conversions, cycles * 2 * 2 * HV_SAMPLES_PER_PULSE, 8);
+    ASSERT_TRUE(AnalogImpl::takeVhvDiffMean(mean));
+    EXPECT_NEAR(mean * vscale, 150.0, 0.5);
+    ASSERT_FALSE(AnalogImpl::takeVhvDiffMean(mean));
+}
+
+TEST_F(ElectrodesSimTest, hv_sampling_time_in_irq_is_bounded) {
+    // An ADC slow enough that a pulse's readings take longer than the slack,
+    // with pulses ending at many different times before the next step
+    SimAdc::conversionTimeNs = 15000;
+    const uint64_t readingNs = 2 * SimAdc::conversionTimeNs;
+    init();
+
+    struct IrqRecord {
+        uint64_t end;
+        uint32_t hvConversions;
+        uint64_t nextDeadline;
+    };
+    std::vector<IrqRecord> irqs;
+    Simulator<ElectrodesTimer> timed([&]() {
+        IrqRecord r;
+        uint32_t conversions = SimAdc::sHvConversions;
+        ElectrodesImpl::timerIrqHandler();
+        r.end = Clock::now_ns();
+        r.hvConversions = SimAdc::sHvConversions - conversions;
+        r.nextDeadline = 0;
+        ElectrodesTimer::pending(r.nextDeadline);
+        irqs.push_back(r);
+    }, [this]() {
+        electrodes.poll();
+        broker.poll();
+    });
+    for(uint8_t setting : {200, 220, 240}) {
+        setElectrodes(0, setting, {10});
+        for(int32_t period : {500, 200, 1000, 230, 700}) {
+            AppConfig::optionValues[DrivePeriodId].i32 = period;
+            timed.runFor(5000000);
+        }
+    }
+    SimAdc::conversionTimeNs = 1000;
+
+    uint32_t sampled = 0;
+    for(auto &r : irqs) {
+        if(r.hvConversions == 0) {
+            continue;
+        }
+        sampled++;
+        // Never more than one pulse's readings in a single interrupt, and no
+        // reading started with less than the slack left before the next step
+        EXPECT_LE(r.hvConversions, 2 * HV_SAMPLES_PER_PULSE);
+        EXPECT_GE(r.nextDeadline + readingNs, r.end + HV_SAMPLE_SLACK_US * 1000);
+    }
+    EXPECT_GT(sampled, 50u);
+}
+
+TEST_F(ElectrodesSimTest, sequence_steps_at_cycle_boundaries) {
+    Board::hv507.capacitance[3] = 10.0;
+    Board::hv507.capacitance[4] = 20.0;
+    Board::hv507.capacitance[5] = 30.0;
+    init();
+
+    std::vector<uint16_t> measured;
+    activeHandler.setFunction([&](auto &e) { measured.push_back(e.measurement - e.baseline); });
+    std::vector<events::SequenceProgress> progress;
+    EventHandlerFunction<events::SequenceProgress> progressHandler([&](auto &e) { progress.push_back(e); });
+    broker.registerHandler(&progressHandler);
+
+    ElectrodesImpl::SequenceStep steps[3];
+    memset(steps, 0, sizeof(steps));
+    const uint16_t dwell[3] = {2, 3, 1};
+    for(uint32_t i=0; i<3; i++) {
+        uint32_t pin = 3 + i;
+        steps[i].dwellCycles = dwell[i];
+        steps[i].dutyCycleA = 255;
+        steps[i].maskA[pin / 8] = 1 << (pin % 8);
+    }
+    events::UpdateElectrodeSequence upload;
+    upload.offset = 0;
+    upload.length = sizeof(steps);
+    upload.data = (const uint8_t*)steps;
+    broker.publish(upload);
+    events::SequenceControl start;
+    start.start = true;
+    start.stepCount = 3;
+    broker.publish(start);
+    runMs(20);
+
+    ASSERT_EQ(progress.size(), 4u);
+    for(uint32_t i=0; i<3; i++) {
+        EXPECT_TRUE(progress[i].running);
+        EXPECT_EQ(progress[i].step, i);
+        EXPECT_EQ(progress[i].stepCount, 3u);
+    }
+    EXPECT_FALSE(progress[3].running);
+    EXPECT_EQ(progress[3].step, 3u);
+    // Each step lasts exactly its dwell time in drive cycles
+    for(uint32_t i=0; i<3; i++) {
+        uint32_t duration = progress[i+1].timestamp - progress[i].timestamp;
+        EXPECT_NEAR(duration, dwell[i] * 2 * AppConfig::DrivePeriod(), 20);
+    }
+
+    // The active measurement follows each step, and stays on the last
+    std::vector<uint16_t> expected = {100, 100, 200, 200, 200, 300};
+    ASSERT_GE(measured.size(), expected.size() + 1);
+    auto first = std::find_if(measured.begin(), measured.end(), [](uint16_t x) { return x > 50; });
+    ASSERT_NE(first, measured.end());
+    for(uint32_t i=0; i<expected.size(); i++) {
+        EXPECT_NEAR(first[i], expected[i], 2);
+    }
+    EXPECT_NEAR(measured.back(), 300, 2);
+    EXPECT_TRUE(Board::hv507.latch[5]);
+    EXPECT_EQ(Board::hv507.activeCount(), 1u);
+    // Sequence steps are not acknowledged like host electrode updates
+    EXPECT_EQ(updatedCount, 0u);
+}
+
+TEST_F(ElectrodesSimTest, set_electrodes_stops_sequence) {
+    init();
+    std::vector<events::SequenceProgress> progress;
+    EventHandlerFunction<events::SequenceProgress> progressHandler([&](auto &e) { progress.push_back(e); });
+    broker.registerHandler(&progressHandler);
+
+    ElectrodesImpl::SequenceStep step;
+    memset(&step, 0, sizeof(step));
+    step.dwellCycles = 100;
+    step.dutyCycleA = 255;
+    step.maskA[0] = 0x01;
+    events::UpdateElectrodeSequence upload;
+    upload.offset = 0;
+    upload.length = sizeof(step);
+    upload.data = (const uint8_t*)&step;
+    broker.publish(upload);
+    events::SequenceControl start;
+    start.start = true;
+    start.stepCount = 1;
+    broker.publish(start);
+    runMs(10);
+    ASSERT_EQ(progress.size(), 1u);
+
+    setElectrodes(0, 255, {7});
+    runMs(10);
+    ASSERT_EQ(progress.size(), 2u);
+    EXPECT_FALSE(progress[1].running);
+    EXPECT_TRUE(Board::hv507.latch[7]);
+    EXPECT_FALSE(Board::hv507.latch[0]);
+}
+
+TEST_F(ElectrodesSimTest, handoff_waits_for_droplet_arrival) {
+    init();
+    std::vector<events::HandoffComplete> handoffs;
+    EventHandlerFunction<events::HandoffComplete> handoffHandler([&](auto &e) { handoffs.push_back(e); });
+    broker.registerHandler(&handoffHandler);
+
+    // The droplet is on electrode 19, and will move to 20
+    Board::hv507.capacitance[19] = 20.0;
+    setElectrodes(0, 255, {19});
+    setElectrodes(101, 0, {20});
+    events::QueueHandoff handoff;
+    handoff.groupID = 0;
+    handoff.setting = 255;
+    memset(handoff.values, 0, sizeof(handoff.values));
+    handoff.values[21 / 8] = 1 << (21 % 8);
+    handoff.scanGroup = 1;
+    handoff.below = false;
+    handoff.threshold = 150;
+    handoff.timeoutCycles = 0;
+    broker.publish(handoff);
+    runMs(20);
+    ASSERT_EQ(handoffs.size(), 0u);
+    EXPECT_TRUE(Board::hv507.latch[19]);
+
+    Board::hv507.capacitance[19] = 0.0;
+    Board::hv507.capacitance[20] = 20.0;
+    uint64_t arrival_us = Clock::now_ns() / 1000;
+    runMs(10);
+    ASSERT_EQ(handoffs.size(), 1u);
+    EXPECT_TRUE(handoffs[0].arrived);
+    EXPECT_NEAR(handoffs[0].groupValue, 200, 2);
+    // Made at the start of the next drive cycle after the group scan sees it
+    EXPECT_LE(handoffs[0].timestamp - arrival_us, 2 * 2 * AppConfig::DrivePeriod());
+    EXPECT_TRUE(Board::hv507.latch[21]);
+    EXPECT_FALSE(Board::hv507.latch[19]);
+}
+
+TEST_F(ElectrodesSimTest, handoff_times_out) {
+    init();
+    std::vector<events::HandoffComplete> handoffs;
+    EventHandlerFunction<events::HandoffComplete> handoffHandler([&](auto &e) { handoffs.push_back(e); });
+    broker.registerHandler(&handoffHandler);
+
+    setElectrodes(101, 0, {20});
+    events::QueueHandoff handoff;
+    handoff.groupID = 0;
+    handoff.setting = 255;
+    memset(handoff.values, 0, sizeof(handoff.values));
+    handoff.values[0] = 0x02;
+    handoff.scanGroup = 1;
+    handoff.below = false;
+    handoff.threshold = 150;
+    handoff.timeoutCycles = 5;
+    broker.publish(handoff);
+    runMs(30);
+
+    ASSERT_EQ(handoffs.size(), 1u);
+    EXPECT_FALSE(handoffs[0].arrived);
+    EXPECT_EQ(handoffs[0].cycles, 5u);
+    EXPECT_TRUE(Board::hv507.latch[1]);
+}
+
+TEST_F(ElectrodesSimTest, one_second_runs_quickly) {
+    init();
+    auto start = std::chrono::steady_clock::now();
+    runMs(1000);
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    EXPECT_GT(activeCount, 450u);
+    EXPECT_LT(std::chrono::duration_cast<std::chrono::milliseconds>(elapsed).count(), 2000);
+}
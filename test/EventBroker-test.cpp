@@ -1,3 +1,5 @@
+#include <utility>
+#include <vector>
 #include "gtest/gtest.h"
 #include "EventEx.hpp"
 
@@ -86,4 +88,119 @@ TEST_F(EventBrokerTest, multiple_events) {
     ASSERT_EQ(flag1, 1);
     ASSERT_EQ(flag2, 1);
     ASSERT_EQ(flag3, 2);
-}
\ No newline at end of file
+}
+TEST_F(EventBrokerTest, handler_only_receives_its_type) {
+    FlagHandler<TestEvent1> flag1;
+    FlagHandler<TestEvent2> flag2;
+    broker.registerHandler(&flag1);
+    broker.registerHandler(&flag2);
+    TestEvent2 event;
+    broker.publish(event);
+    ASSERT_FALSE(flag1.fired);
+    ASSERT_TRUE(flag2.fired);
+}
+
+TEST_F(EventBrokerTest, unregister_handler) {
+    uint32_t count1 = 0, count2 = 0;
+    EventHandlerFunction<TestEvent1> handler1([&](TestEvent1 &) { count1++; });
+    EventHandlerFunction<TestEvent1> handler2([&](TestEvent1 &) { count2++; });
+    broker.registerHandler(&handler1);
+    broker.registerHandler(&handler2);
+    broker.unregisterHandler(&handler1);
+    TestEvent1 event;
+    broker.publish(event);
+    ASSERT_EQ(count1, 0);
+    ASSERT_EQ(count2, 1);
+}
+
+TEST_F(EventBrokerTest, register_twice_dispatches_once) {
+    uint32_t count = 0;
+    EventHandlerFunction<TestEvent1> handler([&](TestEvent1 &) { count++; });
+    broker.registerHandler(&handler);
+    broker.registerHandler(&handler);
+    TestEvent1 event;
+    broker.publish(event);
+    ASSERT_EQ(count, 1);
+}
+
+TEST_F(EventBrokerTest, handler_outlives_broker) {
+    FlagHandler<TestEvent1> flag;
+    {
+        EventBroker shortLivedBroker;
+        shortLivedBroker.registerHandler(&flag);
+    }
+    // Handler must have been detached, so this is safe
+    flag.unregister();
+    broker.registerHandler(&flag);
+    TestEvent1 event;
+    broker.publish(event);
+    ASSERT_TRUE(flag.fired);
+}
+
+TEST_F(EventBrokerTest, publish_from_isr_delivers_on_poll) {
+    std::vector<uint32_t> received;
+    EventHandlerFunction<TestEvent1> handler([&](TestEvent1 &e) { received.push_back(e.value); });
+    broker.registerHandler(&handler);
+    TestEvent1 event(1);
+    broker.publishFromIsr(event);
+    // Payload is copied; later changes to the source do not affect delivery
+    event.value = 2;
+    broker.publishFromIsr(event);
+    ASSERT_EQ(received.size(), 0u);
+    broker.poll();
+    ASSERT_EQ(received, std::vector<uint32_t>({1, 2}));
+    broker.poll();
+    ASSERT_EQ(received.size(), 2u);
+}
+
+TEST_F(EventBrokerTest, publish_from_isr_preserves_order_across_types) {
+    std::vector<uint32_t> received;
+    EventHandlerFunction<TestEvent1> handler1([&](TestEvent1 &e) { received.push_back(e.value); });
+    EventHandlerFunction<TestEvent2> handler2([&](TestEvent2 &e) { received.push_back(e.value); });
+    broker.registerHandler(&handler1);
+    broker.registerHandler(&handler2);
+    broker.publishFromIsr(TestEvent1(1));
+    broker.publishFromIsr(TestEvent2(2));
+    broker.publishFromIsr(TestEvent1(3));
+    broker.poll();
+    ASSERT_EQ(received, std::vector<uint32_t>({1, 2, 3}));
+}
+
+TEST_F(EventBrokerTest, publish_from_isr_counts_overflow) {
+    uint32_t count = 0;
+    EventHandlerFunction<TestEvent1> handler([&](TestEvent1 &) { count++; });
+    broker.registerHandler(&handler);
+    const uint32_t n = DeferredEventQueue::N_SLOTS;
+    for(uint32_t i=0; i<n + 3; i++) {
+        bool accepted = broker.publishFromIsr(TestEvent1(i));
+        ASSERT_EQ(accepted, i < n);
+    }
+    ASSERT_EQ(broker.deferredOverflowCount(), 3u);
+    broker.poll();
+    ASSERT_EQ(count, n);
+    // Slots are free again after delivery
+    ASSERT_TRUE(broker.publishFromIsr(TestEvent1(0)));
+}
+
+template<uint32_t N>
+struct NumberedEvent : public Event {};
+
+template<uint32_t N>
+void registerNumberedEvent(EventBroker &broker) {
+    static FlagHandler<NumberedEvent<N>> handler;
+    broker.registerHandler(&handler);
+}
+
+template<uint32_t... N>
+void registerNumberedEvents(EventBroker &broker, std::integer_sequence<uint32_t, N...>) {
+    (registerNumberedEvent<N>(broker), ...);
+}
+
+TEST(EventBrokerDeathTest, too_many_event_types_is_fatal) {
+    // Run in a child process, so the extra types do not use up the index
+    // for the rest of the tests
+    EventBroker broker;
+    EXPECT_DEATH(
+        registerNumberedEvents(broker, std::make_integer_sequence<uint32_t, EventTypeIndex::MAX_TYPES + 1>()),
+        "EVENTEX_MAX_EVENT_TYPES");
+}
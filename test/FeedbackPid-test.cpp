@@ -0,0 +1,71 @@
+#include <cmath>
+#include "gtest/gtest.h"
+
+#include "FeedbackPid.hpp"
+
+TEST(FeedbackPidTest, CoefficientsKeepPrecisionAcrossRange) {
+    for(float x : {1e-5f, 0.013f, 1.0f, 3.7f, 2500.0f, -42.5f}) {
+        // Applied to a Q16.16 value of 1.0
+        float scaled = FixedPid::toFloat(FixedPid::scale(FixedPid::coefficient(x), 65536));
+        EXPECT_NEAR(scaled, x, std::fabs(x) * 1e-3 + 2.0 / 65536) << x;
+    }
+    auto zero = FixedPid::coefficient(0);
+    ASSERT_EQ(FixedPid::scale(zero, 12345), 0);
+}
+
+TEST(FeedbackPidTest, ProportionalOutputTruncatesTowardsZero) {
+    FloatPid floatPid;
+    FixedPid fixedPid;
+    floatPid.setGains(10.0, 0, 0, 100.0);
+    fixedPid.setGains(10.0, 0, 0, 100.0);
+    ASSERT_EQ(floatPid.update(FloatPid::fromFloat(2.55)), 25);
+    ASSERT_EQ(fixedPid.update(FixedPid::fromFloat(2.55)), 25);
+    ASSERT_EQ(floatPid.update(FloatPid::fromFloat(-2.55)), -25);
+    ASSERT_EQ(fixedPid.update(FixedPid::fromFloat(-2.55)), -25);
+}
+
+TEST(FeedbackPidTest, IntegralTermIsLimited) {
+    FloatPid floatPid;
+    FixedPid fixedPid;
+    floatPid.setGains(0, 0.5, 0, 100.0);
+    fixedPid.setGains(0, 0.5, 0, 100.0);
+    int16_t floatOut = 0, fixedOut = 0;
+    for(int i=0; i<1000; i++) {
+        floatOut = floatPid.update(FloatPid::fromFloat(10.0));
+        fixedOut = fixedPid.update(FixedPid::fromFloat(10.0));
+    }
+    ASSERT_EQ(floatOut, 100);
+    ASSERT_EQ(fixedOut, 100);
+
+    // Unwinds as soon as the error changes sign
+    floatOut = floatPid.update(FloatPid::fromFloat(-10.0));
+    fixedOut = fixedPid.update(FixedPid::fromFloat(-10.0));
+    ASSERT_EQ(floatOut, 97);
+    ASSERT_EQ(fixedOut, 97);
+
+    floatPid.resetIntegral();
+    fixedPid.resetIntegral();
+    ASSERT_EQ(floatPid.update(0), 0);
+    ASSERT_EQ(fixedPid.update(0), 0);
+}
+
+TEST(FeedbackPidTest, FixedPointTracksFloat) {
+    FloatPid floatPid;
+    FixedPid fixedPid;
+    floatPid.setGains(12.5, 0.3, 4.0, 100.0);
+    fixedPid.setGains(12.5, 0.3, 4.0, 100.0);
+    for(int i=0; i<500; i++) {
+        float error = 5.0f * std::sin(i * 0.05f) + 0.7f;
+        int16_t floatOut = floatPid.update(FloatPid::fromFloat(error));
+        int16_t fixedOut = fixedPid.update(FixedPid::fromFloat(error));
+        ASSERT_NEAR(fixedOut, floatOut, 1) << i;
+    }
+}
+
+TEST(FeedbackPidTest, OutputSaturates) {
+    FixedPid fixedPid;
+    fixedPid.setGains(1e6, 0, 0, 100.0);
+    ASSERT_EQ(fixedPid.update(FixedPid::fromFloat(1000.0)), INT16_MAX);
+    // Q16.16 values are symmetric, so the fixed point output is too
+    ASSERT_EQ(fixedPid.update(FixedPid::fromFloat(-1000.0)), -INT16_MAX);
+}
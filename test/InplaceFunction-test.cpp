@@ -0,0 +1,132 @@
+#include <cstdlib>
+#include <memory>
+#include <new>
+#include "gtest/gtest.h"
+#include "Events.hpp"
+#include "InplaceFunction.hpp"
+
+// Count calls to the global allocator while a test has enabled tracking
+static bool trackAllocations = false;
+static uint32_t allocationCount = 0;
+
+void * operator new(size_t size) {
+    if(trackAllocations) {
+        allocationCount++;
+    }
+    void *p = malloc(size);
+    if(p == nullptr) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void *p) noexcept {
+    free(p);
+}
+
+void operator delete(void *p, size_t) noexcept {
+    free(p);
+}
+
+struct AllocationTracker {
+    AllocationTracker() {
+        allocationCount = 0;
+        trackAllocations = true;
+    }
+    ~AllocationTracker() {
+        trackAllocations = false;
+    }
+    uint32_t count() { return allocationCount; }
+};
+
+TEST(InplaceFunction, empty_returns_default) {
+    InplaceFunction<int(int)> f;
+    ASSERT_FALSE(f);
+    ASSERT_EQ(f(3), 0);
+}
+
+TEST(InplaceFunction, invokes_lambda_with_capture) {
+    int offset = 10;
+    InplaceFunction<int(int)> f([&offset](int x) { return x + offset; });
+    ASSERT_TRUE(f);
+    ASSERT_EQ(f(3), 13);
+    offset = 20;
+    ASSERT_EQ(f(3), 23);
+}
+
+TEST(InplaceFunction, copy_and_reassign) {
+    int calls = 0;
+    InplaceFunction<void()> a([&calls]() { calls++; });
+    InplaceFunction<void()> b(a);
+    InplaceFunction<void()> c;
+    c = b;
+    a();
+    b();
+    c();
+    ASSERT_EQ(calls, 3);
+    c = nullptr;
+    ASSERT_FALSE(c);
+    c = [&calls]() { calls += 10; };
+    c();
+    ASSERT_EQ(calls, 13);
+}
+
+TEST(InplaceFunction, destroys_captured_state) {
+    auto counter = std::make_shared<int>(0);
+    {
+        InplaceFunction<void()> f([counter]() { (*counter)++; });
+        InplaceFunction<void()> g(f);
+        ASSERT_EQ(counter.use_count(), 3);
+        f = nullptr;
+        ASSERT_EQ(counter.use_count(), 2);
+    }
+    ASSERT_EQ(counter.use_count(), 1);
+}
+
+TEST(InplaceFunction, publish_does_not_allocate) {
+    EventBroker broker;
+    EventHandlerFunction<events::SetParameter> paramHandler;
+    EventHandlerFunction<events::GpioControl> gpioHandler;
+    broker.registerHandler(&paramHandler);
+    broker.registerHandler(&gpioHandler);
+
+    uint32_t responses = 0;
+    void *self = &responses;
+    AllocationTracker tracker;
+
+    // Handlers and callbacks capture the same kind of state as the
+    // application's: a this pointer, plus a reference or two
+    paramHandler.setFunction([self, &responses](auto &e) {
+        (void)self;
+        responses++;
+        e.callback(e.paramIdx, e.paramValue);
+    });
+    gpioHandler.setFunction([self](auto &e) {
+        (void)self;
+        e.callback(e.pin, e.value);
+    });
+
+    for(uint32_t i=0; i<10; i++) {
+        events::SetParameter param;
+        param.paramIdx = i;
+        param.paramValue.i32 = i;
+        param.writeFlag = 0;
+        param.callback = [self, &responses](const uint32_t &, const ConfigOptionValue &) {
+            (void)self;
+            responses++;
+        };
+        broker.publish(param);
+
+        events::GpioControl gpio;
+        gpio.pin = 1;
+        gpio.value = true;
+        gpio.callback = [self, &responses](uint8_t, bool) {
+            (void)self;
+            responses++;
+        };
+        broker.publish(gpio);
+    }
+
+    ASSERT_EQ(tracker.count(), 0u);
+    ASSERT_EQ(responses, 30u);
+}
@@ -0,0 +1,64 @@
+#include "gtest/gtest.h"
+
+#include "InputFilter.hpp"
+
+TEST(InputFilterTest, NonePassesReadingsThrough) {
+    InputFilter<2> filter;
+    ASSERT_EQ(filter.push(0, 100), 100);
+    ASSERT_EQ(filter.push(0, 300), 300);
+}
+
+TEST(InputFilterTest, MovingAverageOverLength) {
+    InputFilter<2> filter;
+    filter.configure(InputFilterType::MovingAverage, 4);
+    // Averages what it has until the history is full
+    ASSERT_EQ(filter.push(0, 100), 100);
+    ASSERT_EQ(filter.push(0, 200), 150);
+    ASSERT_EQ(filter.push(0, 300), 200);
+    ASSERT_EQ(filter.push(0, 400), 250);
+    ASSERT_EQ(filter.push(0, 500), 350);
+    // Channels are independent
+    ASSERT_EQ(filter.push(1, 10), 10);
+}
+
+TEST(InputFilterTest, MedianRejectsGlitches) {
+    InputFilter<1> filter;
+    filter.configure(InputFilterType::Median, 3);
+    ASSERT_EQ(filter.push(0, 100), 100);
+    ASSERT_EQ(filter.push(0, 4000), 2050);
+    ASSERT_EQ(filter.push(0, 102), 102);
+    ASSERT_EQ(filter.push(0, 98), 102);
+    ASSERT_EQ(filter.push(0, 0), 98);
+}
+
+TEST(InputFilterTest, EmaStartsAtFirstReadingAndConverges) {
+    InputFilter<1> filter;
+    // alpha = 2 / (3 + 1)
+    filter.configure(InputFilterType::Ema, 3);
+    ASSERT_EQ(filter.push(0, 100), 100);
+    ASSERT_EQ(filter.push(0, 200), 150);
+    ASSERT_EQ(filter.push(0, 200), 175);
+    uint16_t x = 0;
+    for(int i=0; i<30; i++) {
+        x = filter.push(0, 200);
+    }
+    ASSERT_EQ(x, 200);
+}
+
+TEST(InputFilterTest, TagChangeRestartsChannel) {
+    InputFilter<1> filter;
+    filter.configure(InputFilterType::MovingAverage, 4);
+    filter.push(0, 100, 0);
+    filter.push(0, 100, 0);
+    // e.g. a switch to low gain, where counts are not comparable
+    ASSERT_EQ(filter.push(0, 20, 1), 20);
+    ASSERT_EQ(filter.push(0, 30, 1), 25);
+}
+
+TEST(InputFilterTest, LengthIsLimited) {
+    InputFilter<1> filter;
+    filter.configure(InputFilterType::MovingAverage, 100);
+    ASSERT_EQ(filter.length(), MAX_INPUT_FILTER_LENGTH);
+    filter.configure(InputFilterType::MovingAverage, 0);
+    ASSERT_EQ(filter.length(), 1u);
+}
@@ -4,6 +4,8 @@
 
 static const int Msg1Size = 16;
 struct MockParser {
+    static const uint32_t MAX_SIZE = 256;
+
     static int predictSize(uint8_t *buf, uint32_t length) {
         if(length < 1) {
             return 0;
@@ -84,3 +86,85 @@ TEST_F(FramerTest, parse_proper_message) {
     }
 }
 
+
+struct VectorProducer : public IProducer<uint8_t> {
+    bool push(uint8_t b) {
+        bytes.push_back(b);
+        return true;
+    }
+    std::vector<uint8_t> bytes;
+};
+
+template<uint32_t SIZE>
+struct TestFrameSink : public FrameSink {
+    TestFrameSink() : FrameSink(buffer, SIZE) {}
+
+    bool writeFrame(const uint8_t *frame, uint32_t length) {
+        writeCount++;
+        if(!accept) {
+            return false;
+        }
+        bytes.insert(bytes.end(), frame, frame + length);
+        return true;
+    }
+
+    uint8_t buffer[SIZE];
+    std::vector<uint8_t> bytes;
+    bool accept = true;
+    uint32_t writeCount = 0;
+};
+
+TEST(SerializerTest, frame_sink_matches_byte_stream) {
+    uint8_t message[40];
+    for(int i=0; i<40; i++) {
+        // Include plenty of bytes which need escaping
+        message[i] = (i % 3 == 0) ? 0x7e : (i % 3 == 1) ? 0x7d : i;
+    }
+    auto expected = serialize_message(message, sizeof(message));
+
+    VectorProducer producer;
+    Serializer streamSer(&producer);
+    for(int i=0; i<40; i++) {
+        streamSer.push(message[i]);
+    }
+    streamSer.finish();
+    ASSERT_EQ(producer.bytes, expected);
+
+    TestFrameSink<128> sink;
+    Serializer frameSer(&sink);
+    frameSer.push(message[0]);
+    frameSer.pushBytes(&message[1], 39);
+    ASSERT_EQ(sink.writeCount, 0u);
+    ASSERT_TRUE(frameSer.finish());
+    ASSERT_EQ(sink.writeCount, 1u);
+    ASSERT_EQ(sink.bytes, expected);
+
+    // The serializer can be reused for the next frame
+    frameSer.pushBytes(message, 40);
+    ASSERT_TRUE(frameSer.finish());
+    ASSERT_EQ(sink.bytes.size(), 2 * expected.size());
+}
+
+TEST(SerializerTest, refused_frame_is_reported) {
+    TestFrameSink<64> sink;
+    sink.accept = false;
+    Serializer ser(&sink);
+    ser.push((uint32_t)1234);
+    ASSERT_FALSE(ser.finish());
+    ASSERT_EQ(sink.bytes.size(), 0u);
+}
+
+TEST(SerializerTest, oversized_frame_is_discarded) {
+    TestFrameSink<16> sink;
+    Serializer ser(&sink);
+    uint8_t message[20] = {0};
+    ser.pushBytes(message, sizeof(message));
+    ASSERT_FALSE(ser.finish());
+    ASSERT_EQ(sink.writeCount, 0u);
+
+    // And the next frame is unaffected
+    uint8_t one = 1;
+    ser.push(one);
+    ASSERT_TRUE(ser.finish());
+    ASSERT_EQ(sink.bytes, serialize_message(&one, 1));
+}
@@ -25,8 +25,9 @@ uint16_t MessagesTest::returnLength = 0;
 
 TEST_F(MessagesTest, BulkCapacitanceRoundTrip) {
     BulkCapacitanceMsg msg;
-    msg.start_index = 11;
+    msg.startIndex = 11;
     msg.count = 5;
+    msg.sequence = 0x1234;
     for(int i=0; i<msg.count; i++) {
         msg.values[i] = i * 3;
     }
@@ -39,13 +40,45 @@ TEST_F(MessagesTest, BulkCapacitanceRoundTrip) {
 
     BulkCapacitanceMsg rxMsg;
     rxMsg.fill(returnBuf, returnLength);
-    ASSERT_EQ(rxMsg.start_index, msg.start_index);
+    ASSERT_EQ(rxMsg.startIndex, msg.startIndex);
     ASSERT_EQ(rxMsg.count, msg.count);
+    ASSERT_EQ(rxMsg.sequence, msg.sequence);
     for(int i=0; i<msg.count; i++) {
         ASSERT_EQ(rxMsg.values[i], msg.values[i]);
     }
 }
 
+TEST_F(MessagesTest, BulkCapacitanceStartIndexPast255) {
+    BulkCapacitanceMsg msg;
+    msg.startIndex = 300;
+    msg.count = 1;
+    msg.values[0] = 42;
+
+    msg.serialize(serializer);
+    parseData();
+
+    BulkCapacitanceMsg rxMsg;
+    ASSERT_TRUE(rxMsg.fill(returnBuf, returnLength));
+    ASSERT_EQ(rxMsg.startIndex, 300);
+    ASSERT_EQ(rxMsg.values[0], 42);
+}
+
+TEST_F(MessagesTest, SetGainCoversAllElectrodes) {
+    // Every fourth electrode at low gain
+    uint8_t buf[3 + SetGainMsg::MAX_BYTES];
+    buf[0] = SetGainMsg::ID;
+    buf[1] = AppConfig::N_PINS & 0xff;
+    buf[2] = AppConfig::N_PINS >> 8;
+    memset(&buf[3], 0x01, SetGainMsg::MAX_BYTES);
+    ASSERT_EQ(Messages::predictSize(buf, sizeof(buf)), (int)sizeof(buf));
+
+    SetGainMsg msg;
+    ASSERT_TRUE(msg.fill(buf, sizeof(buf)));
+    ASSERT_EQ(msg.count, (uint16_t)AppConfig::N_PINS);
+    ASSERT_EQ(msg.get_channel(AppConfig::N_PINS - 4), 1);
+    ASSERT_EQ(msg.get_channel(AppConfig::N_PINS - 1), 0);
+}
+
 TEST_F(MessagesTest, ParameterMsgRoundTrip) {
     ParameterMsg msg;
     msg.paramIdx = 11;
@@ -63,3 +96,160 @@ TEST_F(MessagesTest, ParameterMsgRoundTrip) {
     ASSERT_EQ(rxMsg.paramIdx, msg.paramIdx);
     ASSERT_EQ(rxMsg.paramValue.f32, msg.paramValue.f32);
 }
+
+TEST_F(MessagesTest, ScanMaskMsgRoundTrip) {
+    ScanMaskMsg msg;
+    for(uint32_t i=0; i<AppConfig::N_BYTES; i++) {
+        msg.values[i] = i * 17;
+    }
+
+    msg.serialize(serializer);
+    parseData();
+
+    ASSERT_EQ(returnLength, (uint16_t)(1 + AppConfig::N_BYTES));
+    ASSERT_NE(returnBuf, (uint8_t*)NULL);
+
+    ScanMaskMsg rxMsg(returnBuf, returnLength);
+    for(uint32_t i=0; i<AppConfig::N_BYTES; i++) {
+        ASSERT_EQ(rxMsg.values[i], msg.values[i]);
+    }
+}
+
+TEST_F(MessagesTest, CapScanMsgRoundTrip) {
+    // A full scan is larger than the default FIFO size
+    // Payload plus checksum
+    static const uint32_t FRAME_SIZE = CapScanMsg::HEADER_SIZE + 2 * CapScanMsg::MAX_VALUES + 2;
+    StaticCircularBuffer<uint8_t, 2 * FRAME_SIZE + 8> bigFifo;
+    serializer.setSink(&bigFifo);
+
+    CapScanMsg msg;
+    msg.sequence = 123456;
+    msg.timestamp = 0x7e7d7e7d; // Requires escaping
+    msg.startIndex = 0;
+    msg.count = CapScanMsg::MAX_VALUES;
+    for(uint32_t i=0; i<msg.count; i++) {
+        msg.values[i] = i * 257;
+    }
+    msg.serialize(serializer);
+
+    uint8_t *buf = nullptr;
+    uint16_t length = 0;
+    bool found = false;
+    while(!bigFifo.empty()) {
+        found |= framer.push(bigFifo.pop(), buf, length);
+    }
+    ASSERT_TRUE(found);
+    ASSERT_EQ(length, CapScanMsg::HEADER_SIZE + 2 * msg.count);
+
+    CapScanMsg rxMsg;
+    ASSERT_TRUE(rxMsg.fill(buf, length));
+    ASSERT_EQ(rxMsg.sequence, msg.sequence);
+    ASSERT_EQ(rxMsg.timestamp, msg.timestamp);
+    ASSERT_EQ(rxMsg.startIndex, msg.startIndex);
+    ASSERT_EQ(rxMsg.count, msg.count);
+    for(uint32_t i=0; i<msg.count; i++) {
+        ASSERT_EQ(rxMsg.values[i], msg.values[i]);
+    }
+}
+
+TEST_F(MessagesTest, TxDropCountRoundTrip) {
+    TxDropCountMsg msg;
+    msg.counts[0] = 0;
+    msg.counts[1] = 0x7e7d;
+    msg.counts[2] = 123456;
+    msg.counts[3] = 7;
+
+    msg.serialize(serializer);
+    parseData();
+
+    ASSERT_NE(returnLength, 0);
+    ASSERT_EQ(returnBuf[0], (uint8_t)TxDropCountMsg::ID);
+    TxDropCountMsg rxMsg;
+    ASSERT_TRUE(rxMsg.fill(returnBuf, returnLength));
+    for(uint32_t i=0; i<TxDropCountMsg::N_COUNTS; i++) {
+        ASSERT_EQ(rxMsg.counts[i], msg.counts[i]);
+    }
+}
+
+TEST_F(MessagesTest, SequenceStatusRoundTrip) {
+    SequenceStatusMsg msg;
+    msg.running = 1;
+    msg.step = 12;
+    msg.stepCount = 40;
+    msg.timestamp = 0x12345678;
+
+    msg.serialize(serializer);
+    parseData();
+
+    ASSERT_NE(returnLength, 0);
+    SequenceStatusMsg rxMsg;
+    ASSERT_TRUE(rxMsg.fill(returnBuf, returnLength));
+    ASSERT_EQ(rxMsg.running, msg.running);
+    ASSERT_EQ(rxMsg.step, msg.step);
+    ASSERT_EQ(rxMsg.stepCount, msg.stepCount);
+    ASSERT_EQ(rxMsg.timestamp, msg.timestamp);
+}
+
+TEST_F(MessagesTest, HandoffRoundTrip) {
+    HandoffMsg msg;
+    msg.groupID = 1;
+    msg.setting = 200;
+    for(uint32_t i=0; i<AppConfig::N_BYTES; i++) {
+        msg.values[i] = i * 17;
+    }
+    msg.scanGroup = 3;
+    msg.flags = HandoffMsg::BelowFlag;
+    msg.threshold = 0x7e7d;
+    msg.timeoutCycles = 500;
+
+    msg.serialize(serializer);
+    parseData();
+
+    ASSERT_NE(returnLength, 0);
+    HandoffMsg rxMsg;
+    ASSERT_TRUE(rxMsg.fill(returnBuf, returnLength));
+    ASSERT_EQ(rxMsg.groupID, msg.groupID);
+    ASSERT_EQ(rxMsg.setting, msg.setting);
+    for(uint32_t i=0; i<AppConfig::N_BYTES; i++) {
+        ASSERT_EQ(rxMsg.values[i], msg.values[i]);
+    }
+    ASSERT_EQ(rxMsg.scanGroup, msg.scanGroup);
+    ASSERT_EQ(rxMsg.flags, msg.flags);
+    ASSERT_EQ(rxMsg.threshold, msg.threshold);
+    ASSERT_EQ(rxMsg.timeoutCycles, msg.timeoutCycles);
+}
+
+TEST_F(MessagesTest, FeedbackLoopRoundTrip) {
+    FeedbackLoopMsg msg;
+    msg.loop = 2;
+    msg.mode = 2;
+    msg.baseline = 128;
+    msg.driveGroupA = 4;
+    msg.driveGroupB = 5;
+    msg.flags = FeedbackLoopMsg::ParameterGainsFlag;
+    msg.target = 3.5;
+    msg.measureGroupsPMask = 0x80000001;
+    msg.measureGroupsNMask = 0x00010000;
+    msg.kp = 12.5;
+    msg.ki = 0.25;
+    msg.kd = -1.0;
+
+    msg.serialize(serializer);
+    parseData();
+
+    ASSERT_EQ(returnLength, 31);
+    FeedbackLoopMsg rxMsg;
+    ASSERT_TRUE(rxMsg.fill(returnBuf, returnLength));
+    ASSERT_EQ(rxMsg.loop, msg.loop);
+    ASSERT_EQ(rxMsg.mode, msg.mode);
+    ASSERT_EQ(rxMsg.baseline, msg.baseline);
+    ASSERT_EQ(rxMsg.driveGroupA, msg.driveGroupA);
+    ASSERT_EQ(rxMsg.driveGroupB, msg.driveGroupB);
+    ASSERT_EQ(rxMsg.flags, msg.flags);
+    ASSERT_EQ(rxMsg.target, msg.target);
+    ASSERT_EQ(rxMsg.measureGroupsPMask, msg.measureGroupsPMask);
+    ASSERT_EQ(rxMsg.measureGroupsNMask, msg.measureGroupsNMask);
+    ASSERT_EQ(rxMsg.kp, msg.kp);
+    ASSERT_EQ(rxMsg.ki, msg.ki);
+    ASSERT_EQ(rxMsg.kd, msg.kd);
+}
@@ -0,0 +1,26 @@
+#include "gtest/gtest.h"
+
+#include "SampleReduction.hpp"
+
+TEST(SampleReductionTest, MeanOfAllReadings) {
+    uint16_t samples[] = {10, 20, 30, 40};
+    ASSERT_EQ(reduceSamples(samples, 4, SampleReduction::Mean), 25);
+    ASSERT_EQ(reduceSamples(samples, 1, SampleReduction::Mean), 10);
+}
+
+TEST(SampleReductionTest, Median3RejectsOneOutlierPerGroup) {
+    uint16_t samples[] = {100, 4095, 102, 0, 98, 100, 7};
+    // Medians 102 and 98; the seventh reading is ignored
+    ASSERT_EQ(reduceSamples(samples, 7, SampleReduction::Median3), 100);
+}
+
+TEST(SampleReductionTest, TrimmedMeanDropsExtremes) {
+    uint16_t samples[] = {100, 4095, 104, 0, 96};
+    ASSERT_EQ(reduceSamples(samples, 5, SampleReduction::TrimmedMean), 100);
+}
+
+TEST(SampleReductionTest, FallsBackToMeanWithFewReadings) {
+    uint16_t samples[] = {10, 20};
+    ASSERT_EQ(reduceSamples(samples, 2, SampleReduction::Median3), 15);
+    ASSERT_EQ(reduceSamples(samples, 2, SampleReduction::TrimmedMean), 15);
+}
@@ -0,0 +1,33 @@
+#include "gtest/gtest.h"
+
+#include "SampleRing.hpp"
+
+TEST(SampleRingTest, SumsReadingsSinceLastTake) {
+    SampleRing<int16_t, 8> ring;
+    int32_t sum;
+    ASSERT_EQ(ring.takeSum(sum), 0u);
+    ASSERT_EQ(sum, 0);
+
+    ring.push(10);
+    ring.push(-4);
+    ring.push(7);
+    ASSERT_EQ(ring.takeSum(sum), 3u);
+    ASSERT_EQ(sum, 13);
+    ASSERT_EQ(ring.takeSum(sum), 0u);
+
+    ring.push(5);
+    ASSERT_EQ(ring.takeSum(sum), 1u);
+    ASSERT_EQ(sum, 5);
+}
+
+TEST(SampleRingTest, TakesOnlyNewestHalfAfterOverrun) {
+    SampleRing<int16_t, 8> ring;
+    int32_t sum;
+    for(int16_t i=1; i<=20; i++) {
+        ring.push(i);
+    }
+    // 17 + 18 + 19 + 20
+    ASSERT_EQ(ring.takeSum(sum), 4u);
+    ASSERT_EQ(sum, 74);
+    ASSERT_EQ(ring.takeSum(sum), 0u);
+}
@@ -0,0 +1,49 @@
+#include "gtest/gtest.h"
+#include "ScanBuffer.hpp"
+
+typedef ScanBuffer<4> TestBuffer;
+
+static void writeScan(TestBuffer &buffer, uint32_t sequence) {
+    auto &frame = buffer.back();
+    frame.sequence = sequence;
+    frame.timestamp = sequence * 1000;
+    for(uint32_t i=0; i<4; i++) {
+        frame.values[i] = sequence * 10 + i;
+    }
+    buffer.commit();
+}
+
+TEST(ScanBuffer, initially_empty) {
+    TestBuffer buffer;
+    auto &frame = buffer.acquire();
+    ASSERT_EQ(frame.sequence, 0u);
+    ASSERT_EQ(frame.values[0], 0);
+}
+
+TEST(ScanBuffer, acquire_returns_latest_scan) {
+    TestBuffer buffer;
+    writeScan(buffer, 1);
+    ASSERT_EQ(buffer.acquire().sequence, 1u);
+    writeScan(buffer, 2);
+    writeScan(buffer, 3);
+    auto &frame = buffer.acquire();
+    ASSERT_EQ(frame.sequence, 3u);
+    ASSERT_EQ(frame.timestamp, 3000u);
+    ASSERT_EQ(frame.values[2], 32);
+    // Nothing new; same frame again
+    ASSERT_EQ(&buffer.acquire(), &frame);
+}
+
+TEST(ScanBuffer, acquired_frame_is_not_overwritten) {
+    TestBuffer buffer;
+    writeScan(buffer, 1);
+    auto &frame = buffer.acquire();
+    for(uint32_t seq=2; seq<10; seq++) {
+        writeScan(buffer, seq);
+        ASSERT_EQ(frame.sequence, 1u);
+        for(uint32_t i=0; i<4; i++) {
+            ASSERT_EQ(frame.values[i], 10 + i);
+        }
+    }
+    ASSERT_EQ(buffer.acquire().sequence, 9u);
+}
@@ -0,0 +1,69 @@
+#pragma once
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+
+/** Minimal host benchmark harness
+ *
+ * Benchmarks are registered with the BENCHMARK macro, and are passed the
+ * number of iterations to run. The runner increases the iteration count until
+ * the benchmark runs long enough to time, and reports the cost per iteration.
+ *
+ * Benchmarks which measure something other than host CPU time (e.g. virtual
+ * time in the simulation) can report it with `bench::report`.
+ */
+namespace bench {
+
+typedef void (*BenchFn)(uint64_t iterations);
+
+struct Benchmark {
+    const char *name;
+    BenchFn fn;
+};
+
+inline std::vector<Benchmark> &registry() {
+    static std::vector<Benchmark> benchmarks;
+    return benchmarks;
+}
+
+struct Registrar {
+    Registrar(const char *name, BenchFn fn) {
+        registry().push_back({name, fn});
+    }
+};
+
+/** Prevent the compiler from discarding a computed value */
+template<typename T>
+inline void doNotOptimize(T const &value) {
+    asm volatile("" : : "r,m"(value) : "memory");
+}
+
+struct Metric {
+    const char *name;
+    double value;
+    const char *units;
+};
+
+inline std::vector<Metric> &metrics() {
+    static std::vector<Metric> results;
+    return results;
+}
+
+/** Report an additional named result for the running benchmark
+ *
+ * Only the results from the final (longest) run are printed.
+ */
+inline void report(const char *metric, double value, const char *units) {
+    metrics().push_back({metric, value, units});
+}
+
+inline void printMetric(const Metric &m) {
+    printf("    %-34s %12.2f %s\n", m.name, m.value, m.units);
+}
+
+} // namespace bench
+
+#define BENCHMARK(name) \
+    static void name(uint64_t iterations); \
+    static bench::Registrar name##_registrar(#name, name); \
+    static void name(uint64_t iterations)
@@ -0,0 +1,137 @@
+/** Measures latency from completion of a full capacitance scan to its arrival
+ * at the host, with the scan sent as one CapScanMsg, and with the paced
+ * BulkCapacitanceMsg chunks.
+ *
+ * Runs electrodes and comms in the simulation, with a sliced scan so that
+ * scans complete frequently. The USB link is modelled as a fixed byte rate,
+ * and the host parses messages as bytes arrive. Each iteration is 100ms of
+ * virtual time.
+ */
+#include <algorithm>
+#include <map>
+
+#include "Bench.hpp"
+#include "Simulator.hpp"
+
+#include "Comms.hpp"
+#include "Events.hpp"
+
+using namespace sim;
+
+namespace {
+
+// Roughly the throughput of USB full speed CDC
+const uint64_t USB_NS_PER_BYTE = 1000;
+
+// Parses the messages Comms sends in this setup
+struct HostMessages {
+    static const uint32_t MAX_SIZE = Messages::MAX_SIZE;
+
+    static int predictSize(uint8_t *buf, uint32_t length) {
+        if(length >= 1 && buf[0] == ActiveCapacitanceMsg::ID) {
+            return 6;
+        }
+        return Messages::predictSize(buf, length);
+    }
+};
+
+struct LatencyStats {
+    uint32_t count = 0;
+    double sum = 0;
+    double max = 0;
+
+    void push(double x) {
+        count++;
+        sum += x;
+        max = std::max(max, x);
+    }
+};
+
+LatencyStats runScanLatency(uint64_t iterations, bool paced) {
+    Board::reset();
+    modm::platform::UsbUart0::reset();
+    AppConfig::init();
+    AppConfig::optionValues[ScanSliceSizeId].i32 = 16;
+    // Sweep continuously
+    AppConfig::optionValues[ScanPeriodId].i32 = 1;
+    AppConfig::optionValues[PacedScanTxId].i32 = paced;
+
+    EventEx::EventBroker broker;
+    ElectrodesImpl electrodes;
+    Comms comms;
+
+    // Completion time of each scan, keyed by the sequence number as sent on
+    // the wire
+    std::map<uint16_t, uint64_t> completedAt;
+    EventHandlerFunction<events::CapScan> scanHandler([&](auto &e) {
+        completedAt[(uint16_t)e.sequence] = (uint64_t)e.timestamp * 1000;
+    });
+    // Registered first, so it sees the scan before Comms sends it
+    broker.registerHandler(&scanHandler);
+
+    electrodes.init<SystemClock>(&broker);
+    comms.init(&broker);
+
+    MessageFramer<HostMessages> framer;
+    uint64_t linkFreeAt = 0;
+    LatencyStats stats;
+    auto received = [&](uint8_t *buf, uint16_t len, uint64_t arrival) {
+        int32_t sequence = -1;
+        if(buf[0] == CapScanMsg::ID) {
+            CapScanMsg msg;
+            if(msg.fill(buf, len)) {
+                sequence = (uint16_t)msg.sequence;
+            }
+        } else if(buf[0] == BulkCapacitanceMsg::ID) {
+            BulkCapacitanceMsg msg;
+            // The scan has arrived with its last chunk
+            if(msg.fill(buf, len) && msg.groupScan == 0 &&
+                msg.startIndex + msg.count == AppConfig::N_PINS) {
+                sequence = msg.sequence;
+            }
+        }
+        auto it = completedAt.find(sequence);
+        if(sequence >= 0 && it != completedAt.end()) {
+            stats.push((arrival - it->second) / 1e6);
+            completedAt.erase(it);
+        }
+    };
+
+    Simulator<ElectrodesTimer> simulator(
+        [](){ ElectrodesImpl::timerIrqHandler(); },
+        [&](){
+            comms.poll();
+            broker.poll();
+            // Everything written so far goes out over the link in order
+            auto &tx = modm::platform::UsbUart0::tx;
+            uint64_t now = Clock::now_ns();
+            for(uint8_t b : tx) {
+                linkFreeAt = std::max(linkFreeAt, now) + USB_NS_PER_BYTE;
+                uint8_t *buf;
+                uint16_t len;
+                if(framer.push(b, buf, len)) {
+                    received(buf, len, linkFreeAt);
+                }
+            }
+            tx.clear();
+        }
+    );
+    simulator.runFor(iterations * 100000000ull);
+    return stats;
+}
+
+void reportLatency(const LatencyStats &stats) {
+    bench::report("scans received", stats.count, "");
+    bench::report("mean scan-to-host latency", stats.count ? stats.sum / stats.count : 0, "ms");
+    bench::report("max scan-to-host latency", stats.max, "ms");
+}
+
+} // namespace
+
+BENCHMARK(CapScan_latency_single_message) {
+    reportLatency(runScanLatency(iterations, false));
+}
+
+BENCHMARK(CapScan_latency_paced_chunks) {
+    reportLatency(runScanLatency(iterations, true));
+}
@@ -0,0 +1,75 @@
+/** Compares the cost of the electrode offsets subtracted during one full
+ * scan, computed per electrode in floating point as before, against a lookup
+ * in the precomputed offset table.
+ *
+ * Each iteration is one scan: an offset for every electrode, alternating
+ * between gain settings.
+ */
+#include "Bench.hpp"
+
+#include "AppConfig.hpp"
+
+namespace {
+
+struct Calibration {
+    float voltage;
+    uint16_t offsets[AppConfig::N_PINS];
+};
+
+Calibration makeCalibration() {
+    Calibration cal;
+    cal.voltage = 100.0f;
+    for(uint32_t i=0; i<AppConfig::N_PINS; i++) {
+        cal.offsets[i] = 20 + (i * 7) % 50;
+    }
+    return cal;
+}
+
+// The previous Electrodes::electrodeOffset
+uint16_t legacyElectrodeOffset(const Calibration &cal, uint16_t pin, bool low_gain) {
+    float x = cal.offsets[pin] * AppConfig::HvControlTarget() / cal.voltage;
+    if(low_gain) {
+        x *= AppConfig::LowGainR() / AppConfig::HighGainR();
+    }
+    return x;
+}
+
+} // namespace
+
+BENCHMARK(ElectrodeOffset_scan_float) {
+    AppConfig::init();
+    static Calibration cal = makeCalibration();
+    for(uint64_t i=0; i<iterations; i++) {
+        uint32_t sum = 0;
+        for(uint32_t pin=0; pin<AppConfig::N_PINS; pin++) {
+            sum += legacyElectrodeOffset(cal, pin, pin & 1);
+        }
+        bench::doNotOptimize(sum);
+        // The parameters may change between scans
+        bench::doNotOptimize(AppConfig::optionValues);
+    }
+}
+
+BENCHMARK(ElectrodeOffset_scan_table) {
+    AppConfig::init();
+    static Calibration cal = makeCalibration();
+    static uint16_t table[2][AppConfig::N_PINS];
+    float high = AppConfig::HvControlTarget() / cal.voltage;
+    uint32_t scale[2] = {
+        (uint32_t)(high * 65536.0f),
+        (uint32_t)(high * AppConfig::LowGainR() / AppConfig::HighGainR() * 65536.0f),
+    };
+    for(uint32_t gain=0; gain<2; gain++) {
+        for(uint32_t pin=0; pin<AppConfig::N_PINS; pin++) {
+            table[gain][pin] = ((uint64_t)cal.offsets[pin] * scale[gain]) >> 16;
+        }
+    }
+    for(uint64_t i=0; i<iterations; i++) {
+        uint32_t sum = 0;
+        for(uint32_t pin=0; pin<AppConfig::N_PINS; pin++) {
+            sum += table[pin & 1][pin];
+        }
+        bench::doNotOptimize(sum);
+        bench::doNotOptimize(table);
+    }
+}
@@ -0,0 +1,178 @@
+/** Compares event dispatch cost of EventEx::EventBroker against the previous
+ * implementation, which kept all handlers in one list and matched each one
+ * on typeid before dispatching through dynamic_cast.
+ */
+#include <functional>
+#include <typeinfo>
+
+#include "Bench.hpp"
+#include "EventEx.hpp"
+
+namespace LegacyEventEx {
+
+struct Event {};
+
+struct Registerable {
+    struct Owner {
+        virtual void remove(Registerable *) = 0;
+    };
+    Registerable() : mOwner(nullptr) {}
+    ~Registerable() { unregister(); }
+    void unregister() {
+        if(mOwner) {
+            mOwner->remove(this);
+            mOwner = nullptr;
+        }
+    }
+protected:
+    Registerable *mNext;
+    Owner *mOwner;
+    std::type_info *mEventTypeId;
+    friend class RegistrationList;
+    friend class EventBroker;
+};
+
+template <typename T>
+struct EventHandler : public Registerable {
+    virtual void operator ()(T &event) = 0;
+    void dispatch(Event &event) {
+        (*this)(dynamic_cast<T &>(event));
+    }
+};
+
+template <typename T>
+struct EventHandlerFunction : public EventHandler<T> {
+    EventHandlerFunction(std::function<void(T &)> f) : mFunc(f) {}
+    void operator()(T &event) override { mFunc(event); }
+private:
+    std::function<void(T &)> mFunc;
+};
+
+struct RegistrationList : public Registerable::Owner {
+    struct iter {
+        iter(Registerable *p) : mItem(p) {}
+        Registerable & operator*() { return *mItem; }
+        bool operator!=(const iter &rhs) { return mItem != rhs.mItem; }
+        iter & operator++() { mItem = mItem->mNext; return *this; }
+    private:
+        Registerable *mItem;
+    };
+    RegistrationList() : mTop(nullptr) {}
+    iter begin() { return iter(mTop); }
+    iter end() { return iter(nullptr); }
+    void push_back(Registerable *r) {
+        r->mNext = nullptr;
+        if(mTop == nullptr) {
+            mTop = r;
+        } else {
+            Registerable *p = mTop;
+            while(p->mNext != nullptr) {
+                p = p->mNext;
+            }
+            p->mNext = r;
+        }
+    }
+    void remove(Registerable *r) {
+        if(mTop == r) {
+            mTop = r->mNext;
+        } else {
+            Registerable *p = mTop;
+            while(p->mNext != r && p->mNext != nullptr) {
+                p = p->mNext;
+            }
+            if(p->mNext == r) {
+                p->mNext = r->mNext;
+            }
+        }
+    }
+private:
+    Registerable *mTop;
+};
+
+struct EventBroker {
+    template<typename T>
+    void publish(T &event) {
+        for(auto &handler : mEvents) {
+            if(*handler.mEventTypeId == typeid(event)) {
+                static_cast<EventHandler<Event>*>(&handler)->dispatch(event);
+            }
+        }
+    }
+    template<typename T>
+    void registerHandler(EventHandler<T> *handler) {
+        handler->mOwner = &mEvents;
+        handler->mEventTypeId = const_cast<std::type_info*>(&typeid(T));
+        mEvents.push_back(handler);
+    }
+private:
+    RegistrationList mEvents;
+};
+
+} // namespace LegacyEventEx
+
+// Usable with either broker
+template<int N>
+struct BenchEvent : public EventEx::Event, public LegacyEventEx::Event {
+    uint32_t value = 0;
+};
+
+static uint32_t sink;
+
+// Populate a broker the way the application does: ~20 handlers spread over
+// a dozen event types, with the published event's two subscribers registered
+// among the last.
+template<typename Broker, template<typename> class Handler>
+struct BrokerFixture {
+    template<int N>
+    using H = Handler<BenchEvent<N>>;
+
+    BrokerFixture() :
+        h1([](auto &e){ sink += e.value; }), h2([](auto &e){ sink += e.value; }),
+        h3([](auto &e){ sink += e.value; }), h4([](auto &e){ sink += e.value; }),
+        h5([](auto &e){ sink += e.value; }), h6([](auto &e){ sink += e.value; }),
+        h7([](auto &e){ sink += e.value; }), h8([](auto &e){ sink += e.value; }),
+        h9([](auto &e){ sink += e.value; }), h10([](auto &e){ sink += e.value; }),
+        h11([](auto &e){ sink += e.value; }), h12([](auto &e){ sink += e.value; }),
+        h13([](auto &e){ sink += e.value; }), h14([](auto &e){ sink += e.value; }),
+        h15([](auto &e){ sink += e.value; }), h16([](auto &e){ sink += e.value; }),
+        h17([](auto &e){ sink += e.value; }), h18([](auto &e){ sink += e.value; }),
+        target1([](auto &e){ sink += e.value; }), target2([](auto &e){ sink += e.value; })
+    {
+        broker.registerHandler(&h1); broker.registerHandler(&h2);
+        broker.registerHandler(&h3); broker.registerHandler(&h4);
+        broker.registerHandler(&h5); broker.registerHandler(&h6);
+        broker.registerHandler(&h7); broker.registerHandler(&h8);
+        broker.registerHandler(&h9); broker.registerHandler(&h10);
+        broker.registerHandler(&h11); broker.registerHandler(&h12);
+        broker.registerHandler(&h13); broker.registerHandler(&h14);
+        broker.registerHandler(&h15); broker.registerHandler(&target1);
+        broker.registerHandler(&h16); broker.registerHandler(&h17);
+        broker.registerHandler(&target2); broker.registerHandler(&h18);
+    }
+
+    Broker broker;
+    H<1> h1; H<1> h2; H<2> h3; H<3> h4; H<4> h5; H<5> h6;
+    H<6> h7; H<6> h8; H<7> h9; H<8> h10; H<9> h11; H<10> h12;
+    H<11> h13; H<11> h14; H<12> h15; H<2> h16; H<3> h17; H<4> h18;
+    H<0> target1; H<0> target2;
+};
+
+BENCHMARK(EventBroker_publish_legacy) {
+    static BrokerFixture<LegacyEventEx::EventBroker, LegacyEventEx::EventHandlerFunction> f;
+    BenchEvent<0> event;
+    for(uint64_t i=0; i<iterations; i++) {
+        event.value = i;
+        f.broker.publish(event);
+    }
+    bench::doNotOptimize(sink);
+}
+
+BENCHMARK(EventBroker_publish) {
+    static BrokerFixture<EventEx::EventBroker, EventEx::EventHandlerFunction> f;
+    BenchEvent<0> event;
+    for(uint64_t i=0; i<iterations; i++) {
+        event.value = i;
+        f.broker.publish(event);
+    }
+    bench::doNotOptimize(sink);
+}
@@ -0,0 +1,131 @@
+/** Compares the cost of one feedback controller update on a group scan:
+ * the previous computation, which converted each group to pF with gains
+ * read from AppConfig, against the cached coefficients of FloatPid and
+ * FixedPid.
+ *
+ * Each iteration is one update with two positive and one negative input
+ * group, as in differential mode.
+ */
+#include "Bench.hpp"
+
+#include "AppConfig.hpp"
+#include "FeedbackPid.hpp"
+
+namespace {
+
+const uint32_t N_GROUPS = 8;
+const uint8_t P_MASK = 0x3;
+const uint8_t N_MASK = 0x4;
+const float TARGET = 4.0;
+const float INTEGRAL_MAX = 100.0;
+
+struct Scan {
+    uint16_t measurements[N_GROUPS];
+    uint8_t settings[N_GROUPS];
+};
+
+Scan makeScan(uint64_t i) {
+    Scan scan;
+    for(uint32_t ch=0; ch<N_GROUPS; ch++) {
+        scan.measurements[ch] = 150 + (i * 13 + ch * 7) % 100;
+        scan.settings[ch] = ch == 1;
+    }
+    return scan;
+}
+
+void setGains() {
+    AppConfig::init();
+    AppConfig::optionValues[FeedbackGainPId].f32 = 12.0;
+    AppConfig::optionValues[FeedbackGainIId].f32 = 0.2;
+    AppConfig::optionValues[FeedbackGainDId].f32 = 3.0;
+}
+
+// The previous FeedbackControl::HandleCapGroups
+struct LegacyPid {
+    float mIntegral = 0;
+    float mLastError = 0;
+
+    int16_t update(const Scan &scan) {
+        float x = 0.0;
+        float kp = AppConfig::FeedbackKp();
+        float ki = AppConfig::FeedbackKi();
+        float kd = AppConfig::FeedbackKd();
+        for(uint32_t ch=0; ch<N_GROUPS; ch++) {
+            float gain = AppConfig::CapAmplifierGain() * AppConfig::HvControlTarget() * 1e-12 * 4096 / 3.3;
+            if(scan.settings[ch] & 1) {
+                gain *= AppConfig::LowGainR();
+            } else {
+                gain *= AppConfig::HighGainR();
+            }
+            if(P_MASK & (1<<ch)) {
+                x += scan.measurements[ch] / gain;
+            }
+            if(N_MASK & (1<<ch)) {
+                x -= scan.measurements[ch] / gain;
+            }
+        }
+        float error = TARGET - x;
+        mIntegral += error * ki;
+        if(mIntegral * ki > INTEGRAL_MAX) {
+            mIntegral = INTEGRAL_MAX / ki;
+        } else if(mIntegral * ki < -INTEGRAL_MAX) {
+            mIntegral = -INTEGRAL_MAX / ki;
+        }
+        int16_t feedback = (int16_t)(error * kp + mIntegral * ki + (error - mLastError) * kd);
+        mLastError = error;
+        return feedback;
+    }
+};
+
+// The update in FeedbackControl, with coefficients computed up front
+template<class Pid>
+struct CachedPid {
+    Pid pid;
+    typename Pid::Coefficient scale[2];
+    typename Pid::Value target;
+
+    CachedPid() {
+        float gain = AppConfig::CapAmplifierGain() * AppConfig::HvControlTarget() * 1e-12f * 4096 / 3.3f;
+        scale[0] = Pid::inputCoefficient(1.0f / (gain * AppConfig::HighGainR()));
+        scale[1] = Pid::inputCoefficient(1.0f / (gain * AppConfig::LowGainR()));
+        target = Pid::fromFloat(TARGET);
+        pid.setGains(AppConfig::FeedbackKp(), AppConfig::FeedbackKi(), AppConfig::FeedbackKd(), INTEGRAL_MAX);
+    }
+
+    int16_t update(const Scan &scan) {
+        typename Pid::Accumulator x = 0;
+        x += Pid::scale(scale[scan.settings[0] & 1], scan.measurements[0]);
+        x += Pid::scale(scale[scan.settings[1] & 1], scan.measurements[1]);
+        x -= Pid::scale(scale[scan.settings[2] & 1], scan.measurements[2]);
+        return pid.update(Pid::value(target - x));
+    }
+};
+
+template<class Controller>
+void runUpdates(uint64_t iterations) {
+    setGains();
+    Controller controller;
+    static Scan scans[16];
+    for(uint32_t i=0; i<16; i++) {
+        scans[i] = makeScan(i);
+    }
+    for(uint64_t i=0; i<iterations; i++) {
+        int16_t out = controller.update(scans[i % 16]);
+        bench::doNotOptimize(out);
+        bench::doNotOptimize(AppConfig::optionValues);
+    }
+}
+
+} // namespace
+
+BENCHMARK(FeedbackPid_update_legacy) {
+    runUpdates<LegacyPid>(iterations);
+}
+
+BENCHMARK(FeedbackPid_update_cached_float) {
+    runUpdates<CachedPid<FloatPid>>(iterations);
+}
+
+BENCHMARK(FeedbackPid_update_fixed_point) {
+    runUpdates<CachedPid<FixedPid>>(iterations);
+}
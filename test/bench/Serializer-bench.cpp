@@ -0,0 +1,78 @@
+/** Compares the cost of sending messages through the framed TusbTx sinks
+ * against the previous byte-at-a-time path, which passed every escaped byte
+ * through IProducer::push to UsbUart0::write.
+ */
+#include "Bench.hpp"
+
+#include "Comms.hpp"
+#include "Messages.hpp"
+
+namespace {
+
+struct LegacyTusbTxSink : IProducer<uint8_t> {
+    bool push(uint8_t b) {
+        return modm::platform::UsbUart0::write(b);
+    }
+};
+
+BulkCapacitanceMsg makeBulkMsg() {
+    BulkCapacitanceMsg msg;
+    msg.groupScan = 0;
+    msg.startIndex = 0;
+    msg.count = BulkCapacitanceMsg::MAX_VALUES;
+    msg.sequence = 1;
+    for(uint32_t i=0; i<msg.count; i++) {
+        msg.values[i] = 1000 + i * 37;
+    }
+    return msg;
+}
+
+ActiveCapacitanceMsg makeActiveMsg() {
+    ActiveCapacitanceMsg msg;
+    msg.baseline = 412;
+    msg.measurement = 2210;
+    msg.settings = 0;
+    return msg;
+}
+
+template<typename Msg, typename Sink>
+void sendMessages(uint64_t iterations, Msg msg, Sink *sink) {
+    modm::platform::UsbUart0::reset();
+    Serializer ser(sink);
+    uint64_t bytes = 0;
+    for(uint64_t i=0; i<iterations; i++) {
+        msg.serialize(ser);
+        // Stand in for the host reading the data
+        if((i & 0xff) == 0xff) {
+            bytes += modm::platform::UsbUart0::tx.size();
+            modm::platform::UsbUart0::tx.clear();
+        }
+    }
+    bytes += modm::platform::UsbUart0::tx.size();
+    modm::platform::UsbUart0::reset();
+    bench::report("bytes per message", (double)bytes / iterations, "B");
+}
+
+} // namespace
+
+BENCHMARK(Serializer_BulkCapacitanceMsg_legacy) {
+    LegacyTusbTxSink sink;
+    sendMessages(iterations, makeBulkMsg(), &sink);
+}
+
+BENCHMARK(Serializer_BulkCapacitanceMsg) {
+    static TusbTx tx;
+    static TusbTx::Sink sink(&tx, TxClass::Bulk);
+    sendMessages(iterations, makeBulkMsg(), &sink);
+}
+
+BENCHMARK(Serializer_ActiveCapacitanceMsg_legacy) {
+    LegacyTusbTxSink sink;
+    sendMessages(iterations, makeActiveMsg(), &sink);
+}
+
+BENCHMARK(Serializer_ActiveCapacitanceMsg) {
+    static TusbTx tx;
+    static TusbTx::Sink sink(&tx, TxClass::Telemetry, ActiveCapacitanceSlot);
+    sendMessages(iterations, makeActiveMsg(), &sink);
+}
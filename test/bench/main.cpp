@@ -0,0 +1,49 @@
+/** Runs the host benchmarks
+ *
+ * Usage: PurpleDropBench [--filter substring] [--min-time-ms N]
+ */
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+
+#include "Bench.hpp"
+
+int main(int argc, char **argv) {
+    const char *filter = nullptr;
+    double min_time_ms = 200;
+    for(int i=1; i<argc; i++) {
+        if(strcmp(argv[i], "--filter") == 0 && i + 1 < argc) {
+            filter = argv[++i];
+        } else if(strcmp(argv[i], "--min-time-ms") == 0 && i + 1 < argc) {
+            min_time_ms = atof(argv[++i]);
+        } else {
+            printf("Usage: %s [--filter substring] [--min-time-ms N]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    for(auto &b : bench::registry()) {
+        if(filter && strstr(b.name, filter) == nullptr) {
+            continue;
+        }
+        printf("%s\n", b.name);
+        uint64_t iterations = 1;
+        double elapsed_ms = 0;
+        while(true) {
+            bench::metrics().clear();
+            auto start = std::chrono::steady_clock::now();
+            b.fn(iterations);
+            auto end = std::chrono::steady_clock::now();
+            elapsed_ms = std::chrono::duration<double, std::milli>(end - start).count();
+            if(elapsed_ms >= min_time_ms || iterations >= (1ull << 40)) {
+                break;
+            }
+            iterations *= elapsed_ms < min_time_ms / 10 ? 10 : 2;
+        }
+        bench::printMetric({"time per iteration", elapsed_ms * 1e6 / iterations, "ns"});
+        for(auto &m : bench::metrics()) {
+            bench::printMetric(m);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,167 @@
+/** Host simulation of the PurpleDrop electrode drive and sensing
+ *
+ * Runs the shared application modules against simulated hardware for a fixed
+ * span of virtual time, then reports drive timing and measurement throughput.
+ * Optionally writes a pin-level trace in VCD format.
+ *
+ * Usage: PurpleDropSim [--duration-ms N] [--scan-slice N] [--scan-period N] [--vcd trace.vcd]
+ */
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+
+#include "Simulator.hpp"
+
+#include "Comms.hpp"
+#include "Events.hpp"
+#include "FeedbackControl.hpp"
+#include "HvRegulator.hpp"
+
+using namespace sim;
+
+struct Stats {
+    uint32_t count = 0;
+    double sum = 0;
+    double min = 1e99;
+    double max = 0;
+
+    void push(double x) {
+        count++;
+        sum += x;
+        min = std::min(min, x);
+        max = std::max(max, x);
+    }
+
+    void print(const char *name, const char *units) {
+        if(count == 0) {
+            printf("%-22s: no samples\n", name);
+            return;
+        }
+        printf("%-22s: n=%u min=%.1f mean=%.1f max=%.1f %s\n",
+            name, count, min, sum / count, max, units);
+    }
+};
+
+int main(int argc, char **argv) {
+    uint32_t duration_ms = 1000;
+    const char *vcd_path = nullptr;
+    int32_t scan_slice = -1;
+    int32_t scan_period = -1;
+    for(int i=1; i<argc; i++) {
+        if(strcmp(argv[i], "--duration-ms") == 0 && i + 1 < argc) {
+            duration_ms = atoi(argv[++i]);
+        } else if(strcmp(argv[i], "--scan-slice") == 0 && i + 1 < argc) {
+            scan_slice = atoi(argv[++i]);
+        } else if(strcmp(argv[i], "--scan-period") == 0 && i + 1 < argc) {
+            scan_period = atoi(argv[++i]);
+        } else if(strcmp(argv[i], "--vcd") == 0 && i + 1 < argc) {
+            vcd_path = argv[++i];
+        } else {
+            printf("Usage: %s [--duration-ms N] [--scan-slice N] [--scan-period N] [--vcd trace.vcd]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    Board::reset();
+    modm::platform::UsbUart0::reset();
+    AppConfig::init();
+    if(scan_slice >= 0) {
+        AppConfig::optionValues[ScanSliceSizeId].i32 = scan_slice;
+    }
+    if(scan_period >= 0) {
+        AppConfig::optionValues[ScanPeriodId].i32 = scan_period;
+    }
+    Board::hvVoltage = AppConfig::HvControlTarget();
+
+    EventEx::EventBroker broker;
+    ElectrodesImpl electrodes;
+    Comms comms;
+    FeedbackControl feedbackControl;
+    HvRegulator<SimDac, AnalogImpl> hvRegulator;
+
+    uint32_t nActive = 0, nScan = 0, nGroups = 0;
+    EventHandlerFunction<events::CapActive> activeHandler([&](auto &) { nActive++; });
+    EventHandlerFunction<events::CapScan> scanHandler([&](auto &) { nScan++; });
+    EventHandlerFunction<events::CapGroups> groupsHandler([&](auto &) { nGroups++; });
+    broker.registerHandler(&activeHandler);
+    broker.registerHandler(&scanHandler);
+    broker.registerHandler(&groupsHandler);
+
+    electrodes.setGroupScanController([&](auto &e, auto &dutyCycles) {
+        return feedbackControl.updateFromIsr(e, dutyCycles);
+    });
+    electrodes.init<SystemClock>(&broker);
+    feedbackControl.init(&broker);
+    hvRegulator.init(&broker);
+    comms.init(&broker);
+
+    // A droplet sitting over electrodes 10 and 11, with 10 driven and a scan
+    // group covering both
+    Board::hv507.capacitance[10] = 20.0;
+    Board::hv507.capacitance[11] = 20.0;
+    events::SetElectrodes drive;
+    drive.groupID = 0;
+    drive.setting = 255;
+    memset(drive.values, 0, sizeof(drive.values));
+    drive.values[1] = 0x04;
+    broker.publish(drive);
+    events::SetElectrodes group = drive;
+    group.groupID = 100;
+    group.setting = 0;
+    group.values[1] = 0x0C;
+    broker.publish(group);
+
+    Simulator<ElectrodesTimer> simulator(
+        [](){ ElectrodesImpl::timerIrqHandler(); },
+        [&](){
+            comms.poll();
+            hvRegulator.poll();
+            electrodes.poll();
+            feedbackControl.poll();
+            broker.poll();
+        }
+    );
+
+    uint64_t start_ns = Clock::now_ns();
+    auto wall_start = std::chrono::steady_clock::now();
+    simulator.runFor((uint64_t)duration_ms * 1000000);
+    auto wall_time = std::chrono::steady_clock::now() - wall_start;
+
+    // Each drive cycle begins with the switch to negative polarity
+    Stats cycle_period, irq_time;
+    auto cycle_starts = Board::trace.times(POL, false);
+    for(uint32_t i=1; i<cycle_starts.size(); i++) {
+        cycle_period.push((cycle_starts[i] - cycle_starts[i-1]) / 1000.0);
+    }
+    auto irq_start = Board::trace.times(IRQ, true);
+    auto irq_end = Board::trace.times(IRQ, false);
+    for(uint32_t i=0; i<irq_start.size() && i<irq_end.size(); i++) {
+        irq_time.push((irq_end[i] - irq_start[i]) / 1000.0);
+    }
+
+    double sim_s = (Clock::now_ns() - start_ns) / 1e9;
+    printf("Simulated %.3f s in %.1f ms wall time\n", sim_s,
+        std::chrono::duration<double, std::milli>(wall_time).count());
+    cycle_period.print("Drive cycle period", "us");
+    irq_time.print("IRQ duration", "us");
+    printf("%-22s: %u (%.1f/s)\n", "Active measurements", nActive, nActive / sim_s);
+    printf("%-22s: %u (%.1f/s)\n", "Group scans", nGroups, nGroups / sim_s);
+    printf("%-22s: %u (%.2f/s)\n", "Full scans", nScan, nScan / sim_s);
+    printf("%-22s: %zu\n", "USB bytes sent", modm::platform::UsbUart0::tx.size());
+
+    if(vcd_path) {
+        std::ofstream f(vcd_path);
+        Board::trace.writeVcd(f);
+        printf("Wrote %zu edges to %s\n", Board::trace.edges.size(), vcd_path);
+    }
+
+    // Sanity check for use as a CI smoke test
+    if(cycle_period.count == 0 || nActive == 0) {
+        printf("FAIL: no drive cycles were simulated\n");
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,545 @@
+#pragma once
+#include <array>
+#include <cstdint>
+#include <ostream>
+#include <vector>
+
+#include "AppConfig.hpp"
+#include "SimClock.hpp"
+
+/** Simulated PurpleDrop board hardware for host builds
+ *
+ * Provides GPIO, SPI, ADC, DAC and callback timer policies with the same
+ * static interface as the modm peripherals used on the STM32 and SAMG55, so
+ * that the lib/src templates (HV507, Analog, Electrodes, HvRegulator) can be
+ * instantiated on the host. A behavioural model of the HV507 chain and the
+ * capacitance integrator sits behind the pins, so scans return values derived
+ * from the per-electrode capacitance set by the test.
+ */
+namespace sim {
+
+enum PinId : uint8_t {
+    SCK = 0,
+    MOSI,
+    POL,
+    BL,
+    LE,
+    INT_RESET,
+    GAIN_SEL,
+    SCAN_SYNC,
+    AUGMENT_ENABLE,
+    // Pseudo-signals, recorded in the trace for timing analysis only
+    SPI_BUSY,
+    IRQ,
+    N_PIN_ID
+};
+
+static constexpr const char *PinNames[N_PIN_ID] = {
+    "SCK", "MOSI", "POL", "BL", "LE", "INT_RESET", "GAIN_SEL", "SCAN_SYNC",
+    "AUGMENT_ENABLE", "SPI_BUSY", "IRQ"
+};
+
+enum AdcChannel : uint8_t {
+    VHV_FB_P_CH = 0,
+    VHV_FB_N_CH = 1,
+    INT_VOUT_CH = 2,
+    N_ADC_CH
+};
+
+/** Pin-level trace of every output change, stamped with virtual time */
+struct Trace {
+    struct Edge {
+        uint64_t t_ns;
+        PinId pin;
+        bool value;
+    };
+
+    void record(PinId pin, bool value) {
+        recordAt(Clock::now_ns(), pin, value);
+    }
+
+    /** Record an edge which happened at `t_ns`, which may be in the past */
+    void recordAt(uint64_t t_ns, PinId pin, bool value) {
+        if(!enabled) {
+            return;
+        }
+        auto pos = edges.end();
+        while(pos != edges.begin() && (pos - 1)->t_ns > t_ns) {
+            pos--;
+        }
+        edges.insert(pos, {t_ns, pin, value});
+    }
+
+    /** Times of all transitions of `pin` to `value` */
+    std::vector<uint64_t> times(PinId pin, bool value) const {
+        std::vector<uint64_t> ret;
+        for(auto &e : edges) {
+            if(e.pin == pin && e.value == value) {
+                ret.push_back(e.t_ns);
+            }
+        }
+        return ret;
+    }
+
+    /** Write trace in Value Change Dump format, e.g. for viewing in GTKWave */
+    void writeVcd(std::ostream &os) const {
+        os << "$timescale 1ns $end\n";
+        os << "$scope module purpledrop $end\n";
+        for(uint32_t i=0; i<N_PIN_ID; i++) {
+            os << "$var wire 1 " << (char)('!' + i) << " " << PinNames[i] << " $end\n";
+        }
+        os << "$upscope $end\n$enddefinitions $end\n";
+        os << "#0\n$dumpvars\n";
+        for(uint32_t i=0; i<N_PIN_ID; i++) {
+            os << "0" << (char)('!' + i) << "\n";
+        }
+        os << "$end\n";
+        uint64_t last = 0;
+        for(auto &e : edges) {
+            if(e.t_ns != last) {
+                os << "#" << e.t_ns << "\n";
+                last = e.t_ns;
+            }
+            os << (e.value ? "1" : "0") << (char)('!' + e.pin) << "\n";
+        }
+    }
+
+    bool enabled = true;
+    std::vector<Edge> edges;
+};
+
+/** Behavioural model of the daisy-chained HV507s and capacitance front end
+ *
+ * All inputs are the levels seen by the HV507, i.e. after the opto-isolators.
+ * Shift register position k drives electrode k; bits enter at the top and the
+ * first bit loaded ends up on electrode 0.
+ *
+ * The integrator is reset while INT_RESET is high. When the outputs are
+ * unblanked with the integrator running, the charge drawn by the newly
+ * energized electrodes is added to the integrator output. The integrator also
+ * drifts at a fixed rate while running, which is the offset removed by
+ * Electrodes::calibrateOffset.
+ */
+struct Hv507Model {
+    static const uint32_t N_PINS = AppConfig::N_PINS;
+
+    void reset() {
+        shift.fill(false);
+        latch.fill(false);
+        capacitance.fill(0.0f);
+        integrated = 0;
+        integratorRunning = false;
+        integratorStart = 0;
+        lowGain = false;
+        driveNs.fill(0);
+        lastDriveUpdate = 0;
+    }
+
+    /** Accumulate the time each electrode has been driven since the last
+     * call; to be called before the latch or blanking changes */
+    void updateDriveTime(bool unblanked) {
+        uint64_t now = Clock::now_ns();
+        if(unblanked) {
+            for(uint32_t k=0; k<N_PINS; k++) {
+                if(latch[k]) {
+                    driveNs[k] += now - lastDriveUpdate;
+                }
+            }
+        }
+        lastDriveUpdate = now;
+    }
+
+    void setIntegratorRunning(bool running) {
+        if(running && !integratorRunning) {
+            integratorStart = Clock::now_ns();
+        } else if(!running) {
+            integrated = 0;
+        }
+        integratorRunning = running;
+    }
+
+    void shiftIn(bool bit) {
+        for(uint32_t k=0; k<N_PINS-1; k++) {
+            shift[k] = shift[k+1];
+        }
+        shift[N_PINS-1] = bit;
+    }
+
+    void shiftByte(uint8_t b) {
+        // Equivalent to shifting in each bit, MSB first, but in one pass
+        for(uint32_t k=0; k<N_PINS-8; k++) {
+            shift[k] = shift[k+8];
+        }
+        for(uint32_t i=0; i<8; i++) {
+            shift[N_PINS-8+i] = (b >> (7 - i)) & 1;
+        }
+    }
+
+    void onUnblank() {
+        if(!integratorRunning) {
+            return;
+        }
+        float pf = 0.0;
+        for(uint32_t k=0; k<N_PINS; k++) {
+            if(latch[k]) {
+                pf += capacitance[k];
+            }
+        }
+        float counts = pf * countsPerPf;
+        if(lowGain) {
+            counts *= AppConfig::LowGainR() / AppConfig::HighGainR();
+        }
+        integrated += (int32_t)counts;
+    }
+
+    uint16_t intVout() const {
+        int32_t v = baseline;
+        if(integratorRunning) {
+            v += integrated;
+            v += (int32_t)(driftCountsPerUs * (Clock::now_ns() - integratorStart) / 1000);
+        }
+        return v > 4095 ? 4095 : (uint16_t)v;
+    }
+
+    /** Number of electrodes which are latched on */
+    uint32_t activeCount() const {
+        uint32_t n = 0;
+        for(auto x : latch) {
+            n += x ? 1 : 0;
+        }
+        return n;
+    }
+
+    std::array<bool, N_PINS> shift;
+    std::array<bool, N_PINS> latch;
+    // Electrode capacitance in pF, set by the test
+    std::array<float, N_PINS> capacitance;
+    // Total time each electrode has been latched on and unblanked
+    std::array<uint64_t, N_PINS> driveNs;
+    uint64_t lastDriveUpdate = 0;
+    // ADC counts per pF at high gain
+    float countsPerPf = 10.0;
+    // Integrator drift, independent of load
+    float driftCountsPerUs = 2.0;
+    uint16_t baseline = 400;
+    int32_t integrated = 0;
+    bool integratorRunning = false;
+    uint64_t integratorStart = 0;
+    bool lowGain = false;
+};
+
+struct Board {
+    static void reset() {
+        Clock::reset();
+        levels.fill(false);
+        alternateFunction.fill(false);
+        trace = Trace();
+        hv507.reset();
+        hvVoltage = 0.0;
+        dacOutput = 0;
+        adcNoise = 0;
+        adcGlitchPeriod = 0;
+        adcReadings = 0;
+        noiseState = 1;
+        spiBytes = 0;
+        spiTx.clear();
+        spiTxDone = 0;
+        spiTxStart = 0;
+    }
+
+    static bool isOptoPin(PinId pin) {
+        return pin == SCK || pin == MOSI || pin == POL || pin == BL ||
+            pin == LE || pin == AUGMENT_ENABLE;
+    }
+
+    /** Level of a pin as seen by the HV507 side of the opto-isolators */
+    static bool hvLevel(PinId pin) {
+        bool level = levels[pin];
+        if(isOptoPin(pin) && AppConfig::InvertedOpto()) {
+            level = !level;
+        }
+        return level;
+    }
+
+    static void writePin(PinId pin, bool level) {
+        // Bytes from a background transfer reach the shift register first
+        updateSpi();
+        bool prevHv = hvLevel(pin);
+        if(levels[pin] != level) {
+            levels[pin] = level;
+            trace.record(pin, level);
+        }
+        bool hv = hvLevel(pin);
+        if(hv == prevHv) {
+            return;
+        }
+        if(pin == LE || pin == BL) {
+            hv507.updateDriveTime(pin == BL ? prevHv : hvLevel(BL));
+        }
+        if(pin == SCK && hv && !alternateFunction[SCK]) {
+            hv507.shiftIn(hvLevel(MOSI));
+        } else if(pin == LE && hv) {
+            hv507.latch = hv507.shift;
+        } else if(pin == BL && hv) {
+            hv507.onUnblank();
+        } else if(pin == INT_RESET) {
+            hv507.setIntegratorRunning(!hv);
+        } else if(pin == GAIN_SEL) {
+            hv507.lowGain = hv;
+        }
+    }
+
+    static void spiByte(uint8_t b) {
+        if(AppConfig::InvertedOpto()) {
+            b = ~b;
+        }
+        hv507.shiftByte(b);
+        spiBytes++;
+    }
+
+    /** Begin a background SPI transfer, taking `byteNs` per byte
+     *
+     * Models a DMA transmit: each byte is shifted in when its time has
+     * passed, so that latching early captures a partly loaded register.
+     */
+    static void startSpiTransfer(const uint8_t *tx, std::size_t length, uint64_t byteNs) {
+        updateSpi();
+        spiTx.assign(tx, tx + length);
+        spiTxDone = 0;
+        spiTxStart = Clock::now_ns();
+        spiTxByteNs = byteNs;
+        trace.record(SPI_BUSY, true);
+    }
+
+    /** Time at which the background transfer finishes */
+    static uint64_t spiTransferEnd() {
+        return spiTxStart + spiTx.size() * spiTxByteNs;
+    }
+
+    /** Shift in the bytes of the background transfer sent by now */
+    static void updateSpi() {
+        if(spiTxDone == spiTx.size()) {
+            return;
+        }
+        uint64_t now = Clock::now_ns();
+        while(spiTxDone < spiTx.size() && spiTxStart + (spiTxDone + 1) * spiTxByteNs <= now) {
+            spiByte(spiTx[spiTxDone++]);
+        }
+        if(spiTxDone == spiTx.size()) {
+            trace.recordAt(spiTransferEnd(), SPI_BUSY, false);
+        }
+    }
+
+    static uint16_t sampleChannel(uint8_t ch) {
+        // Mirrors the HV feedback divider in HvRegulator.hpp
+        const float vdivider = 6.65 / (412.0*3);
+        const float vscale = (3.3 / 4096.) / vdivider;
+        if(ch == INT_VOUT_CH) {
+            return intVoutNoise(hv507.intVout());
+        } else if(ch == VHV_FB_P_CH) {
+            return 1024 + (uint16_t)(hvVoltage / vscale);
+        } else if(ch == VHV_FB_N_CH) {
+            return 1024;
+        }
+        return 0;
+    }
+
+    /** Add the configured noise to an integrator reading */
+    static uint16_t intVoutNoise(uint16_t v) {
+        adcReadings++;
+        if(adcGlitchPeriod > 0 && adcReadings % adcGlitchPeriod == 0) {
+            return 4095;
+        }
+        if(adcNoise > 0) {
+            // Deterministic, roughly uniform noise in [-adcNoise, adcNoise]
+            noiseState = noiseState * 1103515245 + 12345;
+            int32_t n = (int32_t)((noiseState >> 16) % (2 * adcNoise + 1)) - (int32_t)adcNoise;
+            int32_t x = (int32_t)v + n;
+            return x < 0 ? 0 : (x > 4095 ? 4095 : x);
+        }
+        return v;
+    }
+
+    inline static std::array<bool, N_PIN_ID> levels;
+    inline static std::array<bool, N_PIN_ID> alternateFunction;
+    inline static Trace trace;
+    inline static Hv507Model hv507;
+    // Voltage present on the HV rail, as seen by the feedback divider
+    inline static float hvVoltage = 0.0;
+    inline static uint16_t dacOutput = 0;
+    // Integrator readings are offset by up to this many counts
+    inline static uint32_t adcNoise = 0;
+    // If non-zero, every Nth integrator reading is full scale
+    inline static uint32_t adcGlitchPeriod = 0;
+    inline static uint32_t adcReadings = 0;
+    inline static uint32_t noiseState = 1;
+    inline static uint32_t spiBytes = 0;
+    // Background transfer in progress, if spiTxDone < spiTx.size()
+    inline static std::vector<uint8_t> spiTx;
+    inline static std::size_t spiTxDone = 0;
+    inline static uint64_t spiTxStart = 0;
+    inline static uint64_t spiTxByteNs = 0;
+};
+
+template<PinId ID>
+struct SimGpio {
+    // Signals for SPI connect<>()
+    using Sck = SimGpio;
+    using Mosi = SimGpio;
+
+    static void connect() { Board::alternateFunction[ID] = true; }
+
+    static void setOutput() { Board::alternateFunction[ID] = false; }
+    static void setOutput(bool value) { setOutput(); Board::writePin(ID, value); }
+    static void setInput() {}
+    static void set() { Board::writePin(ID, true); }
+    static void set(bool value) { Board::writePin(ID, value); }
+    static void reset() { Board::writePin(ID, false); }
+    static void toggle() { Board::writePin(ID, !Board::levels[ID]); }
+    static bool read() { return Board::levels[ID]; }
+    static bool isSet() { return Board::levels[ID]; }
+};
+
+template<AdcChannel CH>
+struct SimAnalogPin {
+    static constexpr uint8_t Channel = CH;
+};
+
+struct SimSpi {
+    enum class DataOrder { MsbFirst, LsbFirst };
+    enum class DataMode { Mode0, Mode1, Mode2, Mode3 };
+
+    template<class SystemClock, uint32_t baudrate>
+    static void initialize() { sBaudrate = baudrate; }
+
+    template<class... Signals>
+    static void connect() { (Signals::connect(), ...); }
+
+    static void setDataOrder(DataOrder) {}
+    static void setDataMode(DataMode mode) { sDataMode = mode; }
+
+    static uint8_t transferBlocking(uint8_t data) {
+        waitTransfer();
+        Board::trace.record(SPI_BUSY, true);
+        Clock::advance(byteTimeNs());
+        Board::spiByte(data);
+        Board::trace.record(SPI_BUSY, false);
+        return 0;
+    }
+
+    static void transferBlocking(const uint8_t *tx, uint8_t *rx, std::size_t length) {
+        waitTransfer();
+        Board::trace.record(SPI_BUSY, true);
+        for(std::size_t i=0; i<length; i++) {
+            Clock::advance(byteTimeNs());
+            Board::spiByte(tx ? tx[i] : 0);
+            if(rx) {
+                rx[i] = 0;
+            }
+        }
+        Board::trace.record(SPI_BUSY, false);
+    }
+
+    /** Non-blocking transmit, as done with DMA on the target */
+    static void startTransfer(const uint8_t *tx, std::size_t length) {
+        Board::startSpiTransfer(tx, length, byteTimeNs());
+    }
+
+    static void waitTransfer() {
+        if(Board::spiTxDone < Board::spiTx.size()) {
+            Clock::advanceTo(Board::spiTransferEnd());
+            Board::updateSpi();
+        }
+    }
+
+    static uint64_t byteTimeNs() { return 8ull * 1000000000ull / sBaudrate; }
+
+    inline static uint32_t sBaudrate = 6000000;
+    inline static DataMode sDataMode = DataMode::Mode0;
+};
+
+struct SimAdc {
+    template<class Pin>
+    static constexpr uint8_t getPinChannel() { return Pin::Channel; }
+
+    static void setChannel(uint8_t ch) { sChannel = ch; }
+
+    static void startConversion() {
+        Clock::advance(conversionTimeNs);
+        sValue = Board::sampleChannel(sChannel);
+        sConversions++;
+        if(sChannel != INT_VOUT_CH) {
+            sHvConversions++;
+        }
+    }
+
+    static bool isConversionFinished() { return true; }
+
+    static void readBurst(uint16_t *samples, uint32_t n) {
+        for(uint32_t i=0; i<n; i++) {
+            startConversion();
+            samples[i] = sValue;
+        }
+    }
+
+    static uint16_t getValue() { return sValue; }
+
+    static uint16_t readChannel(uint8_t ch) {
+        setChannel(ch);
+        startConversion();
+        return getValue();
+    }
+
+    inline static uint64_t conversionTimeNs = 1000;
+    inline static uint8_t sChannel = 0;
+    inline static uint16_t sValue = 0;
+    inline static uint32_t sConversions = 0;
+    // Of those, readings of the HV feedback divider
+    inline static uint32_t sHvConversions = 0;
+};
+
+struct SimDac {
+    static void setOutput(uint16_t x) { Board::dacOutput = x; }
+};
+
+/** Simulated callback timer, interface matching StmCallbackTimer/SamCallbackTimer
+ *
+ * The simulator polls `pending()` to find the next interrupt time.
+ */
+template<uint32_t ID>
+struct SimCallbackTimer {
+    using CountType = uint32_t;
+    static const uint32_t TICK_FREQUENCY = 10000000;
+
+    static void init() { sArmed = false; }
+
+    static void reset() { sBase = Clock::now_ns(); }
+
+    static uint32_t time_us() { return (Clock::now_ns() - sBase) / 1000; }
+
+    static CountType time_counts() {
+        return (Clock::now_ns() - sBase) * (TICK_FREQUENCY / 1000000) / 1000;
+    }
+
+    static uint32_t tick_frequency() { return TICK_FREQUENCY; }
+
+    static void schedule(uint32_t delay_us) {
+        sDeadline = Clock::now_ns() + (uint64_t)delay_us * 1000;
+        sArmed = true;
+    }
+
+    static void irqHandler() { sArmed = false; }
+
+    static bool pending(uint64_t &deadline) {
+        deadline = sDeadline;
+        return sArmed;
+    }
+
+    inline static bool sArmed = false;
+    inline static uint64_t sBase = 0;
+    inline static uint64_t sDeadline = 0;
+};
+
+struct SystemClock {};
+
+} // namespace sim
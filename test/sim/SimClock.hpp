@@ -0,0 +1,32 @@
+#pragma once
+#include <cstdint>
+
+namespace sim {
+
+/** Virtual time base for the host simulation
+ *
+ * Simulated code executes in zero time. The clock only moves forward when the
+ * firmware calls a blocking delay, waits on a peripheral (SPI transfer, ADC
+ * conversion), or when the simulator jumps ahead to the next timer interrupt.
+ * This makes a second of drive cycles run in a few milliseconds, and makes
+ * timing measurements deterministic.
+ */
+struct Clock {
+    static inline uint64_t now_ns() { return sNow; }
+
+    static inline void advance(uint64_t ns) { sNow += ns; }
+
+    /** Move forward to `ns`; never goes backwards */
+    static inline void advanceTo(uint64_t ns) {
+        if(ns > sNow) {
+            sNow = ns;
+        }
+    }
+
+    static inline void reset() { sNow = 0; }
+
+private:
+    inline static uint64_t sNow = 0;
+};
+
+} // namespace sim
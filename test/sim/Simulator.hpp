@@ -0,0 +1,79 @@
+#pragma once
+#include <cstdint>
+#include <functional>
+
+#include "SimBoard.hpp"
+
+#include "Analog.hpp"
+#include "AppConfig.hpp"
+#include "Electrodes.hpp"
+#include "HV507.hpp"
+#include "InvertableGpio.hpp"
+
+namespace sim {
+
+struct Hv507Pins {
+    using SCK = InvertableGpio<SimGpio<PinId::SCK>>;
+    using MOSI = InvertableGpio<SimGpio<PinId::MOSI>>;
+    using POL = InvertableGpio<SimGpio<PinId::POL>>;
+    using BL = InvertableGpio<SimGpio<PinId::BL>>;
+    using LE = InvertableGpio<SimGpio<PinId::LE>>;
+    using AUGMENT_ENABLE = InvertableGpio<SimGpio<PinId::AUGMENT_ENABLE>>;
+    using INT_RESET = SimGpio<PinId::INT_RESET>;
+    using GAIN_SEL = SimGpio<PinId::GAIN_SEL>;
+    using SCAN_SYNC = SimGpio<PinId::SCAN_SYNC>;
+};
+
+using AnalogImpl = Analog<
+    SimAdc,
+    SimAnalogPin<INT_VOUT_CH>,
+    void,
+    SimAnalogPin<VHV_FB_P_CH>,
+    SimAnalogPin<VHV_FB_N_CH>>;
+
+using Hv507Impl = HV507<Hv507Pins, SimSpi, AnalogImpl>;
+// Like the STM32 build, one timer serves for both scheduling and timing
+using ElectrodesTimer = SimCallbackTimer<0>;
+using ElectrodesImpl = Electrodes<Hv507Impl, ElectrodesTimer, ElectrodesTimer>;
+
+/** Runs the electrode timer interrupt and the main loop against the virtual clock
+ *
+ * Each time the timer compare expires, the clock jumps to the compare time and
+ * the IRQ handler is invoked. The main loop function is called once after every
+ * interrupt. Any virtual time consumed by the main loop (e.g. ADC reads in
+ * HvRegulator) delays the next interrupt, as it would on the target.
+ */
+template<typename Timer>
+struct Simulator {
+    Simulator(std::function<void()> irq, std::function<void()> mainLoop) :
+        mIrq(irq), mMainLoop(mainLoop), mIrqCount(0) {}
+
+    void runFor(uint64_t duration_ns) {
+        runUntil(Clock::now_ns() + duration_ns);
+    }
+
+    void runUntil(uint64_t end_ns) {
+        uint64_t deadline;
+        while(Timer::pending(deadline) && deadline <= end_ns) {
+            Clock::advanceTo(deadline);
+            Board::trace.record(IRQ, true);
+            Timer::irqHandler();
+            mIrq();
+            mIrqCount++;
+            Board::trace.record(IRQ, false);
+            if(mMainLoop) {
+                mMainLoop();
+            }
+        }
+        Clock::advanceTo(end_ns);
+    }
+
+    uint32_t irqCount() { return mIrqCount; }
+
+private:
+    std::function<void()> mIrq;
+    std::function<void()> mMainLoop;
+    uint32_t mIrqCount;
+};
+
+} // namespace sim
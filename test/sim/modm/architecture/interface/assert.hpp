@@ -0,0 +1,18 @@
+#pragma once
+
+/** Host stand-in for modm_assert
+ *
+ * A failed assertion reports its name and description and aborts, as the
+ * default modm_abandon handler would halt the device.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+
+#define modm_assert(condition, name, description, ...) \
+    do { \
+        if(!(condition)) { \
+            std::fprintf(stderr, "Assertion '%s' failed: %s\n", name, description); \
+            std::abort(); \
+        } \
+    } while(0)
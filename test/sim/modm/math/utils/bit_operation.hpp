@@ -0,0 +1,14 @@
+#pragma once
+#include <cstdint>
+
+/** Host stand-in for the modm bit operations used by lib/src */
+namespace modm {
+
+inline uint8_t bitReverse(uint8_t n) {
+    n = (n & 0xF0) >> 4 | (n & 0x0F) << 4;
+    n = (n & 0xCC) >> 2 | (n & 0x33) << 2;
+    n = (n & 0xAA) >> 1 | (n & 0x55) << 1;
+    return n;
+}
+
+} // namespace modm
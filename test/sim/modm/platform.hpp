@@ -0,0 +1,97 @@
+#pragma once
+
+/** Host stand-in for the subset of the modm platform API used by lib/src
+ *
+ * Only what the shared application code touches is provided here. Delays and
+ * clocks are backed by the simulation's virtual clock, and the USB CDC UART is
+ * a pair of byte queues which tests can inspect and feed.
+ */
+
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <vector>
+
+#include "SimClock.hpp"
+
+namespace modm {
+
+template<class Rep, class Period>
+inline void delay(std::chrono::duration<Rep, Period> d) {
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(d).count();
+    if(ns > 0) {
+        sim::Clock::advance(ns);
+    }
+}
+
+namespace atomic {
+// There are no real interrupts on the host; the simulator never preempts.
+struct Lock {
+    Lock() {}
+    ~Lock() {}
+};
+} // namespace atomic
+
+namespace chrono {
+template<typename Duration>
+struct sim_clock {
+    using duration = Duration;
+    using rep = typename Duration::rep;
+    using period = typename Duration::period;
+    using time_point = std::chrono::time_point<sim_clock, duration>;
+    static constexpr bool is_steady = true;
+
+    static time_point now() {
+        auto t = std::chrono::nanoseconds(sim::Clock::now_ns());
+        return time_point(duration((rep)std::chrono::duration_cast<
+            std::chrono::duration<uint64_t, period>>(t).count()));
+    }
+};
+
+using micro_clock = sim_clock<std::chrono::duration<uint32_t, std::micro>>;
+using milli_clock = sim_clock<std::chrono::duration<uint32_t, std::milli>>;
+} // namespace chrono
+
+namespace literals {
+using namespace std::chrono_literals;
+} // namespace literals
+
+namespace platform {
+
+/** Simulated USB CDC serial port
+ *
+ * `txCapacity` limits how many unread bytes the host side will accept, so
+ * tests can model a host which is not keeping up.
+ */
+struct UsbUart0 {
+    static bool write(uint8_t b) {
+        if(tx.size() >= txCapacity) {
+            return false;
+        }
+        tx.push_back(b);
+        return true;
+    }
+
+    static bool read(uint8_t &b) {
+        if(rx.empty()) {
+            return false;
+        }
+        b = rx.front();
+        rx.pop_front();
+        return true;
+    }
+
+    static void reset() {
+        rx.clear();
+        tx.clear();
+        txCapacity = SIZE_MAX;
+    }
+
+    inline static std::deque<uint8_t> rx;
+    inline static std::vector<uint8_t> tx;
+    inline static size_t txCapacity = SIZE_MAX;
+};
+
+} // namespace platform
+
+} // namespace modm
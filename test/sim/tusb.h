@@ -0,0 +1,32 @@
+#pragma once
+
+/** Host stand-in for the TinyUSB CDC device API used by lib/src
+ *
+ * Writes go to the same byte queue as the simulated UsbUart0, and the
+ * available space is limited by its `txCapacity`.
+ */
+
+#include <algorithm>
+#include <cstdint>
+
+#include "modm/platform.hpp"
+
+inline uint32_t tud_cdc_write_available() {
+    using modm::platform::UsbUart0;
+    if(UsbUart0::tx.size() >= UsbUart0::txCapacity) {
+        return 0;
+    }
+    return (uint32_t)std::min<size_t>(UsbUart0::txCapacity - UsbUart0::tx.size(), UINT32_MAX);
+}
+
+inline uint32_t tud_cdc_write(const void *buffer, uint32_t bufsize) {
+    using modm::platform::UsbUart0;
+    uint32_t n = std::min(bufsize, tud_cdc_write_available());
+    const uint8_t *p = static_cast<const uint8_t*>(buffer);
+    UsbUart0::tx.insert(UsbUart0::tx.end(), p, p + n);
+    return n;
+}
+
+inline uint32_t tud_cdc_write_flush() {
+    return 0;
+}
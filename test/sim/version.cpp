@@ -0,0 +1,3 @@
+#include "version.hpp"
+
+const char *VERSION_STRING = "host-sim";